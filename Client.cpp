@@ -1,5 +0,0 @@
-#include <iostream>
-int main() {
-	std::cout "Bazooper";
-	return 0;
-}
\ No newline at end of file
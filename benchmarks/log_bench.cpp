@@ -0,0 +1,79 @@
+// The lines one unary request used to print on its way through the server,
+// written with std::cout/std::endl as before, through the async logger, and
+// through the logger with the level set above them (the production default
+// for per-request lines).
+//
+//   ps4_log_bench --benchmark_out=log_bench.json > /dev/null
+//
+// Redirect stdout to a file or /dev/null so the console is not what is
+// being measured; the report then goes to --benchmark_out.
+
+#include "logger.h"
+#include <benchmark/benchmark.h>
+#include <iostream>
+#include <string>
+
+namespace {
+
+const std::string kRequestId = "3f0b6c1e-request";
+const std::string kPeer = "ipv4:10.0.0.17:53122";
+
+void requestWithStdout(int thread_id, int64_t task_id) {
+    std::cout << "[Server] ProcessImage called. Request ID: " << kRequestId << ", Image size: " << 482113 << " bytes" << std::endl;
+    std::cout << "[Server] Task queued (accurate). Queue size: " << 3 << std::endl;
+    std::cout << "[Server] Thread " << thread_id << " received task " << task_id << " for request " << kRequestId << std::endl;
+    std::cout << "[Server] Thread " << thread_id << " processing image (attempt " << 1 << ")..." << std::endl;
+    std::cout << "[OCRProcessor] Starting image processing. Data size: " << 482113 << " bytes, format: png" << std::endl;
+    std::cout << "[OCRProcessor] Image loaded successfully. Width: " << 2480 << ", Height: " << 3508 << std::endl;
+    std::cout << "[OCRProcessor] Converted to 8-bit grayscale (avx2)" << std::endl;
+    std::cout << "[OCRProcessor] Image set to Tesseract. Starting OCR..." << std::endl;
+    std::cout << "[OCRProcessor] OCR completed in " << 812 << "ms, confidence " << 91.5f << std::endl;
+    std::cout << "[Server] Thread " << thread_id << " completed task " << task_id << " in " << 815 << "ms" << std::endl;
+}
+
+void requestWithLogger(logging::Level level, int thread_id, int64_t task_id) {
+    PS4_LOG(level) << "[Server] ProcessImage called. Request ID: " << kRequestId << ", Image size: " << 482113 << " bytes";
+    PS4_LOG(level) << "[Server] Task queued (accurate). Queue size: " << 3;
+    PS4_LOG(level) << "[Server] Thread " << thread_id << " received task " << task_id << " for request " << kRequestId;
+    PS4_LOG(level) << "[Server] Thread " << thread_id << " processing image (attempt " << 1 << ")...";
+    PS4_LOG(level) << "[OCRProcessor] Starting image processing. Data size: " << 482113 << " bytes, format: png";
+    PS4_LOG(level) << "[OCRProcessor] Image loaded successfully. Width: " << 2480 << ", Height: " << 3508;
+    PS4_LOG(level) << "[OCRProcessor] Converted to 8-bit grayscale (avx2)";
+    PS4_LOG(level) << "[OCRProcessor] Image set to Tesseract. Starting OCR...";
+    PS4_LOG(level) << "[OCRProcessor] OCR completed in " << 812 << "ms, confidence " << 91.5f;
+    PS4_LOG(level) << "[Server] Thread " << thread_id << " completed task " << task_id << " in " << 815 << "ms";
+}
+
+void BM_StdoutEndl(benchmark::State& state) {
+    int64_t task_id = 0;
+    for (auto _ : state) {
+        requestWithStdout(state.thread_index(), ++task_id);
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+
+void BM_LogEnabled(benchmark::State& state) {
+    logging::setLevel(logging::Level::Debug);
+    int64_t task_id = 0;
+    for (auto _ : state) {
+        requestWithLogger(logging::Level::Debug, state.thread_index(), ++task_id);
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+
+void BM_LogFiltered(benchmark::State& state) {
+    logging::setLevel(logging::Level::Info);
+    int64_t task_id = 0;
+    for (auto _ : state) {
+        requestWithLogger(logging::Level::Debug, state.thread_index(), ++task_id);
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+
+} // namespace
+
+BENCHMARK(BM_StdoutEndl)->ThreadRange(1, 8)->UseRealTime();
+BENCHMARK(BM_LogEnabled)->ThreadRange(1, 8)->UseRealTime();
+BENCHMARK(BM_LogFiltered)->ThreadRange(1, 8)->UseRealTime();
+
+BENCHMARK_MAIN();
\ No newline at end of file
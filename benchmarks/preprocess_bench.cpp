@@ -0,0 +1,98 @@
+// Preprocessing chain on page-sized scans: Leptonica's
+// pixConvertTo8 -> pixOpenGray -> pixCloseGray against the preprocess module
+// on each instruction set this CPU supports.
+//
+//   ps4_preprocess_bench --benchmark_counters_tabular=true
+
+#include "preprocess.h"
+#include <benchmark/benchmark.h>
+#include <leptonica/allheaders.h>
+#include <random>
+
+namespace {
+
+// Letter/A4 at 300 and 600 dpi
+constexpr int kScanSizes[][2] = {
+    { 2480, 3508 },
+    { 4960, 7016 },
+};
+
+// 32bpp scan: noisy off-white paper with rows of dark glyph-sized blobs, so
+// the morphology has real edges to work on.
+Pix* makeScan(int width, int height) {
+    Pix* pix = pixCreate(width, height, 32);
+    l_uint32* data = pixGetData(pix);
+    const l_int32 wpl = pixGetWpl(pix);
+    std::mt19937 rng(42);
+    for (int y = 0; y < height; ++y) {
+        for (int x = 0; x < width; ++x) {
+            const bool ink = (y / 40) % 2 == 0 && (x / 12) % 3 == 0 && rng() % 4 != 0;
+            const l_uint32 v = ink ? 20 + rng() % 40 : 210 + rng() % 40;
+            data[static_cast<size_t>(y) * wpl + x] = (v << 24) | (v << 16) | ((v - 10) << 8);
+        }
+    }
+    return pix;
+}
+
+void BM_Leptonica(benchmark::State& state) {
+    const int width = static_cast<int>(state.range(0));
+    const int height = static_cast<int>(state.range(1));
+    Pix* scan = makeScan(width, height);
+    for (auto _ : state) {
+        Pix* gray = pixConvertTo8(scan, false);
+        Pix* opened = pixOpenGray(gray, 3, 3);
+        Pix* closed = pixCloseGray(opened, 3, 3);
+        benchmark::DoNotOptimize(pixGetData(closed));
+        pixDestroy(&closed);
+        pixDestroy(&opened);
+        pixDestroy(&gray);
+    }
+    state.SetItemsProcessed(state.iterations() * width * height);
+    pixDestroy(&scan);
+}
+
+void BM_Preprocess(benchmark::State& state) {
+    const int width = static_cast<int>(state.range(0));
+    const int height = static_cast<int>(state.range(1));
+    const auto isa = static_cast<preprocess::Isa>(state.range(2));
+    if (isa > preprocess::detectIsa()) {
+        state.SkipWithError("instruction set not supported on this CPU");
+        return;
+    }
+    preprocess::setIsa(isa);
+    state.SetLabel(preprocess::isaName(isa));
+
+    Pix* scan = makeScan(width, height);
+    preprocess::Workspace workspace;
+    for (auto _ : state) {
+        preprocess::GrayImage gray;
+        preprocess::loadGray(scan, workspace, gray);
+        preprocess::open3x3(gray, workspace);
+        preprocess::close3x3(gray, workspace);
+        benchmark::DoNotOptimize(gray.data);
+    }
+    state.SetItemsProcessed(state.iterations() * width * height);
+    pixDestroy(&scan);
+    preprocess::setIsa(preprocess::detectIsa());
+}
+
+void scanSizes(benchmark::internal::Benchmark* b) {
+    for (const auto& size : kScanSizes) {
+        b->Args({ size[0], size[1] });
+    }
+}
+
+void scanSizesPerIsa(benchmark::internal::Benchmark* b) {
+    for (const auto& size : kScanSizes) {
+        for (auto isa : { preprocess::Isa::Scalar, preprocess::Isa::SSE41, preprocess::Isa::AVX2 }) {
+            b->Args({ size[0], size[1], static_cast<int64_t>(isa) });
+        }
+    }
+}
+
+} // namespace
+
+BENCHMARK(BM_Leptonica)->Apply(scanSizes)->Unit(benchmark::kMillisecond);
+BENCHMARK(BM_Preprocess)->Apply(scanSizesPerIsa)->Unit(benchmark::kMillisecond);
+
+BENCHMARK_MAIN();
\ No newline at end of file
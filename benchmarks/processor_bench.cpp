@@ -0,0 +1,574 @@
+// The stages of OCRProcessor::processImage one at a time, across page sizes
+// and bit depths, plus the whole call end to end:
+//
+//   decode (pixReadMem) -> pixConvertTo8 / loadGray -> pixOpenGray + pixCloseGray
+//   -> SetImage -> Recognize -> GetUTF8Text
+//
+// Besides time, every benchmark reports what it allocates per iteration,
+// counting both operator new and Leptonica's pixel buffers (through
+// setPixMemoryManager):
+//
+//   allocs   blocks allocated per iteration
+//   bytes    bytes allocated per iteration (pixel buffers included)
+//   leaked   blocks allocated and not freed, per iteration; steady state is
+//            0, and a leak of one object per image shows as 1 or more
+//   rss_kb   growth of the resident set over the whole run
+//
+// Replacing operator new only reaches code linked into this executable; with
+// Tesseract as a DLL (vcpkg on Windows), its own allocations go uncounted
+// and only the pixel buffers and RSS see them.
+//
+// BM_Ingest follows a request from the wire to pixReadMem through the
+// server's own parsing and setTaskImageBytes, and fails if the image bytes
+// are copied once parsed.
+//
+// The Tesseract stages need eng.traineddata under TESSDATA_PREFIX and are
+// skipped without it.
+//
+//   ps4_processor_bench --benchmark_filter=Decode --benchmark_counters_tabular=true
+
+#include "ocr_processor.h"
+#include "ocr_service.grpc.pb.h"
+#include "ocr_task.h"
+#include "preprocess.h"
+#include "request_allocator.h"
+#include <benchmark/benchmark.h>
+#include <leptonica/allheaders.h>
+#include <tesseract/baseapi.h>
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <deque>
+#include <map>
+#include <new>
+#include <random>
+#include <string>
+#include <tuple>
+#ifdef _WIN32
+#include <windows.h>
+#include <psapi.h>
+#else
+#include <unistd.h>
+#endif
+
+namespace {
+
+std::atomic<uint64_t> g_allocs{ 0 };
+std::atomic<uint64_t> g_frees{ 0 };
+std::atomic<uint64_t> g_bytes{ 0 };
+// Allocations of at least g_large_size bytes; off unless a benchmark sets it
+std::atomic<size_t> g_large_size{ SIZE_MAX };
+std::atomic<uint64_t> g_large{ 0 };
+
+void* countedAlloc(size_t size) {
+    void* p = std::malloc(size ? size : 1);
+    if (p) {
+        g_allocs.fetch_add(1, std::memory_order_relaxed);
+        g_bytes.fetch_add(size, std::memory_order_relaxed);
+        if (size >= g_large_size.load(std::memory_order_relaxed)) {
+            g_large.fetch_add(1, std::memory_order_relaxed);
+        }
+    }
+    return p;
+}
+
+void countedFree(void* p) {
+    if (p) {
+        g_frees.fetch_add(1, std::memory_order_relaxed);
+        std::free(p);
+    }
+}
+
+} // namespace
+
+// Everything the process allocates through new goes through the counters;
+// the aligned overloads are left alone, nothing on the hot path uses them.
+void* operator new(size_t size) {
+    if (void* p = countedAlloc(size)) {
+        return p;
+    }
+    throw std::bad_alloc();
+}
+void* operator new[](size_t size) {
+    return operator new(size);
+}
+void* operator new(size_t size, const std::nothrow_t&) noexcept {
+    return countedAlloc(size);
+}
+void* operator new[](size_t size, const std::nothrow_t&) noexcept {
+    return countedAlloc(size);
+}
+void operator delete(void* p) noexcept {
+    countedFree(p);
+}
+void operator delete[](void* p) noexcept {
+    countedFree(p);
+}
+void operator delete(void* p, size_t) noexcept {
+    countedFree(p);
+}
+void operator delete[](void* p, size_t) noexcept {
+    countedFree(p);
+}
+
+namespace {
+
+size_t residentBytes() {
+#ifdef _WIN32
+    PROCESS_MEMORY_COUNTERS counters{};
+    if (GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters))) {
+        return counters.WorkingSetSize;
+    }
+    return 0;
+#else
+    long pages = 0;
+    if (FILE* statm = std::fopen("/proc/self/statm", "r")) {
+        long size = 0;
+        if (std::fscanf(statm, "%ld %ld", &size, &pages) != 2) {
+            pages = 0;
+        }
+        std::fclose(statm);
+    }
+    return static_cast<size_t>(pages) * static_cast<size_t>(sysconf(_SC_PAGESIZE));
+#endif
+}
+
+// Allocation counters over a benchmark's timed loop; report() turns them
+// into per-iteration counters.
+class MemoryProbe {
+public:
+    MemoryProbe()
+        : allocs_(g_allocs.load()), frees_(g_frees.load()), bytes_(g_bytes.load()), rss_(residentBytes()) {}
+
+    // Runs untimed setup whose allocations should not count either.
+    template <typename F>
+    void exclude(F&& setup) {
+        const uint64_t allocs = g_allocs.load(), frees = g_frees.load(), bytes = g_bytes.load();
+        setup();
+        allocs_ += g_allocs.load() - allocs;
+        frees_ += g_frees.load() - frees;
+        bytes_ += g_bytes.load() - bytes;
+    }
+
+    void report(benchmark::State& state) const {
+        const uint64_t allocs = g_allocs.load() - allocs_;
+        const uint64_t frees = g_frees.load() - frees_;
+        const int64_t rss = static_cast<int64_t>(residentBytes()) - static_cast<int64_t>(rss_);
+        state.counters["allocs"] = benchmark::Counter(static_cast<double>(allocs), benchmark::Counter::kAvgIterations);
+        state.counters["bytes"] = benchmark::Counter(static_cast<double>(g_bytes.load() - bytes_),
+            benchmark::Counter::kAvgIterations);
+        state.counters["leaked"] = benchmark::Counter(static_cast<double>(allocs) - static_cast<double>(frees),
+            benchmark::Counter::kAvgIterations);
+        state.counters["rss_kb"] = static_cast<double>(rss / 1024);
+    }
+
+private:
+    uint64_t allocs_;
+    uint64_t frees_;
+    uint64_t bytes_;
+    size_t rss_;
+};
+
+// Letter at 150 dpi and A4 at 300 dpi
+constexpr int kPageSizes[][2] = {
+    { 1275, 1650 },
+    { 2480, 3508 },
+};
+
+enum Format { Png, Jpeg, TiffG4 };
+
+const char* formatName(int format) {
+    switch (format) {
+    case Png: return "png";
+    case Jpeg: return "jpeg";
+    case TiffG4: return "tiff-g4";
+    }
+    return "?";
+}
+
+// A page of text at the given depth, rendered once and kept for the run.
+Pix* page(int width, int height, int depth) {
+    static std::map<std::tuple<int, int, int>, Pix*> pages;
+    Pix*& pix = pages[{ width, height, depth }];
+    if (pix) {
+        return pix;
+    }
+
+    static const char* const kWords[] = {
+        "invoice", "total", "amount", "date", "customer", "order", "number", "payment", "the", "of",
+        "and", "to", "in", "shipping", "address", "quantity", "price", "tax", "balance", "due",
+    };
+    std::mt19937 rng(42);
+    std::string text;
+    for (int i = 0; i < width * height / 4000; ++i) {
+        text += kWords[rng() % std::size(kWords)];
+        text += ' ';
+    }
+    Pix* gray = pixCreate(width, height, 8);
+    pixSetAll(gray);
+    L_BMF* font = bmfCreate(nullptr, 20);
+    l_int32 overflow = 0;
+    pixSetTextblock(gray, font, text.c_str(), 0, width / 16, height / 16, width - width / 8, 0, &overflow);
+    bmfDestroy(&font);
+
+    if (depth == 1) {
+        pix = pixThresholdToBinary(gray, 128);
+        pixDestroy(&gray);
+    }
+    else if (depth == 32) {
+        pix = pixConvert8To32(gray);
+        pixDestroy(&gray);
+    }
+    else {
+        pix = gray;
+    }
+    return pix;
+}
+
+const std::string& encodedPage(int width, int height, int depth, int format) {
+    static std::map<std::tuple<int, int, int, int>, std::string> files;
+    std::string& bytes = files[{ width, height, depth, format }];
+    if (bytes.empty()) {
+        const l_int32 iff = format == Jpeg ? IFF_JFIF_JPEG : format == TiffG4 ? IFF_TIFF_G4 : IFF_PNG;
+        l_uint8* data = nullptr;
+        size_t size = 0;
+        if (pixWriteMem(&data, &size, page(width, height, depth), iff) == 0) {
+            bytes.assign(reinterpret_cast<const char*>(data), size);
+        }
+        lept_free(data);
+    }
+    return bytes;
+}
+
+// One engine for all Tesseract stages; nullptr if eng.traineddata is missing.
+tesseract::TessBaseAPI* engine() {
+    static tesseract::TessBaseAPI* api = [] {
+        auto* api = new tesseract::TessBaseAPI();
+        if (api->Init(nullptr, "eng", tesseract::OEM_LSTM_ONLY) != 0) {
+            delete api;
+            return static_cast<tesseract::TessBaseAPI*>(nullptr);
+        }
+        api->SetPageSegMode(tesseract::PSM_SINGLE_BLOCK);
+        return api;
+    }();
+    return api;
+}
+
+void label(benchmark::State& state, int depth) {
+    state.SetLabel(std::to_string(depth) + "bpp");
+}
+
+void BM_Decode(benchmark::State& state) {
+    const int width = static_cast<int>(state.range(0));
+    const int height = static_cast<int>(state.range(1));
+    const int depth = static_cast<int>(state.range(2));
+    const int format = static_cast<int>(state.range(3));
+    const std::string& bytes = encodedPage(width, height, depth, format);
+    if (bytes.empty()) {
+        state.SkipWithError("encoding the page failed");
+        return;
+    }
+    state.SetLabel(std::to_string(depth) + "bpp " + formatName(format));
+
+    MemoryProbe probe;
+    for (auto _ : state) {
+        Pix* pix = pixReadMem(reinterpret_cast<const l_uint8*>(bytes.data()), bytes.size());
+        benchmark::DoNotOptimize(pix);
+        pixDestroy(&pix);
+    }
+    probe.report(state);
+    state.SetBytesProcessed(state.iterations() * static_cast<int64_t>(bytes.size()));
+}
+
+// A ProcessImage request from its wire bytes to the decoded page: gRPC
+// parses it onto the call's arena (ArenaRequestAllocator), the task points
+// into the parsed bytes and is queued and popped by a worker, which decodes
+// them in place. Parsing takes the payload out of the transport's buffers;
+// nothing after it may copy the payload again:
+//
+//   parse_bytes     heap bytes allocated by parsing, per iteration; about
+//                   the payload
+//   arena_bytes     arena blocks allocated, per iteration
+//   payload_copies  allocations as large as the payload between parsing
+//                   and pixReadMem; the benchmark fails unless it is 0
+void BM_Ingest(benchmark::State& state) {
+    const int width = static_cast<int>(state.range(0));
+    const int height = static_cast<int>(state.range(1));
+    const int depth = static_cast<int>(state.range(2));
+    const int format = static_cast<int>(state.range(3));
+    const std::string& bytes = encodedPage(width, height, depth, format);
+    if (bytes.empty()) {
+        state.SkipWithError("encoding the page failed");
+        return;
+    }
+    state.SetLabel(std::to_string(depth) + "bpp " + formatName(format));
+
+    ocrservice::OCRRequest sent;
+    sent.set_image_data(bytes);
+    sent.set_format(formatName(format));
+    const std::string wire = sent.SerializeAsString();
+
+    ArenaRequestAllocator allocator;
+    std::deque<ImageTask> queue;
+    uint64_t parse_bytes = 0;
+    uint64_t copies = 0;
+    const uint64_t arena_bytes = ArenaRequestAllocator::stats().arena_block_bytes;
+
+    MemoryProbe probe;
+    for (auto _ : state) {
+        // As received: the transport's copy is not the server's doing
+        state.PauseTiming();
+        grpc::ByteBuffer buffer;
+        probe.exclude([&] {
+            grpc::Slice slice(wire.data(), wire.size());
+            buffer = grpc::ByteBuffer(&slice, 1);
+        });
+        state.ResumeTiming();
+
+        auto* holder = allocator.AllocateMessages();
+        const uint64_t before_parse = g_bytes.load();
+        if (!grpc::SerializationTraits<ocrservice::OCRRequest>::Deserialize(&buffer, holder->request()).ok()) {
+            holder->Release();
+            state.SkipWithError("parsing the request failed");
+            break;
+        }
+        parse_bytes += g_bytes.load() - before_parse;
+
+        const uint64_t large = g_large.load();
+        g_large_size.store(bytes.size());
+        const ocrservice::OCRRequest& request = *holder->request();
+        ImageTask task;
+        setTaskImageBytes(task, request);
+        queue.push_back(std::move(task));
+        ImageTask popped = std::move(queue.front());
+        queue.pop_front();
+        g_large_size.store(SIZE_MAX);
+        copies += g_large.load() - large;
+
+        Pix* pix = pixReadMem(popped.image_data, popped.image_size);
+        benchmark::DoNotOptimize(pix);
+        pixDestroy(&pix);
+        holder->Release();
+    }
+    probe.report(state);
+    state.counters["parse_bytes"] = benchmark::Counter(static_cast<double>(parse_bytes),
+        benchmark::Counter::kAvgIterations);
+    state.counters["arena_bytes"] = benchmark::Counter(
+        static_cast<double>(ArenaRequestAllocator::stats().arena_block_bytes - arena_bytes),
+        benchmark::Counter::kAvgIterations);
+    state.counters["payload_copies"] = benchmark::Counter(static_cast<double>(copies),
+        benchmark::Counter::kAvgIterations);
+    state.SetBytesProcessed(state.iterations() * static_cast<int64_t>(bytes.size()));
+    if (copies > 0) {
+        state.SkipWithError("the image bytes were copied after parsing");
+    }
+}
+
+void BM_ConvertTo8(benchmark::State& state) {
+    const int width = static_cast<int>(state.range(0));
+    const int height = static_cast<int>(state.range(1));
+    const int depth = static_cast<int>(state.range(2));
+    Pix* pix = page(width, height, depth);
+    label(state, depth);
+
+    MemoryProbe probe;
+    for (auto _ : state) {
+        Pix* gray = pixConvertTo8(pix, false);
+        benchmark::DoNotOptimize(pixGetData(gray));
+        pixDestroy(&gray);
+    }
+    probe.report(state);
+    state.SetItemsProcessed(state.iterations() * width * height);
+}
+
+// What the server does instead: into a reused buffer, 32bpp without Leptonica
+void BM_LoadGray(benchmark::State& state) {
+    const int width = static_cast<int>(state.range(0));
+    const int height = static_cast<int>(state.range(1));
+    const int depth = static_cast<int>(state.range(2));
+    Pix* pix = page(width, height, depth);
+    label(state, depth);
+
+    preprocess::Workspace workspace;
+    MemoryProbe probe;
+    for (auto _ : state) {
+        preprocess::GrayImage gray;
+        preprocess::loadGray(pix, workspace, gray);
+        benchmark::DoNotOptimize(gray.data);
+    }
+    probe.report(state);
+    state.SetItemsProcessed(state.iterations() * width * height);
+}
+
+void BM_OpenCloseGray(benchmark::State& state) {
+    const int width = static_cast<int>(state.range(0));
+    const int height = static_cast<int>(state.range(1));
+    Pix* gray = page(width, height, 8);
+
+    MemoryProbe probe;
+    for (auto _ : state) {
+        Pix* opened = pixOpenGray(gray, 3, 3);
+        Pix* closed = pixCloseGray(opened, 3, 3);
+        benchmark::DoNotOptimize(pixGetData(closed));
+        pixDestroy(&closed);
+        pixDestroy(&opened);
+    }
+    probe.report(state);
+    state.SetItemsProcessed(state.iterations() * width * height);
+}
+
+void BM_SetImage(benchmark::State& state) {
+    tesseract::TessBaseAPI* api = engine();
+    if (!api) {
+        state.SkipWithError("eng.traineddata not found (set TESSDATA_PREFIX)");
+        return;
+    }
+    const int width = static_cast<int>(state.range(0));
+    const int height = static_cast<int>(state.range(1));
+    preprocess::Workspace workspace;
+    preprocess::GrayImage gray;
+    preprocess::loadGray(page(width, height, 8), workspace, gray);
+
+    MemoryProbe probe;
+    for (auto _ : state) {
+        api->SetImage(gray.data, gray.width, gray.height, 1, gray.stride);
+    }
+    // Each image is freed by the next; this frees the last one
+    api->Clear();
+    probe.report(state);
+    state.SetItemsProcessed(state.iterations() * width * height);
+}
+
+void BM_Recognize(benchmark::State& state) {
+    tesseract::TessBaseAPI* api = engine();
+    if (!api) {
+        state.SkipWithError("eng.traineddata not found (set TESSDATA_PREFIX)");
+        return;
+    }
+    const int width = static_cast<int>(state.range(0));
+    const int height = static_cast<int>(state.range(1));
+    preprocess::Workspace workspace;
+    preprocess::GrayImage gray;
+    preprocess::loadGray(page(width, height, 8), workspace, gray);
+
+    // SetImage is untimed but counted: it frees the previous results, so
+    // leaving it out of the counts would hide whether they are freed at all
+    MemoryProbe probe;
+    for (auto _ : state) {
+        state.PauseTiming();
+        api->SetImage(gray.data, gray.width, gray.height, 1, gray.stride);
+        state.ResumeTiming();
+        benchmark::DoNotOptimize(api->Recognize(nullptr));
+    }
+    api->Clear();
+    probe.report(state);
+}
+
+// Collecting the text of a page already recognized
+void BM_GetUTF8Text(benchmark::State& state) {
+    tesseract::TessBaseAPI* api = engine();
+    if (!api) {
+        state.SkipWithError("eng.traineddata not found (set TESSDATA_PREFIX)");
+        return;
+    }
+    const int width = static_cast<int>(state.range(0));
+    const int height = static_cast<int>(state.range(1));
+    preprocess::Workspace workspace;
+    preprocess::GrayImage gray;
+    preprocess::loadGray(page(width, height, 8), workspace, gray);
+
+    MemoryProbe probe;
+    for (auto _ : state) {
+        state.PauseTiming();
+        probe.exclude([&] {
+            api->SetImage(gray.data, gray.width, gray.height, 1, gray.stride);
+            api->Recognize(nullptr);
+        });
+        state.ResumeTiming();
+        char* text = api->GetUTF8Text();
+        benchmark::DoNotOptimize(text);
+        delete[] text;
+    }
+    // Frees what the excluded recognitions left behind
+    probe.exclude([api] { api->Clear(); });
+    probe.report(state);
+}
+
+// The whole call as the server makes it, from file bytes to text
+void BM_ProcessImage(benchmark::State& state) {
+    const int width = static_cast<int>(state.range(0));
+    const int height = static_cast<int>(state.range(1));
+    const int depth = static_cast<int>(state.range(2));
+    const int format = static_cast<int>(state.range(3));
+    const std::string& bytes = encodedPage(width, height, depth, format);
+    OCRProcessor processor("eng");
+    if (!processor.ready()) {
+        state.SkipWithError("eng.traineddata not found (set TESSDATA_PREFIX)");
+        return;
+    }
+    state.SetLabel(std::to_string(depth) + "bpp " + formatName(format));
+
+    MemoryProbe probe;
+    for (auto _ : state) {
+        OCRProcessor::Result result = processor.processImage(
+            reinterpret_cast<const unsigned char*>(bytes.data()), bytes.size(), formatName(format));
+        if (!result.success) {
+            state.SkipWithError(result.error_msg.c_str());
+            break;
+        }
+        benchmark::DoNotOptimize(result.text.data());
+    }
+    probe.report(state);
+}
+
+void pageSizes(benchmark::internal::Benchmark* b) {
+    for (const auto& size : kPageSizes) {
+        b->Args({ size[0], size[1] });
+    }
+}
+
+void pageSizesPerDepth(benchmark::internal::Benchmark* b) {
+    for (const auto& size : kPageSizes) {
+        for (int depth : { 1, 8, 32 }) {
+            b->Args({ size[0], size[1], depth });
+        }
+    }
+}
+
+// How scans usually arrive: bilevel as G4 TIFF or PNG, gray and color as
+// PNG or JPEG
+void pageSizesPerFile(benchmark::internal::Benchmark* b) {
+    for (const auto& size : kPageSizes) {
+        b->Args({ size[0], size[1], 1, TiffG4 });
+        b->Args({ size[0], size[1], 1, Png });
+        for (int depth : { 8, 32 }) {
+            b->Args({ size[0], size[1], depth, Png });
+            b->Args({ size[0], size[1], depth, Jpeg });
+        }
+    }
+}
+
+} // namespace
+
+BENCHMARK(BM_Decode)->Apply(pageSizesPerFile)->Unit(benchmark::kMillisecond);
+BENCHMARK(BM_Ingest)->Apply(pageSizesPerFile)->Unit(benchmark::kMillisecond);
+BENCHMARK(BM_ConvertTo8)->Apply(pageSizesPerDepth)->Unit(benchmark::kMillisecond);
+BENCHMARK(BM_LoadGray)->Apply(pageSizesPerDepth)->Unit(benchmark::kMillisecond);
+BENCHMARK(BM_OpenCloseGray)->Apply(pageSizes)->Unit(benchmark::kMillisecond);
+BENCHMARK(BM_SetImage)->Apply(pageSizes)->Unit(benchmark::kMicrosecond);
+BENCHMARK(BM_Recognize)->Apply(pageSizes)->Unit(benchmark::kMillisecond);
+BENCHMARK(BM_GetUTF8Text)->Apply(pageSizes)->Unit(benchmark::kMillisecond);
+BENCHMARK(BM_ProcessImage)->Apply(pageSizesPerFile)->Unit(benchmark::kMillisecond);
+
+int main(int argc, char** argv) {
+    // Before any Pix exists, so every pixel buffer is allocated and freed
+    // through the counters
+    setPixMemoryManager(countedAlloc, countedFree);
+    benchmark::Initialize(&argc, argv);
+    if (benchmark::ReportUnrecognizedArguments(argc, argv)) {
+        return 1;
+    }
+    benchmark::RunSpecifiedBenchmarks();
+    benchmark::Shutdown();
+    return 0;
+}
\ No newline at end of file
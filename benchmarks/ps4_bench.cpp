@@ -0,0 +1,570 @@
+// Load generator for a running ps4_server, no GUI involved.
+//
+// Closed loop keeps --concurrency calls outstanding, and each caller sends
+// its next image as soon as the last one is answered. Open loop sends at
+// --rate per second whether or not earlier calls came back. Latency is then
+// measured from when each call was due, not from when it went out, so a
+// server that falls behind cannot hide it.
+//
+//   ps4_bench --target localhost:50051 --mode closed --concurrency 16 --duration-s 60
+//   ps4_bench --mode open --rate 40 --images ./scans --deadline-ms 2000 --out run.json
+//
+// Images come from --images (every file in the directory) or are rendered
+// with Leptonica's built-in bitmap font. The report goes to stdout (or
+// --out) as JSON; progress goes to stderr. Start the server with
+// --cache-mb 0, or every round after the first is served from its cache.
+
+#include "metrics.h"
+#include "ocr_service.grpc.pb.h"
+#include <grpcpp/grpcpp.h>
+#include <leptonica/allheaders.h>
+#include <algorithm>
+#include <atomic>
+#include <charconv>
+#include <chrono>
+#include <climits>
+#include <condition_variable>
+#include <cstdio>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <mutex>
+#include <random>
+#include <set>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+struct Options {
+    std::string target = "localhost:50051";
+    bool open_loop = false;
+    int concurrency = 8;            // closed loop
+    double rate = 10.0;             // open loop, calls per second
+    bool poisson = true;            // open loop: exponential gaps, else even
+    int max_in_flight = 10000;      // open loop: calls beyond this are not sent
+    int duration_s = 30;
+    int warmup_s = 5;               // sent, but left out of the report
+    int deadline_ms = 0;            // 0: no deadline
+    int max_message_mb = 64;
+    std::string images_dir;         // empty: render synthetic pages
+    int synthetic_count = 32;
+    int width = 1275;               // letter size at 150 dpi
+    int height = 1650;
+    int font_size = 16;
+    ocrservice::ServiceTier tier = ocrservice::TIER_ACCURATE;
+    std::string language;           // empty: the server's default
+    std::string out;                // empty: stdout
+};
+
+void printUsage() {
+    std::cerr <<
+        "Usage: ps4_bench [options]\n"
+        "  --target HOST:PORT      server to load (localhost:50051)\n"
+        "  --mode closed|open      closed: fixed concurrency; open: fixed arrival rate (closed)\n"
+        "  --concurrency N         closed loop: calls kept outstanding (8)\n"
+        "  --rate R                open loop: calls per second (10)\n"
+        "  --arrivals poisson|uniform  open loop: gaps between calls (poisson)\n"
+        "  --max-in-flight N       open loop: calls beyond this are dropped, not sent (10000)\n"
+        "  --duration-s S          measured time (30)\n"
+        "  --warmup-s S            load before measuring (5)\n"
+        "  --deadline-ms D         per-call deadline, 0 for none (0)\n"
+        "  --max-message-mb MB     largest image sent (64)\n"
+        "  --images DIR            send the image files in DIR\n"
+        "  --synthetic N           otherwise render N pages of text (32)\n"
+        "  --size WxH              rendered page size (1275x1650)\n"
+        "  --font-size F           rendered font size, 4-20 and even (16)\n"
+        "  --tier accurate|fast    service tier (accurate)\n"
+        "  --language L            Tesseract language (server default)\n"
+        "  --out FILE              write the JSON report here instead of stdout\n";
+}
+
+// The whole argument has to be a number; std::stoi would throw out of main
+// on "abc" and quietly accept "64abc"
+template <typename T>
+bool parseNumber(const std::string& flag, const std::string& text, T& value) {
+    const char* end = text.data() + text.size();
+    auto [parsed, error] = std::from_chars(text.data(), end, value);
+    if (error != std::errc() || parsed != end) {
+        std::cerr << "Invalid value '" << text << "' for " << flag << std::endl;
+        return false;
+    }
+    return true;
+}
+
+bool parseArgs(int argc, char* argv[], Options& options) {
+    for (int i = 1; i < argc; ++i) {
+        const std::string arg = argv[i];
+        const bool has_value = i + 1 < argc;
+        if (arg == "--target" && has_value) {
+            options.target = argv[++i];
+        }
+        else if (arg == "--mode" && has_value) {
+            const std::string mode = argv[++i];
+            if (mode != "closed" && mode != "open") {
+                std::cerr << "Unknown mode '" << mode << "' (expected closed or open)" << std::endl;
+                return false;
+            }
+            options.open_loop = mode == "open";
+        }
+        else if (arg == "--concurrency" && has_value) {
+            if (!parseNumber(arg, argv[++i], options.concurrency)) return false;
+            options.concurrency = std::max(1, options.concurrency);
+        }
+        else if (arg == "--rate" && has_value) {
+            if (!parseNumber(arg, argv[++i], options.rate)) return false;
+            if (options.rate <= 0.0) {
+                std::cerr << "--rate must be positive" << std::endl;
+                return false;
+            }
+        }
+        else if (arg == "--arrivals" && has_value) {
+            const std::string arrivals = argv[++i];
+            if (arrivals != "poisson" && arrivals != "uniform") {
+                std::cerr << "Unknown arrivals '" << arrivals << "' (expected poisson or uniform)" << std::endl;
+                return false;
+            }
+            options.poisson = arrivals == "poisson";
+        }
+        else if (arg == "--max-in-flight" && has_value) {
+            if (!parseNumber(arg, argv[++i], options.max_in_flight)) return false;
+            options.max_in_flight = std::max(1, options.max_in_flight);
+        }
+        else if (arg == "--duration-s" && has_value) {
+            if (!parseNumber(arg, argv[++i], options.duration_s)) return false;
+            options.duration_s = std::max(1, options.duration_s);
+        }
+        else if (arg == "--warmup-s" && has_value) {
+            if (!parseNumber(arg, argv[++i], options.warmup_s)) return false;
+            options.warmup_s = std::max(0, options.warmup_s);
+        }
+        else if (arg == "--max-message-mb" && has_value) {
+            if (!parseNumber(arg, argv[++i], options.max_message_mb)) return false;
+            // gRPC takes the limit in bytes as an int
+            options.max_message_mb = std::clamp(options.max_message_mb, 1, INT_MAX / (1024 * 1024));
+        }
+        else if (arg == "--deadline-ms" && has_value) {
+            if (!parseNumber(arg, argv[++i], options.deadline_ms)) return false;
+            options.deadline_ms = std::max(0, options.deadline_ms);
+        }
+        else if (arg == "--images" && has_value) {
+            options.images_dir = argv[++i];
+        }
+        else if (arg == "--synthetic" && has_value) {
+            if (!parseNumber(arg, argv[++i], options.synthetic_count)) return false;
+            options.synthetic_count = std::max(1, options.synthetic_count);
+        }
+        else if (arg == "--size" && has_value) {
+            const std::string size = argv[++i];
+            const size_t x = size.find('x');
+            if (x == std::string::npos) {
+                std::cerr << "Invalid size '" << size << "' (expected WxH)" << std::endl;
+                return false;
+            }
+            if (!parseNumber(arg, size.substr(0, x), options.width)) return false;
+            if (!parseNumber(arg, size.substr(x + 1), options.height)) return false;
+            options.width = std::max(64, options.width);
+            options.height = std::max(64, options.height);
+        }
+        else if (arg == "--font-size" && has_value) {
+            if (!parseNumber(arg, argv[++i], options.font_size)) return false;
+            options.font_size = std::clamp(options.font_size / 2 * 2, 4, 20);
+        }
+        else if (arg == "--tier" && has_value) {
+            const std::string tier = argv[++i];
+            if (tier != "accurate" && tier != "fast") {
+                std::cerr << "Unknown tier '" << tier << "' (expected accurate or fast)" << std::endl;
+                return false;
+            }
+            options.tier = tier == "fast" ? ocrservice::TIER_FAST : ocrservice::TIER_ACCURATE;
+        }
+        else if (arg == "--language" && has_value) {
+            options.language = argv[++i];
+        }
+        else if (arg == "--out" && has_value) {
+            options.out = argv[++i];
+        }
+        else {
+            std::cerr << "Unknown or incomplete option '" << arg << "'" << std::endl;
+            return false;
+        }
+    }
+    return true;
+}
+
+struct Image {
+    std::string bytes;
+    std::string format;
+};
+
+// Format names as the GUI client sends them
+std::string formatOf(const std::filesystem::path& path) {
+    std::string ext = path.extension().string();
+    std::transform(ext.begin(), ext.end(), ext.begin(), [](unsigned char c) { return static_cast<char>(std::tolower(c)); });
+    if (ext == ".png") return "png";
+    if (ext == ".jpg" || ext == ".jpeg") return "jpeg";
+    if (ext == ".tif" || ext == ".tiff") return "tiff";
+    if (ext == ".bmp") return "bmp";
+    if (ext == ".pnm" || ext == ".pbm" || ext == ".pgm" || ext == ".ppm") return "pnm";
+    if (ext == ".webp") return "webp";
+    if (ext == ".gif") return "gif";
+    return std::string();
+}
+
+std::vector<Image> loadImages(const std::string& dir) {
+    std::vector<Image> images;
+    std::error_code error;
+    for (const auto& entry : std::filesystem::directory_iterator(dir, error)) {
+        const std::string format = formatOf(entry.path());
+        if (!entry.is_regular_file() || format.empty()) {
+            continue;
+        }
+        std::ifstream file(entry.path(), std::ios::binary);
+        std::ostringstream bytes;
+        bytes << file.rdbuf();
+        images.push_back(Image{ bytes.str(), format });
+    }
+    if (error) {
+        std::cerr << "Cannot read " << dir << ": " << error.message() << std::endl;
+    }
+    return images;
+}
+
+// Pages of random words in Leptonica's bitmap font, encoded as PNG. Every
+// page differs, so the server cannot answer one from another's result.
+std::vector<Image> renderImages(const Options& options) {
+    static const char* const kWords[] = {
+        "invoice", "total", "amount", "date", "customer", "order", "number", "payment", "the", "of",
+        "and", "to", "in", "shipping", "address", "quantity", "price", "tax", "balance", "due",
+        "account", "reference", "description", "service", "period", "receipt", "statement", "page",
+        "signature", "approved", "2024", "17.50", "1,204.00", "No.", "Ltd", "street", "city",
+    };
+    std::vector<Image> images;
+    L_BMF* font = bmfCreate(nullptr, options.font_size);
+    if (!font) {
+        std::cerr << "Leptonica could not create its bitmap font" << std::endl;
+        return images;
+    }
+    std::mt19937 rng(42);
+    std::uniform_int_distribution<size_t> word(0, std::size(kWords) - 1);
+    const int margin = options.width / 16;
+    for (int i = 0; i < options.synthetic_count; ++i) {
+        std::string text;
+        // Roughly enough to fill the page; pixSetTextblock wraps and clips
+        const int words = options.width * options.height / (options.font_size * options.font_size * 12);
+        for (int w = 0; w < words; ++w) {
+            text += kWords[word(rng)];
+            text += ' ';
+        }
+
+        Pix* page = pixCreate(options.width, options.height, 8);
+        pixSetAll(page);    // white
+        l_int32 overflow = 0;
+        pixSetTextblock(page, font, text.c_str(), 0, margin, margin, options.width - 2 * margin, 0, &overflow);
+        l_uint8* data = nullptr;
+        size_t size = 0;
+        if (pixWriteMem(&data, &size, page, IFF_PNG) == 0) {
+            images.push_back(Image{ std::string(reinterpret_cast<const char*>(data), size), "png" });
+        }
+        lept_free(data);
+        pixDestroy(&page);
+    }
+    bmfDestroy(&font);
+    return images;
+}
+
+std::shared_ptr<grpc::Channel> createChannel(const Options& options) {
+    grpc::ChannelArguments args;
+    args.SetMaxSendMessageSize(options.max_message_mb * 1024 * 1024);
+    args.SetMaxReceiveMessageSize(options.max_message_mb * 1024 * 1024);
+    return grpc::CreateCustomChannel(options.target, grpc::InsecureChannelCredentials(), args);
+}
+
+class LoadGenerator {
+public:
+    LoadGenerator(const Options& options, std::vector<ocrservice::OCRRequest> requests)
+        : options_(options), requests_(std::move(requests)),
+          stub_(ocrservice::OCRService::NewStub(createChannel(options))) {
+    }
+
+    // Blocks for warmup, measurement and draining.
+    void run() {
+        start_ = Clock::now();
+        measure_start_ = start_ + std::chrono::seconds(options_.warmup_s);
+        end_ = measure_start_ + std::chrono::seconds(options_.duration_s);
+
+        std::thread pacer;
+        if (options_.open_loop) {
+            pacer = std::thread(&LoadGenerator::paceOpenLoop, this);
+        }
+        else {
+            for (int i = 0; i < options_.concurrency; ++i) {
+                startCall(start_);
+            }
+        }
+
+        while (Clock::now() < end_) {
+            std::this_thread::sleep_until(std::min(end_, Clock::now() + std::chrono::seconds(1)));
+            reportProgress();
+        }
+        if (pacer.joinable()) {
+            pacer.join();
+        }
+        drain();
+    }
+
+    std::string reportJson() const {
+        const LatencyHistogram::Snapshot latency = latency_.snapshot();
+        const double seconds = static_cast<double>(options_.duration_s);
+        const uint64_t completed = ok_ + failed_ + deadline_exceeded_ + shed_ + errors_ + unfinished_;
+        auto ms = [](int64_t us) { return static_cast<double>(us) / 1000.0; };
+        auto rate = [completed](uint64_t n) { return completed ? static_cast<double>(n) / completed : 0.0; };
+
+        char buffer[2048];
+        std::snprintf(buffer, sizeof(buffer),
+            "{\n"
+            "  \"target\": \"%s\",\n"
+            "  \"mode\": \"%s\",\n"
+            "  \"concurrency\": %d,\n"
+            "  \"rate\": %.3f,\n"
+            "  \"duration_s\": %d,\n"
+            "  \"deadline_ms\": %d,\n"
+            "  \"images\": %zu,\n"
+            "  \"requests\": %llu,\n"
+            "  \"ok\": %llu,\n"
+            "  \"failed\": %llu,\n"
+            "  \"deadline_exceeded\": %llu,\n"
+            "  \"shed\": %llu,\n"
+            "  \"errors\": %llu,\n"
+            "  \"unfinished\": %llu,\n"
+            "  \"dropped\": %llu,\n"
+            "  \"throughput_rps\": %.3f,\n"
+            "  \"completed_rps\": %.3f,\n"
+            "  \"error_rate\": %.6f,\n"
+            "  \"deadline_rate\": %.6f,\n"
+            "  \"shed_rate\": %.6f,\n"
+            "  \"latency_ms\": {\"mean\": %.3f, \"p50\": %.3f, \"p90\": %.3f, \"p99\": %.3f, \"p999\": %.3f, \"max\": %.3f}",
+            options_.target.c_str(), options_.open_loop ? "open" : "closed",
+            options_.open_loop ? 0 : options_.concurrency, options_.open_loop ? options_.rate : 0.0,
+            options_.duration_s, options_.deadline_ms, requests_.size(),
+            static_cast<unsigned long long>(completed), static_cast<unsigned long long>(ok_.load()),
+            static_cast<unsigned long long>(failed_.load()), static_cast<unsigned long long>(deadline_exceeded_.load()),
+            static_cast<unsigned long long>(shed_.load()), static_cast<unsigned long long>(errors_.load()),
+            static_cast<unsigned long long>(unfinished_.load()), static_cast<unsigned long long>(dropped_.load()),
+            ok_ / seconds, completed / seconds,
+            rate(failed_ + errors_), rate(deadline_exceeded_), rate(shed_),
+            latency.count ? ms(latency.sum_us) / latency.count : 0.0,
+            ms(latency.percentile(0.5)), ms(latency.percentile(0.9)), ms(latency.percentile(0.99)),
+            ms(latency.percentile(0.999)), ms(latency.max_us));
+
+        std::string json = buffer;
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (!first_error_.empty()) {
+            json += ",\n  \"first_error\": \"";
+            for (char c : first_error_) {
+                if (c == '"' || c == '\\') {
+                    json += '\\';
+                }
+                json += static_cast<unsigned char>(c) < 0x20 ? ' ' : c;
+            }
+            json += '"';
+        }
+        json += "\n}\n";
+        return json;
+    }
+
+private:
+    struct Call {
+        grpc::ClientContext context;
+        ocrservice::OCRResponse response;
+        Clock::time_point due;      // when the call should have gone out
+    };
+
+    void startCall(Clock::time_point due) {
+        Call* call = new Call();
+        call->due = due;
+        if (options_.deadline_ms > 0) {
+            call->context.set_deadline(std::chrono::system_clock::now() + std::chrono::milliseconds(options_.deadline_ms));
+        }
+        const ocrservice::OCRRequest* request = &requests_[next_request_.fetch_add(1) % requests_.size()];
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            live_.insert(&call->context);
+            ++in_flight_;
+        }
+        // Several calls may send the same request message; it is only read
+        stub_->async()->ProcessImage(&call->context, request, &call->response,
+            [this, call](grpc::Status status) { onDone(call, status); });
+    }
+
+    // Runs on a gRPC thread.
+    void onDone(Call* call, const grpc::Status& status) {
+        const Clock::time_point now = Clock::now();
+        if (call->due >= measure_start_ && call->due < end_) {
+            if (status.ok() && call->response.success()) {
+                ++ok_;
+                latency_.record(now - call->due);
+            }
+            else if (status.ok()) {
+                ++failed_;
+                noteError(call->response.error_message());
+            }
+            else if (status.error_code() == grpc::StatusCode::DEADLINE_EXCEEDED) {
+                ++deadline_exceeded_;
+            }
+            else if (status.error_code() == grpc::StatusCode::RESOURCE_EXHAUSTED) {
+                ++shed_;
+            }
+            else if (status.error_code() == grpc::StatusCode::CANCELLED && draining_) {
+                ++unfinished_;
+            }
+            else {
+                ++errors_;
+                noteError(status.error_message());
+            }
+        }
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            live_.erase(&call->context);
+        }
+        delete call;
+        // The next caller goes out before this one is counted as done, so
+        // the drain cannot see zero in between
+        if (!options_.open_loop && now < end_) {
+            startCall(now);
+        }
+
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (--in_flight_ == 0) {
+            idle_cv_.notify_all();
+        }
+    }
+
+    void paceOpenLoop() {
+        std::mt19937_64 rng(7);
+        std::exponential_distribution<double> gap(options_.rate);
+        Clock::time_point due = start_;
+        while (due < end_) {
+            std::this_thread::sleep_until(due);
+            bool full = false;
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                full = in_flight_ >= options_.max_in_flight;
+            }
+            if (!full) {
+                startCall(due);
+            }
+            else if (due >= measure_start_) {
+                ++dropped_;
+            }
+            const double seconds = options_.poisson ? gap(rng) : 1.0 / options_.rate;
+            due += std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(seconds));
+        }
+    }
+
+    // Waits for the calls still out, cancelling them if they do not come
+    // back within the deadline (or a minute without one).
+    void drain() {
+        const auto patience = std::chrono::milliseconds(options_.deadline_ms > 0 ? options_.deadline_ms + 1000 : 60000);
+        std::unique_lock<std::mutex> lock(mutex_);
+        if (!idle_cv_.wait_for(lock, patience, [this] { return in_flight_ == 0; })) {
+            std::cerr << "[Bench] Cancelling " << in_flight_ << " calls still outstanding" << std::endl;
+            draining_ = true;
+            for (grpc::ClientContext* context : live_) {
+                context->TryCancel();
+            }
+            idle_cv_.wait(lock, [this] { return in_flight_ == 0; });
+        }
+    }
+
+    void noteError(const std::string& message) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (first_error_.empty()) {
+            first_error_ = message.empty() ? "(no message)" : message;
+        }
+    }
+
+    void reportProgress() {
+        const auto elapsed = std::chrono::duration_cast<std::chrono::seconds>(Clock::now() - start_).count();
+        int in_flight = 0;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            in_flight = in_flight_;
+        }
+        std::cerr << "[Bench] " << elapsed << "s" << (Clock::now() < measure_start_ ? " (warmup)" : "")
+            << " ok=" << ok_ << " failed=" << failed_ + errors_ << " deadline=" << deadline_exceeded_
+            << " shed=" << shed_ << " in_flight=" << in_flight << std::endl;
+    }
+
+    const Options options_;
+    const std::vector<ocrservice::OCRRequest> requests_;
+    std::unique_ptr<ocrservice::OCRService::Stub> stub_;
+    std::atomic<uint64_t> next_request_{ 0 };
+
+    Clock::time_point start_;
+    Clock::time_point measure_start_;
+    Clock::time_point end_;
+
+    mutable std::mutex mutex_;
+    std::condition_variable idle_cv_;
+    std::set<grpc::ClientContext*> live_;
+    int in_flight_ = 0;
+    std::atomic<bool> draining_{ false };
+    std::string first_error_;
+
+    // Calls due inside the measured window only
+    LatencyHistogram latency_;      // of successful calls
+    std::atomic<uint64_t> ok_{ 0 };
+    std::atomic<uint64_t> failed_{ 0 };             // answered with success = false
+    std::atomic<uint64_t> deadline_exceeded_{ 0 };
+    std::atomic<uint64_t> shed_{ 0 };               // RESOURCE_EXHAUSTED
+    std::atomic<uint64_t> errors_{ 0 };             // any other gRPC error
+    std::atomic<uint64_t> unfinished_{ 0 };         // cancelled by drain()
+    std::atomic<uint64_t> dropped_{ 0 };            // open loop, over max_in_flight
+};
+
+} // namespace
+
+int main(int argc, char* argv[]) {
+    Options options;
+    if (!parseArgs(argc, argv, options)) {
+        printUsage();
+        return 2;
+    }
+
+    std::vector<Image> images = options.images_dir.empty() ? renderImages(options) : loadImages(options.images_dir);
+    if (images.empty()) {
+        std::cerr << "No images to send" << std::endl;
+        return 1;
+    }
+
+    std::vector<ocrservice::OCRRequest> requests(images.size());
+    for (size_t i = 0; i < images.size(); ++i) {
+        requests[i].set_image_data(std::move(images[i].bytes));
+        requests[i].set_format(images[i].format);
+        requests[i].set_request_id(static_cast<int32_t>(i));
+        requests[i].set_tier(options.tier);
+        requests[i].set_language(options.language);
+    }
+
+    std::cerr << "[Bench] " << (options.open_loop ? "Open" : "Closed") << " loop against " << options.target
+        << " with " << requests.size() << " images, " << options.warmup_s << "s warmup + "
+        << options.duration_s << "s" << std::endl;
+
+    LoadGenerator generator(options, std::move(requests));
+    generator.run();
+    const std::string report = generator.reportJson();
+
+    if (options.out.empty()) {
+        std::cout << report;
+    }
+    else if (!writeFileAtomically(options.out, report)) {
+        std::cerr << "Cannot write " << options.out << std::endl;
+        return 1;
+    }
+    return 0;
+}
\ No newline at end of file
@@ -0,0 +1,543 @@
+#include "batch_client.h"
+#include <grpcpp/grpcpp.h>
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <filesystem>
+#include <iostream>
+#include <random>
+
+namespace fs = std::filesystem;
+
+namespace {
+
+// Paths are kept as UTF-8 with forward slashes, so checkpoints carry over
+// between platforms
+std::string utf8(const fs::path& path) {
+    const std::u8string text = path.generic_u8string();
+    return std::string(text.begin(), text.end());
+}
+
+fs::path fromUtf8(const std::string& text) {
+    return fs::path(std::u8string(text.begin(), text.end()));
+}
+
+// Formats the server's Leptonica decodes; everything else is left alone.
+// Names as the GUI client sends them.
+std::string formatOf(const fs::path& path) {
+    std::string ext = utf8(path.extension());
+    std::transform(ext.begin(), ext.end(), ext.begin(), [](unsigned char c) { return static_cast<char>(std::tolower(c)); });
+    if (ext == ".png") return "png";
+    if (ext == ".jpg" || ext == ".jpeg") return "jpeg";
+    if (ext == ".tif" || ext == ".tiff") return "tiff";
+    if (ext == ".bmp") return "bmp";
+    if (ext == ".gif") return "gif";
+    if (ext == ".webp") return "webp";
+    if (ext == ".pbm" || ext == ".pgm" || ext == ".ppm" || ext == ".pnm") return "pnm";
+    return std::string();
+}
+
+// True for a missing or empty file too: appending starts a fresh line.
+bool endsWithNewline(const fs::path& path) {
+    std::ifstream file(path, std::ios::binary | std::ios::ate);
+    if (!file || file.tellg() <= 0) {
+        return true;
+    }
+    file.seekg(-1, std::ios::end);
+    return file.get() == '\n';
+}
+
+void appendJsonString(std::string& out, const std::string& text) {
+    out += '"';
+    for (char c : text) {
+        switch (c) {
+        case '"': out += "\\\""; break;
+        case '\\': out += "\\\\"; break;
+        case '\n': out += "\\n"; break;
+        case '\r': out += "\\r"; break;
+        case '\t': out += "\\t"; break;
+        case '\f': out += "\\f"; break;    // between the pages of a TIFF
+        default:
+            if (static_cast<unsigned char>(c) < 0x20) {
+                char escape[8];
+                std::snprintf(escape, sizeof(escape), "\\u%04x", c);
+                out += escape;
+            }
+            else {
+                out += c;   // UTF-8 passes through
+            }
+        }
+    }
+    out += '"';
+}
+
+const char* statusCodeName(grpc::StatusCode code) {
+    switch (code) {
+    case grpc::StatusCode::OK: return "OK";
+    case grpc::StatusCode::CANCELLED: return "CANCELLED";
+    case grpc::StatusCode::UNKNOWN: return "UNKNOWN";
+    case grpc::StatusCode::INVALID_ARGUMENT: return "INVALID_ARGUMENT";
+    case grpc::StatusCode::DEADLINE_EXCEEDED: return "DEADLINE_EXCEEDED";
+    case grpc::StatusCode::NOT_FOUND: return "NOT_FOUND";
+    case grpc::StatusCode::ALREADY_EXISTS: return "ALREADY_EXISTS";
+    case grpc::StatusCode::PERMISSION_DENIED: return "PERMISSION_DENIED";
+    case grpc::StatusCode::RESOURCE_EXHAUSTED: return "RESOURCE_EXHAUSTED";
+    case grpc::StatusCode::FAILED_PRECONDITION: return "FAILED_PRECONDITION";
+    case grpc::StatusCode::ABORTED: return "ABORTED";
+    case grpc::StatusCode::OUT_OF_RANGE: return "OUT_OF_RANGE";
+    case grpc::StatusCode::UNIMPLEMENTED: return "UNIMPLEMENTED";
+    case grpc::StatusCode::INTERNAL: return "INTERNAL";
+    case grpc::StatusCode::UNAVAILABLE: return "UNAVAILABLE";
+    case grpc::StatusCode::DATA_LOSS: return "DATA_LOSS";
+    case grpc::StatusCode::UNAUTHENTICATED: return "UNAUTHENTICATED";
+    default: return "UNKNOWN";
+    }
+}
+
+// Worth another attempt in this run
+bool isTransient(grpc::StatusCode code) {
+    return code == grpc::StatusCode::UNAVAILABLE || code == grpc::StatusCode::RESOURCE_EXHAUSTED
+        || code == grpc::StatusCode::DEADLINE_EXCEEDED || code == grpc::StatusCode::ABORTED;
+}
+
+// The image itself is the problem; trying again will not help
+bool isBadInput(grpc::StatusCode code) {
+    return code == grpc::StatusCode::INVALID_ARGUMENT || code == grpc::StatusCode::FAILED_PRECONDITION
+        || code == grpc::StatusCode::OUT_OF_RANGE;
+}
+
+} // namespace
+
+template <typename T>
+bool BatchClient::BoundedQueue<T>::push(T item, size_t bytes) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    not_full_.wait(lock, [this, bytes] {
+        return closed_ || items_.empty() || (items_.size() < max_items_ && bytes_ + bytes <= max_bytes_);
+    });
+    if (closed_) {
+        return false;
+    }
+    items_.emplace_back(std::move(item), bytes);
+    bytes_ += bytes;
+    not_empty_.notify_one();
+    return true;
+}
+
+template <typename T>
+bool BatchClient::BoundedQueue<T>::popFor(T& item, std::chrono::milliseconds timeout) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    if (!not_empty_.wait_for(lock, timeout, [this] { return closed_ || !items_.empty(); }) || items_.empty()) {
+        return false;
+    }
+    item = std::move(items_.front().first);
+    bytes_ -= items_.front().second;
+    items_.pop_front();
+    not_full_.notify_all();
+    return true;
+}
+
+template <typename T>
+void BatchClient::BoundedQueue<T>::close() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    closed_ = true;
+    not_empty_.notify_all();
+    not_full_.notify_all();
+}
+
+template <typename T>
+void BatchClient::BoundedQueue<T>::cancel() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    closed_ = true;
+    items_.clear();
+    bytes_ = 0;
+    not_empty_.notify_all();
+    not_full_.notify_all();
+}
+
+template <typename T>
+bool BatchClient::BoundedQueue<T>::finished() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return closed_ && items_.empty();
+}
+
+template <typename T>
+size_t BatchClient::BoundedQueue<T>::bytes() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return bytes_;
+}
+
+BatchClient::BatchClient(const BatchOptions& options)
+    : options_(options),
+      pool_(options.servers),
+      // Paths are small; this only keeps the crawler from racing ahead
+      paths_(static_cast<size_t>(std::max(options.prefetch_files, 1)) * 16, SIZE_MAX),
+      prefetched_(static_cast<size_t>(std::max(options.prefetch_files, 1)), options.prefetch_bytes) {
+}
+
+BatchClient::~BatchClient() {
+    stop();
+    paths_.cancel();
+    prefetched_.cancel();
+    if (crawler_.joinable()) {
+        crawler_.join();
+    }
+    for (std::thread& reader : readers_) {
+        if (reader.joinable()) {
+            reader.join();
+        }
+    }
+}
+
+bool BatchClient::open() {
+    const fs::path output = fromUtf8(options_.output);
+    const fs::path checkpoint = fromUtf8(options_.checkpoint.empty() ? options_.output + ".checkpoint" : options_.checkpoint);
+
+    // After a crash either file may end mid-line
+    const bool output_whole = endsWithNewline(output);
+    const bool checkpoint_whole = endsWithNewline(checkpoint);
+
+    {
+        std::ifstream done(checkpoint, std::ios::binary);
+        std::string line;
+        std::string last;
+        while (std::getline(done, line)) {
+            if (!line.empty() && line.back() == '\r') {
+                line.pop_back();
+            }
+            if (!line.empty()) {
+                last = line;
+                done_paths_.insert(std::move(line));
+            }
+        }
+        // Cut short, it could name a different file ("a.tif" of "a.tiff")
+        if (!checkpoint_whole) {
+            done_paths_.erase(last);
+        }
+    }
+    output_.open(output, std::ios::binary | std::ios::app);
+    if (!output_) {
+        error_ = "cannot open " + options_.output;
+        return false;
+    }
+    checkpoint_.open(checkpoint, std::ios::binary | std::ios::app);
+    if (!checkpoint_) {
+        error_ = "cannot open " + utf8(checkpoint);
+        return false;
+    }
+    if (!output_whole) {
+        output_ << '\n';
+    }
+    if (!checkpoint_whole) {
+        checkpoint_ << '\n';
+    }
+    return true;
+}
+
+BatchSummary BatchClient::run() {
+    start_ = Clock::now();
+    crawler_ = std::thread(&BatchClient::crawl, this);
+    readers_left_ = std::max(options_.readers, 1);
+    for (int i = 0; i < std::max(options_.readers, 1); ++i) {
+        readers_.emplace_back(&BatchClient::read, this);
+    }
+
+    bool source_done = false;
+    bool cancelled = false;
+    Clock::time_point last_progress = start_;
+    while (true) {
+        if (stopping_ && !cancelled) {
+            paths_.cancel();
+            prefetched_.cancel();
+            cancelled = true;
+        }
+
+        std::vector<std::unique_ptr<Job>> due;
+        bool take_new = false;
+        {
+            std::unique_lock<std::mutex> lock(jobs_mutex_);
+            const Clock::time_point now = Clock::now();
+            if (stopping_) {
+                // Left for the next run
+                in_flight_ -= static_cast<int>(retries_.size());
+                retries_.clear();
+            }
+            while (!retries_.empty() && retries_.front().due <= now) {
+                due.push_back(std::move(retries_.front().job));
+                retries_.pop_front();
+            }
+            if (due.empty()) {
+                if ((source_done || stopping_) && in_flight_ == 0) {
+                    break;
+                }
+                take_new = !source_done && !stopping_ && in_flight_ < options_.max_in_flight;
+                if (!take_new) {
+                    Clock::time_point until = now + std::chrono::milliseconds(250);
+                    if (!retries_.empty()) {
+                        until = std::min(until, retries_.front().due);
+                    }
+                    jobs_cv_.wait_until(lock, until);
+                }
+            }
+        }
+
+        for (std::unique_ptr<Job>& job : due) {
+            send(std::move(job));
+        }
+        if (take_new) {
+            std::unique_ptr<Job> job;
+            if (prefetched_.popFor(job, std::chrono::milliseconds(50))) {
+                {
+                    std::lock_guard<std::mutex> lock(jobs_mutex_);
+                    ++in_flight_;
+                }
+                send(std::move(job));
+            }
+            else if (prefetched_.finished()) {
+                source_done = true;
+            }
+        }
+
+        if (Clock::now() - last_progress >= std::chrono::seconds(5)) {
+            last_progress = Clock::now();
+            reportProgress();
+        }
+    }
+
+    crawler_.join();
+    for (std::thread& reader : readers_) {
+        reader.join();
+    }
+    readers_.clear();
+    {
+        std::lock_guard<std::mutex> lock(output_mutex_);
+        flushCheckpointLocked();
+    }
+
+    BatchSummary summary;
+    summary.found = found_;
+    summary.skipped = skipped_;
+    summary.succeeded = succeeded_;
+    summary.failed = failed_;
+    summary.unfinished = summary.found - summary.skipped - summary.succeeded - summary.failed;
+    summary.retries = retry_count_;
+    summary.bytes_sent = bytes_sent_;
+    summary.seconds = std::chrono::duration<double>(Clock::now() - start_).count();
+    summary.interrupted = stopping_;
+    return summary;
+}
+
+void BatchClient::crawl() {
+    const fs::path root = fromUtf8(options_.input_dir);
+    std::error_code error;
+    fs::recursive_directory_iterator it(root, fs::directory_options::skip_permission_denied, error);
+    for (; !error && it != fs::recursive_directory_iterator() && !stopping_; it.increment(error)) {
+        std::error_code file_error;
+        if (!it->is_regular_file(file_error) || formatOf(it->path()).empty()) {
+            continue;
+        }
+        std::string path = utf8(it->path().lexically_relative(root));
+        ++found_;
+        if (done_paths_.count(path)) {
+            ++skipped_;
+            continue;
+        }
+        if (!paths_.push(std::move(path), 0)) {
+            break;
+        }
+    }
+    if (error) {
+        std::cerr << "[Batch] Stopped crawling " << options_.input_dir << ": " << error.message() << std::endl;
+    }
+    paths_.close();
+}
+
+void BatchClient::read() {
+    const fs::path root = fromUtf8(options_.input_dir);
+    std::string path;
+    while (!stopping_) {
+        if (!paths_.popFor(path, std::chrono::milliseconds(100))) {
+            if (paths_.finished()) {
+                break;
+            }
+            continue;
+        }
+
+        auto job = std::make_unique<Job>();
+        job->path = path;
+        const fs::path file_path = root / fromUtf8(path);
+        std::ifstream file(file_path, std::ios::binary | std::ios::ate);
+        std::string bytes;
+        if (file) {
+            bytes.resize(static_cast<size_t>(std::max<std::streamoff>(file.tellg(), 0)));
+            file.seekg(0);
+            file.read(bytes.data(), static_cast<std::streamsize>(bytes.size()));
+        }
+        if (!file || bytes.empty()) {
+            // Not checkpointed: the next run tries again
+            record(*job, false, "\"ok\":false,\"error\":\"cannot read file\"");
+            continue;
+        }
+
+        const size_t size = bytes.size();
+        job->request.set_image_data(std::move(bytes));
+        job->request.set_format(formatOf(file_path));
+        job->request.set_request_id(next_request_id_++);
+        job->request.set_tier(options_.tier);
+        job->request.set_language(options_.language);
+        if (!prefetched_.push(std::move(job), size)) {
+            break;
+        }
+    }
+    if (--readers_left_ == 0) {
+        prefetched_.close();
+    }
+}
+
+void BatchClient::send(std::unique_ptr<Job> job) {
+    if (job->attempts++ == 0) {
+        job->started = Clock::now();
+    }
+    Call* call = new Call();
+    call->job = std::move(job);
+    if (options_.deadline_ms > 0) {
+        call->context.set_deadline(std::chrono::system_clock::now() + std::chrono::milliseconds(options_.deadline_ms));
+    }
+    call->backend = pool_.acquire(call->job->request.tier());
+    if (!call->backend) {
+        // The resolver file lists nobody right now; retried like a dead server
+        onDone(call, grpc::Status(grpc::StatusCode::UNAVAILABLE, "no server configured"));
+        return;
+    }
+    bytes_sent_ += call->job->request.image_data().size();
+    call->backend->stub->async()->ProcessImage(&call->context, &call->job->request, &call->response,
+        [this, call](grpc::Status status) { onDone(call, status); });
+}
+
+void BatchClient::onDone(Call* call, const grpc::Status& status) {
+    std::unique_ptr<Call> owned(call);
+    if (call->backend) {
+        pool_.release(call->backend, status);
+    }
+    const ocrservice::OCRResponse& response = call->response;
+
+    std::string fields;
+    if (status.ok()) {
+        const bool ok = response.success();
+        fields = ok ? "\"ok\":true" : "\"ok\":false";
+        fields += ",\"pages\":" + std::to_string(std::max(response.page_count(), 1));
+        if (ok) {
+            ++succeeded_;
+            fields += ",\"text\":";
+            appendJsonString(fields, response.text());
+        }
+        else {
+            ++failed_;
+            fields += ",\"error\":";
+            appendJsonString(fields, response.error_message());
+        }
+        record(*call->job, true, fields);
+        finishJob();
+        return;
+    }
+
+    const grpc::StatusCode code = status.error_code();
+    if (isTransient(code) && call->job->attempts <= options_.retries && !stopping_) {
+        ++retry_count_;
+        Retry retry{ Clock::now() + backoff(*call), std::move(call->job) };
+        std::lock_guard<std::mutex> lock(jobs_mutex_);
+        auto at = std::upper_bound(retries_.begin(), retries_.end(), retry.due,
+            [](Clock::time_point due, const Retry& other) { return due < other.due; });
+        retries_.insert(at, std::move(retry));
+        jobs_cv_.notify_all();
+        return;
+    }
+
+    // Only bad input is final; anything else is tried again next run
+    const bool bad_input = isBadInput(code);
+    if (bad_input) {
+        ++failed_;
+    }
+    fields = "\"ok\":false,\"code\":\"";
+    fields += statusCodeName(code);
+    fields += "\",\"error\":";
+    appendJsonString(fields, status.error_message());
+    record(*call->job, bad_input, fields);
+    finishJob();
+}
+
+std::chrono::milliseconds BatchClient::backoff(const Call& call) const {
+    const auto& trailers = call.context.GetServerTrailingMetadata();
+    const auto hint = trailers.find("grpc-retry-pushback-ms");
+    if (hint != trailers.end()) {
+        const long long ms = std::atoll(std::string(hint->second.data(), hint->second.size()).c_str());
+        if (ms > 0) {
+            return std::chrono::milliseconds(ms);
+        }
+    }
+    // 250 ms doubling to at most 30 s, +-25% so retries spread out
+    thread_local std::mt19937 rng(std::random_device{}());
+    const int64_t base = std::min<int64_t>(int64_t{ 250 } << std::min(call.job->attempts - 1, 7), 30000);
+    std::uniform_int_distribution<int64_t> jitter(base * 3 / 4, base * 5 / 4);
+    return std::chrono::milliseconds(jitter(rng));
+}
+
+void BatchClient::record(const Job& job, bool done, const std::string& json_fields) {
+    std::string line = "{\"path\":";
+    appendJsonString(line, job.path);
+    line += ",\"request_id\":" + std::to_string(job.request.request_id());
+    line += ",\"attempts\":" + std::to_string(job.attempts);
+    const int64_t ms = job.attempts > 0
+        ? std::chrono::duration_cast<std::chrono::milliseconds>(Clock::now() - job.started).count() : 0;
+    line += ",\"ms\":" + std::to_string(ms);
+    line += ',';
+    line += json_fields;
+    line += "}\n";
+
+    std::lock_guard<std::mutex> lock(output_mutex_);
+    output_ << line;
+    if (done) {
+        pending_checkpoint_.push_back(job.path);
+        if (pending_checkpoint_.size() >= static_cast<size_t>(std::max(options_.checkpoint_every, 1))) {
+            flushCheckpointLocked();
+        }
+    }
+}
+
+void BatchClient::finishJob() {
+    std::lock_guard<std::mutex> lock(jobs_mutex_);
+    --in_flight_;
+    jobs_cv_.notify_all();
+}
+
+void BatchClient::flushCheckpointLocked() {
+    // Results first, so a checkpointed path always has its line on disk
+    output_.flush();
+    for (const std::string& path : pending_checkpoint_) {
+        checkpoint_ << path << '\n';
+    }
+    checkpoint_.flush();
+    pending_checkpoint_.clear();
+}
+
+void BatchClient::reportProgress() {
+    const double seconds = std::chrono::duration<double>(Clock::now() - start_).count();
+    const uint64_t done = succeeded_ + failed_;
+    int in_flight = 0;
+    {
+        std::lock_guard<std::mutex> lock(jobs_mutex_);
+        in_flight = in_flight_;
+    }
+    char line[256];
+    std::snprintf(line, sizeof(line),
+        "[Batch] %llu done (%.1f/s), %llu failed, %llu skipped, %llu retries, %d in flight, %.1f MB prefetched",
+        static_cast<unsigned long long>(done), seconds > 0 ? done / seconds : 0.0,
+        static_cast<unsigned long long>(failed_.load()), static_cast<unsigned long long>(skipped_.load()),
+        static_cast<unsigned long long>(retry_count_.load()), in_flight, prefetched_.bytes() / 1048576.0);
+    std::cerr << line;
+    for (const BackendPool::Status& server : pool_.status()) {
+        if (server.ejected) {
+            std::cerr << ", " << server.address << " ejected";
+        }
+    }
+    std::cerr << std::endl;
+}
\ No newline at end of file
@@ -0,0 +1,183 @@
+#pragma once
+
+#include "backend_pool.h"
+#include "ocr_service.grpc.pb.h"
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_set>
+#include <vector>
+
+// OCRs every image under a directory tree without a GUI, for jobs too big
+// to hold in memory or to click through.
+//
+//   crawler --paths--> readers --prefetched requests--> sender --RPCs--> results
+//
+// The crawler walks the tree, readers load files ahead of the sender into
+// a queue bounded by count and bytes, and the sender keeps up to
+// max_in_flight images at the server. Transient failures (unavailable,
+// overloaded, deadline) are retried with backoff, honouring the server's
+// pushback hint.
+//
+// Results are appended to a JSONL file in completion order, one line per
+// image. Each image that got a final answer is also appended to the
+// checkpoint file (its path, one per line) once its line is flushed, and a
+// later run over the same tree skips every path listed there. A crash can
+// lose at most the last checkpoint_every entries, which are then OCR'd
+// again, so an image may appear twice in the output but is never missing.
+//
+// With several servers, each attempt goes to the least loaded one that is
+// not ejected (see BackendPool), so a retry usually lands elsewhere.
+struct BatchOptions {
+    BackendPool::Options servers;
+    std::string input_dir;
+    std::string output = "results.jsonl";
+    std::string checkpoint;             // empty: output + ".checkpoint"
+    int max_in_flight = 32;             // images at the server or waiting to retry
+    int readers = 4;
+    int prefetch_files = 64;
+    size_t prefetch_bytes = 256u << 20;
+    int deadline_ms = 120000;           // per attempt; 0: none
+    int retries = 3;                    // after the first attempt
+    int checkpoint_every = 100;
+    ocrservice::ServiceTier tier = ocrservice::TIER_ACCURATE;
+    std::string language;               // empty: the server's default
+};
+
+struct BatchSummary {
+    uint64_t found = 0;         // images in the tree
+    uint64_t skipped = 0;       // already in the checkpoint
+    uint64_t succeeded = 0;
+    uint64_t failed = 0;        // answered, but no text: a bad image
+    uint64_t unfinished = 0;    // gave up on retries, unreadable, or interrupted
+    uint64_t retries = 0;
+    uint64_t bytes_sent = 0;
+    double seconds = 0.0;
+    bool interrupted = false;
+};
+
+class BatchClient {
+public:
+    explicit BatchClient(const BatchOptions& options);
+    ~BatchClient();
+
+    BatchClient(const BatchClient&) = delete;
+    BatchClient& operator=(const BatchClient&) = delete;
+
+    // Opens the output and loads the checkpoint. Returns false, with
+    // error() set, if either cannot be opened.
+    bool open();
+    const std::string& error() const { return error_; }
+
+    // Blocks until every image is done or stop() is called.
+    BatchSummary run();
+
+    // Stops taking new images; those already sent are let finish. Only
+    // stores a flag, so it may be called from a signal handler.
+    void stop() { stopping_.store(true); }
+
+private:
+    using Clock = std::chrono::steady_clock;
+
+    struct Job {
+        std::string path;           // relative to input_dir, as in the checkpoint
+        ocrservice::OCRRequest request;
+        int attempts = 0;
+        Clock::time_point started;  // first attempt
+    };
+
+    struct Call {
+        grpc::ClientContext context;
+        ocrservice::OCRResponse response;
+        std::unique_ptr<Job> job;
+        std::shared_ptr<BackendPool::Backend> backend;
+    };
+
+    struct Retry {
+        Clock::time_point due;
+        std::unique_ptr<Job> job;
+    };
+
+    // Blocking FIFO bounded by item count and total bytes. An item larger
+    // than max_bytes still gets in once the queue is empty.
+    template <typename T>
+    class BoundedQueue {
+    public:
+        BoundedQueue(size_t max_items, size_t max_bytes) : max_items_(max_items), max_bytes_(max_bytes) {}
+
+        // Blocks while full. False once closed.
+        bool push(T item, size_t bytes);
+        // Waits up to timeout. False if nothing came; finished() tells
+        // whether anything ever will.
+        bool popFor(T& item, std::chrono::milliseconds timeout);
+        // Producers are done; what is queued can still be popped.
+        void close();
+        // Drops everything queued and unblocks producers.
+        void cancel();
+        bool finished();
+        size_t bytes();
+
+    private:
+        std::mutex mutex_;
+        std::condition_variable not_full_;
+        std::condition_variable not_empty_;
+        std::deque<std::pair<T, size_t>> items_;
+        const size_t max_items_;
+        const size_t max_bytes_;
+        size_t bytes_ = 0;
+        bool closed_ = false;
+    };
+
+    void crawl();
+    void read();
+    void send(std::unique_ptr<Job> job);
+    // Runs on a gRPC thread.
+    void onDone(Call* call, const grpc::Status& status);
+    // Backoff before attempt number `attempts + 1`, or the server's hint.
+    std::chrono::milliseconds backoff(const Call& call) const;
+    // Writes the job's line; done jobs go to the checkpoint too.
+    void record(const Job& job, bool done, const std::string& json_fields);
+    void finishJob();
+    // Caller holds output_mutex_.
+    void flushCheckpointLocked();
+    void reportProgress();
+
+    const BatchOptions options_;
+    BackendPool pool_;
+    std::string error_;
+
+    std::unordered_set<std::string> done_paths_;    // loaded from the checkpoint
+    BoundedQueue<std::string> paths_;
+    BoundedQueue<std::unique_ptr<Job>> prefetched_;
+    std::thread crawler_;
+    std::vector<std::thread> readers_;
+    std::atomic<int> readers_left_{ 0 };
+    std::atomic<int32_t> next_request_id_{ 1 };
+    std::atomic<bool> stopping_{ false };
+
+    // Jobs taken from the queue and not finished, retries included
+    std::mutex jobs_mutex_;
+    std::condition_variable jobs_cv_;
+    int in_flight_ = 0;
+    std::deque<Retry> retries_;                     // soonest first
+
+    std::mutex output_mutex_;
+    std::ofstream output_;
+    std::ofstream checkpoint_;
+    std::vector<std::string> pending_checkpoint_;   // written, not yet flushed
+
+    Clock::time_point start_;
+    std::atomic<uint64_t> found_{ 0 };
+    std::atomic<uint64_t> skipped_{ 0 };
+    std::atomic<uint64_t> succeeded_{ 0 };
+    std::atomic<uint64_t> failed_{ 0 };
+    std::atomic<uint64_t> retry_count_{ 0 };
+    std::atomic<uint64_t> bytes_sent_{ 0 };
+};
\ No newline at end of file
@@ -0,0 +1,172 @@
+#include "batch_client.h"
+#include <algorithm>
+#include <charconv>
+#include <climits>
+#include <csignal>
+#include <cstdio>
+#include <iostream>
+#include <limits>
+
+BatchClient* client = nullptr;
+
+void signalHandler(int signum) {
+    // Calls already sent finish and are checkpointed; rerun to resume
+    if (client) {
+        client->stop();
+    }
+}
+
+// The whole argument has to be a number; std::stoi would throw out of main
+// on "abc" and quietly accept "64abc"
+template <typename T>
+bool parseNumber(const std::string& flag, const std::string& text, T& value) {
+    const char* end = text.data() + text.size();
+    auto [parsed, error] = std::from_chars(text.data(), end, value);
+    if (error != std::errc() || parsed != end) {
+        std::cerr << "Invalid value '" << text << "' for " << flag << std::endl;
+        return false;
+    }
+    return true;
+}
+
+void printUsage() {
+    std::cerr <<
+        "Usage: ps4_batch --input DIR [options]\n"
+        "  --target HOST:PORT,...  servers to spread images over (localhost:50051)\n"
+        "  --resolver FILE         servers, one per line, reread on change\n"
+        "  --routing outstanding|queue\n"
+        "                          fewest calls from us, or shortest reported queue\n"
+        "  --output FILE           JSONL results, appended to (results.jsonl)\n"
+        "  --checkpoint FILE       finished paths, appended to (OUTPUT.checkpoint)\n"
+        "  --in-flight N           images at the server at once (32)\n"
+        "  --readers N             threads reading files (4)\n"
+        "  --prefetch N            files read ahead of sending (64)\n"
+        "  --prefetch-mb MB        bytes read ahead of sending (256)\n"
+        "  --max-message-mb MB     largest image sent (64)\n"
+        "  --deadline-ms D         per attempt, 0 for none (120000)\n"
+        "  --retries N             extra attempts on transient errors (3)\n"
+        "  --checkpoint-every N    results per checkpoint flush (100)\n"
+        "  --tier accurate|fast    service tier (accurate)\n"
+        "  --language L            Tesseract language (server default)\n";
+}
+
+int main(int argc, char* argv[]) {
+    BatchOptions options;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg == "--input" && i + 1 < argc) {
+            options.input_dir = argv[++i];
+        }
+        else if (arg == "--target" && i + 1 < argc) {
+            options.servers.endpoints.clear();
+            if (!BackendPool::parseEndpoints(argv[++i], options.servers.endpoints)) {
+                std::cerr << "Bad target list '" << argv[i] << "' (expected host:port[,host:port...])" << std::endl;
+                return 2;
+            }
+        }
+        else if (arg == "--resolver" && i + 1 < argc) {
+            options.servers.resolver_file = argv[++i];
+        }
+        else if (arg == "--routing" && i + 1 < argc) {
+            const std::string routing = argv[++i];
+            if (routing != "outstanding" && routing != "queue") {
+                std::cerr << "Unknown routing '" << routing << "' (expected outstanding or queue)" << std::endl;
+                return 2;
+            }
+            options.servers.routing = routing == "queue"
+                ? BackendPool::Routing::ShortestQueue : BackendPool::Routing::LeastOutstanding;
+        }
+        else if (arg == "--output" && i + 1 < argc) {
+            options.output = argv[++i];
+        }
+        else if (arg == "--checkpoint" && i + 1 < argc) {
+            options.checkpoint = argv[++i];
+        }
+        else if (arg == "--in-flight" && i + 1 < argc) {
+            if (!parseNumber(arg, argv[++i], options.max_in_flight)) return 2;
+            options.max_in_flight = std::max(1, options.max_in_flight);
+        }
+        else if (arg == "--readers" && i + 1 < argc) {
+            if (!parseNumber(arg, argv[++i], options.readers)) return 2;
+            options.readers = std::max(1, options.readers);
+        }
+        else if (arg == "--prefetch" && i + 1 < argc) {
+            if (!parseNumber(arg, argv[++i], options.prefetch_files)) return 2;
+            options.prefetch_files = std::max(1, options.prefetch_files);
+        }
+        else if (arg == "--prefetch-mb" && i + 1 < argc) {
+            size_t prefetch_mb = 0;
+            if (!parseNumber(arg, argv[++i], prefetch_mb)) return 2;
+            options.prefetch_bytes = std::min(prefetch_mb, std::numeric_limits<size_t>::max() / (1024 * 1024)) * 1024 * 1024;
+        }
+        else if (arg == "--max-message-mb" && i + 1 < argc) {
+            if (!parseNumber(arg, argv[++i], options.servers.max_message_mb)) return 2;
+            // gRPC takes the limit in bytes as an int
+            options.servers.max_message_mb = std::clamp(options.servers.max_message_mb, 1, INT_MAX / (1024 * 1024));
+        }
+        else if (arg == "--deadline-ms" && i + 1 < argc) {
+            if (!parseNumber(arg, argv[++i], options.deadline_ms)) return 2;
+            options.deadline_ms = std::max(0, options.deadline_ms);
+        }
+        else if (arg == "--retries" && i + 1 < argc) {
+            if (!parseNumber(arg, argv[++i], options.retries)) return 2;
+            options.retries = std::max(0, options.retries);
+        }
+        else if (arg == "--checkpoint-every" && i + 1 < argc) {
+            if (!parseNumber(arg, argv[++i], options.checkpoint_every)) return 2;
+            options.checkpoint_every = std::max(1, options.checkpoint_every);
+        }
+        else if (arg == "--tier" && i + 1 < argc) {
+            const std::string tier = argv[++i];
+            if (tier != "accurate" && tier != "fast") {
+                std::cerr << "Unknown tier '" << tier << "' (expected accurate or fast)" << std::endl;
+                return 2;
+            }
+            options.tier = tier == "fast" ? ocrservice::TIER_FAST : ocrservice::TIER_ACCURATE;
+        }
+        else if (arg == "--language" && i + 1 < argc) {
+            options.language = argv[++i];
+        }
+        else {
+            std::cerr << "Unknown or incomplete option '" << arg << "'" << std::endl;
+            printUsage();
+            return 2;
+        }
+    }
+    if (options.input_dir.empty()) {
+        printUsage();
+        return 2;
+    }
+    if (options.servers.endpoints.empty()) {
+        options.servers.endpoints.push_back("localhost:50051");
+    }
+
+    BatchClient batch(options);
+    if (!batch.open()) {
+        std::cerr << "[Batch] " << batch.error() << std::endl;
+        return 1;
+    }
+    client = &batch;
+    std::signal(SIGINT, signalHandler);
+    std::signal(SIGTERM, signalHandler);
+
+    const BatchSummary summary = batch.run();
+    client = nullptr;
+
+    char line[256];
+    std::snprintf(line, sizeof(line),
+        "[Batch] %s in %.1fs: %llu found, %llu skipped, %llu succeeded, %llu failed, %llu unfinished, "
+        "%llu retries, %.1f MB sent",
+        summary.interrupted ? "Interrupted" : "Done", summary.seconds,
+        static_cast<unsigned long long>(summary.found), static_cast<unsigned long long>(summary.skipped),
+        static_cast<unsigned long long>(summary.succeeded), static_cast<unsigned long long>(summary.failed),
+        static_cast<unsigned long long>(summary.unfinished), static_cast<unsigned long long>(summary.retries),
+        summary.bytes_sent / 1048576.0);
+    std::cerr << line << std::endl;
+
+    // 3: some images are left for the next run
+    if (summary.interrupted) {
+        return 130;
+    }
+    return summary.unfinished > 0 ? 3 : 0;
+}
\ No newline at end of file
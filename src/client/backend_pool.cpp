@@ -0,0 +1,298 @@
+#include "backend_pool.h"
+#include <algorithm>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+
+namespace {
+
+std::string trim(const std::string& text) {
+    const size_t begin = text.find_first_not_of(" \t\r\n");
+    if (begin == std::string::npos) {
+        return std::string();
+    }
+    const size_t end = text.find_last_not_of(" \t\r\n");
+    return text.substr(begin, end - begin + 1);
+}
+
+// host:port, [v6]:port, or a gRPC target URI (dns:///, unix:, ...)
+bool isEndpoint(const std::string& endpoint) {
+    return !endpoint.empty() && endpoint.find(':') != std::string::npos
+        && endpoint.find_first_of(" \t") == std::string::npos;
+}
+
+int tierIndex(ocrservice::ServiceTier tier) {
+    return tier == ocrservice::TIER_FAST ? 1 : 0;
+}
+
+} // namespace
+
+BackendPool::BackendPool(const Options& options)
+    : options_(options) {
+    if (options_.resolver_file.empty()) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        setEndpointsLocked(options_.endpoints);
+    }
+    else {
+        reloadResolver();
+    }
+    if (options_.probe_interval_ms > 0) {
+        prober_ = std::thread(&BackendPool::probeLoop, this);
+    }
+}
+
+BackendPool::~BackendPool() {
+    {
+        std::lock_guard<std::mutex> lock(probe_mutex_);
+        stopping_ = true;
+    }
+    probe_cv_.notify_all();
+    if (prober_.joinable()) {
+        prober_.join();
+    }
+}
+
+bool BackendPool::parseEndpoints(const std::string& list, std::vector<std::string>& endpoints) {
+    std::stringstream stream(list);
+    std::string endpoint;
+    while (std::getline(stream, endpoint, ',')) {
+        endpoint = trim(endpoint);
+        if (!isEndpoint(endpoint)) {
+            return false;
+        }
+        endpoints.push_back(endpoint);
+    }
+    return !endpoints.empty();
+}
+
+std::shared_ptr<BackendPool::Backend> BackendPool::acquire(ocrservice::ServiceTier tier) {
+    const int t = tierIndex(tier);
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (backends_.empty()) {
+        return nullptr;
+    }
+
+    auto score = [this, t](const Backend& backend) {
+        if (options_.routing == Routing::ShortestQueue && backend.reported) {
+            // Tasks per worker, so a bigger box gets proportionally more
+            const int others = std::max(backend.load[t] - backend.outstanding_at_report, 0);
+            return static_cast<double>(others + backend.outstanding) / std::max(backend.workers[t], 1);
+        }
+        return static_cast<double>(backend.outstanding);
+    };
+
+    const Clock::time_point now = Clock::now();
+    std::shared_ptr<Backend> best;
+    std::shared_ptr<Backend> soonest;   // of the ejected ones
+    double best_score = 0.0;
+    // Starting one further each time spreads ties around
+    const size_t n = backends_.size();
+    for (size_t i = 0; i < n; ++i) {
+        const std::shared_ptr<Backend>& backend = backends_[(next_ + i) % n];
+        if (backend->ejected_until > now) {
+            if (!soonest || backend->ejected_until < soonest->ejected_until) {
+                soonest = backend;
+            }
+            continue;
+        }
+        const double s = score(*backend);
+        if (!best || s < best_score) {
+            best = backend;
+            best_score = s;
+        }
+    }
+    next_ = (next_ + 1) % n;
+
+    if (!best) {
+        best = soonest;
+    }
+    ++best->outstanding;
+    return best;
+}
+
+void BackendPool::release(const std::shared_ptr<Backend>& backend, const grpc::Status& status) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    --backend->outstanding;
+    switch (status.error_code()) {
+    case grpc::StatusCode::UNAVAILABLE:
+        failedLocked(*backend, "unavailable");
+        break;
+    case grpc::StatusCode::DEADLINE_EXCEEDED:
+    case grpc::StatusCode::RESOURCE_EXHAUSTED:
+    case grpc::StatusCode::CANCELLED:
+        // Slow, busy or abandoned by us; says nothing about its health
+        break;
+    default:
+        // It answered
+        succeededLocked(*backend);
+        break;
+    }
+}
+
+std::vector<BackendPool::Status> BackendPool::status() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    const Clock::time_point now = Clock::now();
+    std::vector<Status> result;
+    for (const std::shared_ptr<Backend>& backend : backends_) {
+        result.push_back(Status{ backend->address, backend->ejected_until > now, backend->outstanding });
+    }
+    return result;
+}
+
+void BackendPool::setEndpointsLocked(const std::vector<std::string>& endpoints) {
+    std::vector<std::shared_ptr<Backend>> backends;
+    for (const std::string& address : endpoints) {
+        auto same = [&address](const std::shared_ptr<Backend>& backend) { return backend->address == address; };
+        if (std::any_of(backends.begin(), backends.end(), same)) {
+            continue;
+        }
+        auto existing = std::find_if(backends_.begin(), backends_.end(), same);
+        if (existing != backends_.end()) {
+            backends.push_back(*existing);
+            continue;
+        }
+        auto backend = std::make_shared<Backend>();
+        backend->address = address;
+        grpc::ChannelArguments args;
+        args.SetMaxSendMessageSize(options_.max_message_mb * 1024 * 1024);
+        args.SetMaxReceiveMessageSize(options_.max_message_mb * 1024 * 1024);
+        backend->channel = grpc::CreateCustomChannel(address, grpc::InsecureChannelCredentials(), args);
+        backend->stub = ocrservice::OCRService::NewStub(backend->channel);
+        backends.push_back(std::move(backend));
+    }
+    // Removed backends live on until their last lease is released
+    backends_.swap(backends);
+    next_ = 0;
+}
+
+void BackendPool::reloadResolver() {
+    std::error_code error;
+    const auto time = std::filesystem::last_write_time(options_.resolver_file, error);
+    if (error) {
+        // Keep what we have; the file may be in the middle of a replace
+        if (resolver_time_ == std::filesystem::file_time_type()) {
+            std::cerr << "[Backends] Cannot read " << options_.resolver_file << ": " << error.message() << std::endl;
+        }
+        return;
+    }
+    if (time == resolver_time_) {
+        return;
+    }
+
+    std::ifstream file(options_.resolver_file);
+    std::vector<std::string> endpoints;
+    std::string line;
+    while (std::getline(file, line)) {
+        line = trim(line.substr(0, line.find('#')));
+        if (line.empty()) {
+            continue;
+        }
+        if (!isEndpoint(line)) {
+            std::cerr << "[Backends] Ignoring '" << line << "' in " << options_.resolver_file << std::endl;
+            continue;
+        }
+        endpoints.push_back(line);
+    }
+    if (!file.eof()) {
+        return;     // read error; try again next time
+    }
+
+    resolver_time_ = time;
+    std::cerr << "[Backends] " << endpoints.size() << " endpoint(s) from " << options_.resolver_file << std::endl;
+    std::lock_guard<std::mutex> lock(mutex_);
+    setEndpointsLocked(endpoints);
+}
+
+void BackendPool::probeLoop() {
+    std::unique_lock<std::mutex> lock(probe_mutex_);
+    while (!probe_cv_.wait_for(lock, std::chrono::milliseconds(options_.probe_interval_ms), [this] { return stopping_; })) {
+        lock.unlock();
+        if (!options_.resolver_file.empty()) {
+            reloadResolver();
+        }
+        probeAll();
+        lock.lock();
+    }
+}
+
+// GetStats on every backend at once; returns when all have answered or
+// timed out
+void BackendPool::probeAll() {
+    struct Probe {
+        std::shared_ptr<Backend> backend;
+        grpc::ClientContext context;
+        ocrservice::StatsRequest request;
+        ocrservice::StatsResponse response;
+    };
+
+    std::vector<std::shared_ptr<Backend>> backends;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        backends = backends_;
+    }
+    std::vector<std::unique_ptr<Probe>> probes;
+    std::mutex done_mutex;
+    std::condition_variable done_cv;
+    size_t pending = backends.size();
+
+    for (const std::shared_ptr<Backend>& backend : backends) {
+        auto probe = std::make_unique<Probe>();
+        probe->backend = backend;
+        probe->context.set_deadline(std::chrono::system_clock::now() + std::chrono::milliseconds(options_.probe_timeout_ms));
+        Probe* p = probe.get();
+        probes.push_back(std::move(probe));
+        backend->stub->async()->GetStats(&p->context, &p->request, &p->response,
+            [this, p, &done_mutex, &done_cv, &pending](grpc::Status status) {
+                {
+                    std::lock_guard<std::mutex> lock(mutex_);
+                    Backend& backend = *p->backend;
+                    if (status.ok()) {
+                        backend.reported = true;
+                        backend.outstanding_at_report = backend.outstanding;
+                        for (const auto& tier : p->response.tiers()) {
+                            const int t = tierIndex(tier.tier());
+                            backend.workers[t] = tier.workers();
+                            backend.load[t] = static_cast<int>(tier.queue_depth()) + tier.busy_workers();
+                        }
+                        succeededLocked(backend);
+                    }
+                    else if (status.error_code() == grpc::StatusCode::UNIMPLEMENTED) {
+                        // A server from before GetStats: alive, load unknown
+                        succeededLocked(backend);
+                    }
+                    else {
+                        failedLocked(backend, "probe failed");
+                    }
+                }
+                // Notified under the lock: probeAll may return, and its
+                // locals go away, as soon as pending reaches 0
+                std::lock_guard<std::mutex> lock(done_mutex);
+                --pending;
+                done_cv.notify_all();
+            });
+    }
+
+    std::unique_lock<std::mutex> lock(done_mutex);
+    done_cv.wait(lock, [&pending] { return pending == 0; });
+}
+
+void BackendPool::succeededLocked(Backend& backend) {
+    if (backend.failures >= options_.eject_after) {
+        std::cerr << "[Backends] " << backend.address << " is back" << std::endl;
+    }
+    backend.failures = 0;
+    backend.ejected_until = Clock::time_point();
+    backend.eject_ms = 0;
+}
+
+void BackendPool::failedLocked(Backend& backend, const char* why) {
+    ++backend.failures;
+    const Clock::time_point now = Clock::now();
+    // Calls already out when it went down fail together; count them once
+    if (backend.failures < options_.eject_after || backend.ejected_until > now) {
+        return;
+    }
+    backend.eject_ms = backend.eject_ms == 0 ? options_.eject_min_ms : std::min(backend.eject_ms * 2, options_.eject_max_ms);
+    backend.ejected_until = now + std::chrono::milliseconds(backend.eject_ms);
+    std::cerr << "[Backends] Ejecting " << backend.address << " for " << backend.eject_ms << " ms (" << why << ")" << std::endl;
+}
\ No newline at end of file
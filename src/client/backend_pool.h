@@ -0,0 +1,126 @@
+#pragma once
+
+#include "ocr_service.grpc.pb.h"
+#include <grpcpp/grpcpp.h>
+#include <chrono>
+#include <condition_variable>
+#include <filesystem>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Spreads calls over several OCR servers, one channel each.
+//
+// Each call leases the backend that looks least loaded and hands the lease
+// back with the call's status:
+//
+//     auto backend = pool.acquire(tier);
+//     backend->stub->async()->ProcessImage(..., [&](grpc::Status status) {
+//         pool.release(backend, status);
+//     });
+//
+// Load is this client's outstanding calls by default, or, with
+// Routing::ShortestQueue, the queued and running tasks per worker that each
+// server last reported through GetStats, with this client's own share
+// replaced by its calls outstanding now, which also sees other clients'
+// work.
+//
+// A backend that fails eject_after calls in a row with UNAVAILABLE, or
+// stops answering the background GetStats probe, is ejected: it gets no
+// calls until its ejection ends, then one more chance. Each ejection in a
+// row lasts twice as long, up to eject_max_ms; a probe that gets through
+// reinstates it at once. With every backend ejected, calls go to the one
+// due back first rather than nowhere.
+class BackendPool {
+public:
+    enum class Routing {
+        LeastOutstanding,
+        ShortestQueue,
+    };
+
+    struct Options {
+        std::vector<std::string> endpoints;     // host:port
+        // One host:port per line, '#' starts a comment. Reread whenever it
+        // changes, so backends can be added and drained without a restart.
+        // Used instead of endpoints when set.
+        std::string resolver_file;
+        Routing routing = Routing::LeastOutstanding;
+        int probe_interval_ms = 1000;
+        int probe_timeout_ms = 500;
+        int eject_after = 3;
+        int eject_min_ms = 1000;
+        int eject_max_ms = 30000;
+        // Both ways; the server's --max-message-mb must allow as much
+        int max_message_mb = 64;
+    };
+
+    struct Backend {
+        std::string address;
+        std::shared_ptr<grpc::Channel> channel;
+        std::unique_ptr<ocrservice::OCRService::Stub> stub;
+
+    private:
+        friend class BackendPool;
+        using Clock = std::chrono::steady_clock;
+
+        // Guarded by the pool's mutex
+        int outstanding = 0;
+        int failures = 0;                   // UNAVAILABLE in a row
+        Clock::time_point ejected_until;    // past: in service
+        int eject_ms = 0;
+        bool reported = false;              // has answered a probe with stats
+        int workers[2] = {};                // by ServiceTier, as last reported
+        int load[2] = {};                   // queued + running, as last reported
+        int outstanding_at_report = 0;      // ours, counted in load
+    };
+
+    struct Status {
+        std::string address;
+        bool ejected;
+        int outstanding;
+    };
+
+    explicit BackendPool(const Options& options);
+    ~BackendPool();
+
+    BackendPool(const BackendPool&) = delete;
+    BackendPool& operator=(const BackendPool&) = delete;
+
+    // "host:port,host:port" into endpoints; false if any is malformed.
+    static bool parseEndpoints(const std::string& list, std::vector<std::string>& endpoints);
+
+    // nullptr only when no backend is configured.
+    std::shared_ptr<Backend> acquire(ocrservice::ServiceTier tier);
+    // Once per acquire, when the call is over.
+    void release(const std::shared_ptr<Backend>& backend, const grpc::Status& status);
+
+    std::vector<Status> status();
+
+private:
+    using Clock = std::chrono::steady_clock;
+
+    // Replaces the backend list, keeping the channels of addresses still in
+    // it. Caller holds mutex_.
+    void setEndpointsLocked(const std::vector<std::string>& endpoints);
+    void reloadResolver();
+    void probeLoop();
+    void probeAll();
+    // Caller holds mutex_.
+    void succeededLocked(Backend& backend);
+    void failedLocked(Backend& backend, const char* why);
+
+    const Options options_;
+
+    std::mutex mutex_;
+    std::vector<std::shared_ptr<Backend>> backends_;
+    size_t next_ = 0;   // rotates ties
+
+    std::filesystem::file_time_type resolver_time_;
+
+    std::mutex probe_mutex_;
+    std::condition_variable probe_cv_;
+    bool stopping_ = false;
+    std::thread prober_;
+};
\ No newline at end of file
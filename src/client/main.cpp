@@ -1,11 +1,58 @@
 #include <QApplication>
+#include <QCommandLineParser>
+#include <algorithm>
+#include <climits>
+#include <iostream>
 #include "mainwindow.h"
 
 int main(int argc, char* argv[])
 {
     QApplication app(argc, argv);
 
-    MainWindow window;
+    QCommandLineParser parser;
+    parser.addHelpOption();
+    QCommandLineOption serverOption("server",
+        "OCR servers to spread images over, comma separated.", "host:port[,host:port...]", "localhost:50051");
+    QCommandLineOption resolverOption("resolver",
+        "File listing one server per line, reread when it changes. Overrides --server.", "file");
+    QCommandLineOption routingOption("routing",
+        "outstanding: fewest calls from this client; queue: shortest queue reported by the server.",
+        "outstanding|queue", "outstanding");
+    QCommandLineOption maxMessageOption("max-message-mb",
+        "Largest image sent, in MB. The server must accept as much.", "MB", "64");
+    parser.addOption(serverOption);
+    parser.addOption(resolverOption);
+    parser.addOption(routingOption);
+    parser.addOption(maxMessageOption);
+    parser.process(app);
+
+    BackendPool::Options options;
+    if (parser.isSet(resolverOption)) {
+        options.resolver_file = parser.value(resolverOption).toStdString();
+    }
+    else if (!BackendPool::parseEndpoints(parser.value(serverOption).toStdString(), options.endpoints)) {
+        std::cerr << "Bad --server list '" << parser.value(serverOption).toStdString()
+            << "' (expected host:port[,host:port...])" << std::endl;
+        return 2;
+    }
+    bool numeric = false;
+    options.max_message_mb = parser.value(maxMessageOption).toInt(&numeric);
+    if (!numeric) {
+        std::cerr << "Invalid --max-message-mb '" << parser.value(maxMessageOption).toStdString() << "'" << std::endl;
+        return 2;
+    }
+    // gRPC takes the limit in bytes as an int
+    options.max_message_mb = std::clamp(options.max_message_mb, 1, INT_MAX / (1024 * 1024));
+    const QString routing = parser.value(routingOption);
+    if (routing == "queue") {
+        options.routing = BackendPool::Routing::ShortestQueue;
+    }
+    else if (routing != "outstanding") {
+        std::cerr << "Unknown routing '" << routing.toStdString() << "' (expected outstanding or queue)" << std::endl;
+        return 2;
+    }
+
+    MainWindow window(std::make_shared<BackendPool>(options));
     window.show();
 
     return app.exec();
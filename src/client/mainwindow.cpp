@@ -8,121 +8,576 @@
 #include <QListWidgetItem>
 #include <QTimer>
 #include <QFileInfo>
+#include <QFile>
+#include <QSet>
+#include <QHash>
+#include <algorithm>
+#include <chrono>
+#include <deque>
 
 // OCRClientWorker implementation
-OCRClientWorker::OCRClientWorker(std::shared_ptr<grpc::Channel> channel)
-    : stub_(ocrservice::OCRService::NewStub(channel)), shutdown_(false), deadlineEnabled_(false)
+
+// State for one unary ProcessImage call; deleted on the worker thread once
+// its callback has run.
+struct OCRClientWorker::UnaryCall {
+    int requestId = 0;
+    std::shared_ptr<BackendPool::Backend> backend;
+    grpc::ClientContext context;
+    ocrservice::OCRRequest request;
+    ocrservice::OCRResponse response;
+    std::chrono::high_resolution_clock::time_point startTime;
+};
+
+// One ProcessImageStream call to one server, carrying the images of upload
+// batches routed there. The worker thread decides when the next image may
+// be sent (the in-flight window) and where; reads and write completions run
+// on gRPC threads and post back to the worker. Each image sent holds a
+// lease on the backend until its result is in.
+class OCRClientWorker::BatchStream final
+    : public grpc::ClientBidiReactor<ocrservice::OCRRequest, ocrservice::OCRResponse> {
+public:
+    BatchStream(OCRClientWorker* worker, std::shared_ptr<BackendPool::Backend> backend)
+        : worker_(worker), backend_(std::move(backend)), startTime_(std::chrono::high_resolution_clock::now())
+    {
+        worker_->trackCall(&context_);
+        backend_->stub->async()->ProcessImageStream(&context_, this);
+        StartRead(&response_);
+        // Writes are started from the worker thread, outside any reaction,
+        // so keep the call open until we have half-closed
+        AddHold();
+        StartCall();
+    }
+
+    const std::shared_ptr<BackendPool::Backend>& backend() const { return backend_; }
+
+    // Neither broken nor half-closed
+    bool writable() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return !broken_ && !writesClosed_;
+    }
+
+    // Worker thread. Returns false if the stream has already ended, in which
+    // case nothing was sent.
+    bool send(int requestId, ocrservice::OCRRequest request) {
+        const ocrservice::OCRRequest* next = nullptr;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (broken_) return false;
+            awaiting_.insert(requestId);
+            // Only one write may be outstanding; deque keeps addresses stable
+            writes_.push_back(std::move(request));
+            if (!writing_) {
+                writing_ = true;
+                next = &writes_.front();
+            }
+        }
+        if (next) StartWrite(next);
+        return true;
+    }
+
+    // Worker thread: nothing more will be sent
+    void closeWrites() {
+        bool now = false;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (writesClosed_) return;
+            writesClosed_ = true;
+            now = !writing_;
+        }
+        if (now) {
+            StartWritesDone();
+            RemoveHold();
+        }
+    }
+
+    void OnWriteDone(bool ok) override {
+        const ocrservice::OCRRequest* next = nullptr;
+        bool halfClose = false;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            writes_.pop_front();
+            if (!ok) {
+                // Stream is broken; queued requests stay in awaiting_ and
+                // are failed in OnDone
+                broken_ = true;
+                writes_.clear();
+            }
+            if (!writes_.empty()) {
+                next = &writes_.front();
+            }
+            else {
+                writing_ = false;
+                halfClose = writesClosed_;
+            }
+        }
+        if (next) {
+            StartWrite(next);
+        }
+        else if (halfClose) {
+            StartWritesDone();
+            RemoveHold();
+        }
+        if (!ok) {
+            schedulePump();
+        }
+    }
+
+    void OnReadDone(bool ok) override {
+        if (!ok) {
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                broken_ = true;
+            }
+            schedulePump();
+            return;
+        }
+
+        int requestId = response_.request_id();
+        if (response_.has_progress()) {
+            // Interim update; the result for this page comes later
+            const int pageCount = std::max(response_.page_count(), 1);
+            int pagesDone = 0;
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                auto pages = pages_.constFind(requestId);
+                if (pages != pages_.constEnd()) {
+                    pagesDone = pages->received;
+                }
+            }
+            emit worker_->progressReady(requestId,
+                (pagesDone * 100 + response_.progress().percent()) / pageCount);
+            StartRead(&response_);
+            return;
+        }
+
+        QString text = QString::fromStdString(response_.text());
+        bool success = response_.success();
+        QString error = QString::fromStdString(response_.error_message());
+        bool known = false;
+        bool complete = true;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            const int pageCount = response_.page_count();
+            const int page = response_.page();
+            if (pageCount > 1 && page >= 0 && page < pageCount) {
+                // A multi-page TIFF is answered page by page, in any order;
+                // report it once every page is in
+                PageSet& pages = pages_[requestId];
+                if (pages.texts.isEmpty()) {
+                    pages.texts.resize(pageCount);
+                }
+                pages.texts[page] = text;
+                if (!success) {
+                    pages.errors << QString("Page %1: %2").arg(page + 1).arg(error);
+                }
+                complete = ++pages.received == pageCount;
+                if (complete) {
+                    text = pages.texts.join("\n\n");
+                    success = pages.errors.isEmpty();
+                    error = pages.errors.join(" ");
+                    pages_.remove(requestId);
+                }
+            }
+            if (complete) {
+                known = awaiting_.remove(requestId);
+            }
+        }
+
+        qDebug() << "[Client] Stream result for request" << requestId
+            << "Page:" << response_.page() + 1 << "of" << std::max(response_.page_count(), 1)
+            << "Success:" << response_.success()
+            << "Text length:" << response_.text().length();
+
+        if (!complete) {
+            StartRead(&response_);
+            return;
+        }
+
+        emit worker_->resultReady(requestId, text, success, error);
+
+        if (known) {
+            worker_->pool_->release(backend_, grpc::Status::OK);
+            OCRClientWorker* worker = worker_;
+            QMetaObject::invokeMethod(worker, [worker]() { worker->onCallFinished(1); }, Qt::QueuedConnection);
+        }
+        StartRead(&response_);
+    }
+
+    void OnDone(const grpc::Status& status) override {
+        auto duration = std::chrono::duration_cast<std::chrono::milliseconds>(
+            std::chrono::high_resolution_clock::now() - startTime_);
+        qDebug() << "[Client] Batch stream finished in" << duration.count() << "ms. Status ok:" << status.ok();
+
+        QList<int> unanswered;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            unanswered = awaiting_.values();
+            awaiting_.clear();
+        }
+
+        QString error = status.ok() ? QString("No result received")
+            : QString("gRPC error: %1").arg(status.error_message().c_str());
+        for (int requestId : unanswered) {
+            emit worker_->resultReady(requestId, "", false, error);
+            worker_->pool_->release(backend_, status);
+        }
+
+        // The worker deletes us, possibly before this function returns, so
+        // take everything needed from `this` first
+        OCRClientWorker* worker = worker_;
+        BatchStream* self = this;
+        grpc::ClientContext* context = &context_;
+        int released = static_cast<int>(unanswered.size());
+        QMetaObject::invokeMethod(worker, [worker, self, released]() {
+            worker->onStreamDone(self, released);
+        }, Qt::QueuedConnection);
+
+        // Must be last: the worker's destructor may proceed after this
+        worker->untrackCall(context);
+    }
+
+private:
+    void schedulePump() {
+        OCRClientWorker* worker = worker_;
+        QMetaObject::invokeMethod(worker, [worker]() { worker->pump(); }, Qt::QueuedConnection);
+    }
+
+    OCRClientWorker* worker_;
+    std::shared_ptr<BackendPool::Backend> backend_;
+    grpc::ClientContext context_;
+    ocrservice::OCRResponse response_;
+    std::chrono::high_resolution_clock::time_point startTime_;
+
+    std::mutex mutex_;
+    std::deque<ocrservice::OCRRequest> writes_;
+    QSet<int> awaiting_;    // sent, no result yet
+
+    struct PageSet {
+        QStringList texts;     // by page index
+        QStringList errors;
+        int received = 0;
+    };
+    QHash<int, PageSet> pages_; // multi-page requests with pages outstanding
+    bool writing_ = false;
+    bool writesClosed_ = false;
+    bool broken_ = false;
+};
+
+OCRClientWorker::OCRClientWorker(std::shared_ptr<BackendPool> pool)
+    : pool_(std::move(pool)), shutdown_(false), deadlineEnabled_(false),
+      rawPixelsEnabled_(false), maxInFlight_(kDefaultMaxInFlight), inFlight_(0)
 {
 }
 
 OCRClientWorker::~OCRClientWorker() {
     shutdown_ = true;
+
+    // Half-close every stream so its hold is released, cancel everything
+    // still running and wait for the callbacks that reference us
+    for (BatchStream* stream : streams_) {
+        stream->closeWrites();
+    }
+    {
+        std::unique_lock<std::mutex> lock(callsMutex_);
+        for (grpc::ClientContext* context : liveCalls_) {
+            context->TryCancel();
+        }
+        callsCv_.wait(lock, [this]() { return liveCalls_.isEmpty(); });
+    }
+    qDeleteAll(streams_);
+}
+
+void OCRClientWorker::setMaxInFlight(int maxInFlight) {
+    maxInFlight_ = std::max(1, maxInFlight);
+    qDebug() << "[Client] Max in-flight RPCs:" << maxInFlight_;
+    pump();
 }
 
-void OCRClientWorker::processImage(int requestId, const QImage& image, const QString& filePath) {
+void OCRClientWorker::processImage(int requestId, const QString& filePath) {
     if (shutdown_) return;
 
-    qDebug() << "[Client] Processing image. Request ID:" << requestId
+    qDebug() << "[Client] Queueing image. Request ID:" << requestId
         << "File:" << filePath
-        << "Image size:" << image.size()
         << "Deadline enabled:" << deadlineEnabled_.load();
 
-    try {
-        // Convert QImage to byte array
-        QByteArray imageBytes;
-        QBuffer buffer(&imageBytes);
-        buffer.open(QIODevice::WriteOnly);
-        bool saved = image.save(&buffer, "PNG");
+    unaryQueue_.enqueue(OCRJob{ requestId, filePath });
+    pump();
+}
 
-        if (!saved) {
-            qDebug() << "[Client] Failed to convert image to PNG format";
-            emit resultReady(requestId, "", false, "Failed to convert image to PNG");
-            return;
+void OCRClientWorker::processBatch(const QList<OCRJob>& jobs) {
+    if (shutdown_ || jobs.isEmpty()) return;
+
+    qDebug() << "[Client] Streaming batch of" << jobs.size() << "images";
+
+    for (const OCRJob& job : jobs) {
+        streamQueue_.enqueue(job);
+    }
+    pump();
+}
+
+void OCRClientWorker::pump() {
+    if (shutdown_) return;
+
+    // A broken stream gets nothing more; half-close it so OnDone can fail
+    // what it still owes and give back those in-flight slots
+    for (BatchStream* stream : streams_) {
+        if (!stream->writable()) {
+            stream->closeWrites();
         }
+    }
 
-        qDebug() << "[Client] Image converted to PNG. Size:" << imageBytes.size() << "bytes";
+    while (inFlight_ < maxInFlight_) {
+        OCRJob job;
+        bool streamed = false;
+        if (!unaryQueue_.isEmpty()) {
+            job = unaryQueue_.dequeue();
+        }
+        else if (!streamQueue_.isEmpty()) {
+            job = streamQueue_.dequeue();
+            streamed = true;
+        }
+        else {
+            break;
+        }
 
-        // Prepare gRPC request
         ocrservice::OCRRequest request;
-        request.set_image_data(imageBytes.constData(), imageBytes.size());
-        request.set_request_id(requestId);
+        request.set_request_id(job.requestId);
+        if (!fillImage(job.filePath, request)) {
+            emit resultReady(job.requestId, "", false, "Failed to read image file");
+            continue;
+        }
 
-        qDebug() << "[Client] Sending gRPC request. Request ID:" << request.request_id()
-            << "Image data size:" << request.image_data().size() << "bytes";
+        // Each image goes to whichever server is least loaded right now
+        std::shared_ptr<BackendPool::Backend> backend = pool_->acquire(request.tier());
+        if (!backend) {
+            emit resultReady(job.requestId, "", false, "No OCR server configured");
+            continue;
+        }
 
-        // Send request with optional deadline
-        grpc::ClientContext context;
+        if (streamed) {
+            request.set_report_progress(true);
+            if (!streamFor(backend)->send(job.requestId, std::move(request))) {
+                // It broke since streamFor looked; the next try opens a new one
+                pool_->release(backend, grpc::Status(grpc::StatusCode::UNAVAILABLE, "stream closed"));
+                streamQueue_.prepend(job);
+                continue;
+            }
+        }
+        else {
+            startUnary(job.requestId, std::move(request), std::move(backend));
+        }
+        ++inFlight_;
+    }
 
-        // Set a deadline
-        if (deadlineEnabled_) {
-            auto deadline = std::chrono::system_clock::now() + std::chrono::milliseconds(500);
-            context.set_deadline(deadline);
-            qDebug() << "[Client] Deadline set to 500ms for request" << requestId;
+    // With nothing left to send, every stream can half-close
+    if (streamQueue_.isEmpty()) {
+        for (BatchStream* stream : streams_) {
+            stream->closeWrites();
         }
+    }
+}
+
+OCRClientWorker::BatchStream* OCRClientWorker::streamFor(const std::shared_ptr<BackendPool::Backend>& backend) {
+    for (BatchStream* stream : streams_) {
+        if (stream->backend() == backend && stream->writable()) {
+            return stream;
+        }
+    }
+    qDebug() << "[Client] Opening a stream to" << QString::fromStdString(backend->address);
+    BatchStream* stream = new BatchStream(this, backend);
+    streams_.append(stream);
+    return stream;
+}
+
+void OCRClientWorker::startUnary(int requestId, ocrservice::OCRRequest request,
+    std::shared_ptr<BackendPool::Backend> backend) {
+    UnaryCall* call = new UnaryCall();
+    call->requestId = requestId;
+    call->backend = std::move(backend);
+    call->request = std::move(request);
 
-        ocrservice::OCRResponse response;
+    qDebug() << "[Client] Sending gRPC request. Request ID:" << requestId
+        << "Server:" << QString::fromStdString(call->backend->address)
+        << "Image data size:" << call->request.image_data().size() << "bytes";
 
-        auto start_time = std::chrono::high_resolution_clock::now();
-        grpc::Status status = stub_->ProcessImage(&context, request, &response);
-        auto end_time = std::chrono::high_resolution_clock::now();
-        auto duration = std::chrono::duration_cast<std::chrono::milliseconds>(end_time - start_time);
+    // Set a deadline
+    if (deadlineEnabled_) {
+        auto deadline = std::chrono::system_clock::now() + std::chrono::milliseconds(500);
+        call->context.set_deadline(deadline);
+        qDebug() << "[Client] Deadline set to 500ms for request" << requestId;
+    }
+
+    trackCall(&call->context);
+    call->startTime = std::chrono::high_resolution_clock::now();
+    call->backend->stub->async()->ProcessImage(&call->context, &call->request, &call->response,
+        [this, call](grpc::Status status) { onUnaryDone(call, status); });
+}
+
+// Runs on a gRPC thread.
+void OCRClientWorker::onUnaryDone(UnaryCall* call, const grpc::Status& status) {
+    const int requestId = call->requestId;
+    const ocrservice::OCRResponse& response = call->response;
+
+    auto end_time = std::chrono::high_resolution_clock::now();
+    auto duration = std::chrono::duration_cast<std::chrono::milliseconds>(end_time - call->startTime);
 
-        qDebug() << "[Client] Received response in" << duration.count() << "ms";
+    qDebug() << "[Client] Received response in" << duration.count() << "ms";
+    pool_->release(call->backend, status);
 
-        if (status.ok()) {
-            qDebug() << "[Client] Response request_id:" << response.request_id();
-            qDebug() << "[Client] Response success:" << response.success();
-            qDebug() << "[Client] Response text length:" << response.text().length();
-            qDebug() << "[Client] Request" << requestId << "successful. "
-                << "Text length:" << response.text().length()
-                << "Success:" << response.success();
+    if (status.ok()) {
+        qDebug() << "[Client] Request" << requestId << "successful. "
+            << "Text length:" << response.text().length()
+            << "Success:" << response.success();
 
-            emit resultReady(requestId,
-                QString::fromStdString(response.text()),
-                response.success(),
-                QString::fromStdString(response.error_message()));
+        // Pages of a multi-page TIFF come joined with form feeds
+        emit resultReady(requestId,
+            QString::fromStdString(response.text()).replace('\f', "\n\n"),
+            response.success(),
+            QString::fromStdString(response.error_message()));
+    }
+    else {
+        // Check if it's a deadline exceeded error
+        if (status.error_code() == grpc::StatusCode::DEADLINE_EXCEEDED) {
+            qDebug() << "[Client] Deadline exceeded for request" << requestId;
+            emit resultReady(requestId, "", false, "Deadline");
         }
         else {
-            // Check if it's a deadline exceeded error
-            if (status.error_code() == grpc::StatusCode::DEADLINE_EXCEEDED) {
-                qDebug() << "[Client] Deadline exceeded for request" << requestId;
-                emit resultReady(requestId, "", false, "Deadline");
-            }
-            else {
-                qDebug() << "[Client] gRPC error for request" << requestId
-                    << ":" << QString::fromStdString(status.error_message());
-                emit resultReady(requestId, "", false,
-                    QString("gRPC error: %1").arg(status.error_message().c_str()));
-            }
+            qDebug() << "[Client] gRPC error for request" << requestId
+                << ":" << QString::fromStdString(status.error_message());
+            emit resultReady(requestId, "", false,
+                QString("gRPC error: %1").arg(status.error_message().c_str()));
         }
     }
-    catch (const std::exception& e) {
-        qDebug() << "[Client] Exception for request" << requestId << ":" << e.what();
-        emit resultReady(requestId, "", false, QString("Exception: %1").arg(e.what()));
+
+    // The call is deleted on the worker thread, so don't touch it after posting
+    grpc::ClientContext* context = &call->context;
+    QMetaObject::invokeMethod(this, [this, call]() {
+        delete call;
+        onCallFinished(1);
+    }, Qt::QueuedConnection);
+
+    // Must be last: the destructor may proceed after this
+    untrackCall(context);
+}
+
+void OCRClientWorker::onCallFinished(int count) {
+    inFlight_ -= count;
+    pump();
+}
+
+void OCRClientWorker::onStreamDone(BatchStream* stream, int released) {
+    streams_.removeOne(stream);
+    delete stream;
+    onCallFinished(released);
+}
+
+void OCRClientWorker::trackCall(grpc::ClientContext* context) {
+    std::lock_guard<std::mutex> lock(callsMutex_);
+    liveCalls_.insert(context);
+}
+
+void OCRClientWorker::untrackCall(grpc::ClientContext* context) {
+    std::lock_guard<std::mutex> lock(callsMutex_);
+    liveCalls_.remove(context);
+    if (liveCalls_.isEmpty()) {
+        callsCv_.notify_all();
     }
 }
 
+bool OCRClientWorker::fillImage(const QString& filePath, ocrservice::OCRRequest& request) {
+    if (rawPixelsEnabled_) {
+        // Decode here so the server can skip pixReadMem and pixConvertTo8
+        QImageReader reader(filePath);
+        reader.setAutoTransform(true);
+        QImage image = reader.read();
+        if (image.isNull()) {
+            qDebug() << "[Client] Failed to decode" << filePath << ":" << reader.errorString();
+            return false;
+        }
+        image = image.convertToFormat(QImage::Format_Grayscale8);
+
+        ocrservice::RawPixels* raw = request.mutable_raw_pixels();
+        raw->set_width(image.width());
+        raw->set_height(image.height());
+        raw->set_stride(static_cast<int>(image.bytesPerLine()));
+        raw->set_data(reinterpret_cast<const char*>(image.constBits()), static_cast<size_t>(image.sizeInBytes()));
+
+        qDebug() << "[Client] Sending raw grayscale pixels" << image.size()
+            << "Size:" << raw->data().size() << "bytes";
+        return true;
+    }
+
+    QByteArray imageBytes;
+    QByteArray format;
+    if (!loadImageBytes(filePath, imageBytes, format)) {
+        return false;
+    }
+    request.set_image_data(imageBytes.constData(), imageBytes.size());
+    request.set_format(format.toStdString());
+    return true;
+}
+
+bool OCRClientWorker::loadImageBytes(const QString& filePath, QByteArray& imageBytes, QByteArray& format) {
+    // Formats the server's Leptonica decodes itself; these go out untouched
+    static const QSet<QByteArray> kServerFormats = {
+        "png", "jpeg", "bmp", "tif", "tiff", "gif", "webp", "pbm", "pgm", "ppm"
+    };
+
+    // Sniff the real format from the file contents, not the extension
+    format = QImageReader::imageFormat(filePath);
+    if (kServerFormats.contains(format)) {
+        QFile file(filePath);
+        if (!file.open(QIODevice::ReadOnly)) {
+            qDebug() << "[Client] Failed to open" << filePath;
+            return false;
+        }
+        imageBytes = file.readAll();
+        qDebug() << "[Client] Sending original" << format << "bytes. Size:" << imageBytes.size() << "bytes";
+        return !imageBytes.isEmpty();
+    }
+
+    // Only formats the server cannot decode are re-encoded
+    QImage image(filePath);
+    if (image.isNull()) {
+        qDebug() << "[Client] Failed to decode" << filePath;
+        return false;
+    }
+    QBuffer buffer(&imageBytes);
+    buffer.open(QIODevice::WriteOnly);
+    if (!image.save(&buffer, "PNG")) {
+        qDebug() << "[Client] Failed to convert image to PNG format";
+        return false;
+    }
+
+    qDebug() << "[Client] Re-encoded" << format << "image to PNG. Size:" << imageBytes.size() << "bytes";
+    format = "png";
+    return true;
+}
+
 // MainWindow implementation
-MainWindow::MainWindow(QWidget* parent)
+MainWindow::MainWindow(std::shared_ptr<BackendPool> pool, QWidget* parent)
     : QMainWindow(parent), completedCount_(0), nextRequestId_(1), totalInCurrentBatch_(0), deadlineEnabled_(false)
 {
-    // Setup gRPC channel
-    channel_ = grpc::CreateChannel("10.98.53.240:50051", grpc::InsecureChannelCredentials());
-    stub_ = ocrservice::OCRService::NewStub(channel_);
-
     // Setup worker thread
     workerThread_ = new QThread(this);
-    worker_ = new OCRClientWorker(channel_);
+    worker_ = new OCRClientWorker(std::move(pool));
     worker_->moveToThread(workerThread_);
 
     connect(worker_, &OCRClientWorker::resultReady,
         this, &MainWindow::onOCRResultReady, Qt::QueuedConnection);
+    connect(worker_, &OCRClientWorker::progressReady,
+        this, &MainWindow::onOCRProgress, Qt::QueuedConnection);
 
     qDebug() << "[Client] Signal-slot connection established";
     connect(workerThread_, &QThread::finished, worker_, &QObject::deleteLater);
 
     workerThread_->start();
 
+    progressTimer_ = new QTimer(this);
+    progressTimer_->setSingleShot(true);
+    progressTimer_->setInterval(kProgressIntervalMs);
+    connect(progressTimer_, &QTimer::timeout, this, &MainWindow::flushProgress);
+
     setupUI();
 }
 
@@ -155,6 +610,18 @@ void MainWindow::setupUI()
     buttonLayout->addWidget(clearButton);
     buttonLayout->addWidget(deadlineButton);
 
+    rawPixelsButton = new QPushButton("Transport: Encoded", this);
+    rawPixelsButton->setCheckable(true);
+    rawPixelsButton->setToolTip("Send decoded 8-bit grayscale pixels so the server skips image decoding");
+    buttonLayout->addWidget(rawPixelsButton);
+
+    // Window of images sent to the server but not yet answered
+    inFlightSpinBox = new QSpinBox(this);
+    inFlightSpinBox->setRange(1, 64);
+    inFlightSpinBox->setValue(OCRClientWorker::kDefaultMaxInFlight);
+    inFlightSpinBox->setPrefix("In flight: ");
+    buttonLayout->addWidget(inFlightSpinBox);
+
     progressBar = new QProgressBar(this);
     resultsDisplay = new QTextEdit(this);
     statusLabel = new QLabel("Ready to upload images", this);
@@ -185,6 +652,8 @@ void MainWindow::setupUI()
     connect(uploadButton, &QPushButton::clicked, this, &MainWindow::onUploadClicked);
     connect(clearButton, &QPushButton::clicked, this, &MainWindow::onClearClicked);
     connect(deadlineButton, &QPushButton::clicked, this, &MainWindow::onDeadlineToggled);
+    connect(rawPixelsButton, &QPushButton::clicked, this, &MainWindow::onRawPixelsToggled);
+    connect(inFlightSpinBox, &QSpinBox::valueChanged, this, &MainWindow::onMaxInFlightChanged);
 
     setWindowTitle("Distributed OCR Client");
     resize(800, 600);
@@ -207,6 +676,22 @@ void MainWindow::onDeadlineToggled()
     qDebug() << "[Client] Deadline mode:" << (deadlineEnabled_ ? "ENABLED" : "DISABLED");
 }
 
+void MainWindow::onRawPixelsToggled()
+{
+    bool enabled = rawPixelsButton->isChecked();
+    rawPixelsButton->setText(enabled ? "Transport: Raw" : "Transport: Encoded");
+
+    worker_->setRawPixelsEnabled(enabled);
+    qDebug() << "[Client] Raw pixel transport:" << (enabled ? "ENABLED" : "DISABLED");
+}
+
+void MainWindow::onMaxInFlightChanged(int maxInFlight)
+{
+    OCRClientWorker* worker = worker_;
+    QMetaObject::invokeMethod(worker_, [worker, maxInFlight]() { worker->setMaxInFlight(maxInFlight); },
+        Qt::QueuedConnection);
+}
+
 QWidget* MainWindow::createThumbnailWidget(const QImage& image, const QString& fileName, const QString& status)
 {
     QWidget* widget = new QWidget();
@@ -215,12 +700,13 @@ QWidget* MainWindow::createThumbnailWidget(const QImage& image, const QString& f
 
     // Create thumbnail
     QLabel* imageLabel = new QLabel();
-    QPixmap pixmap = QPixmap::fromImage(image.scaled(100, 100, Qt::KeepAspectRatio, Qt::SmoothTransformation));
+    QPixmap pixmap = QPixmap::fromImage(image);
     imageLabel->setPixmap(pixmap);
     imageLabel->setAlignment(Qt::AlignCenter);
 
-    // Create text label
+    // Create text label; updateThumbnailStatus finds it by name
     QLabel* textLabel = new QLabel(QString("%1\n%2").arg(fileName).arg(status));
+    textLabel->setObjectName("thumbnailStatus");
     textLabel->setAlignment(Qt::AlignCenter);
     textLabel->setWordWrap(true);
     textLabel->setMaximumWidth(120);
@@ -231,6 +717,25 @@ QWidget* MainWindow::createThumbnailWidget(const QImage& image, const QString& f
     return widget;
 }
 
+QImage MainWindow::loadThumbnail(const QString& filePath)
+{
+    QImageReader reader(filePath);
+    reader.setAutoTransform(true);
+
+    // Let the decoder downscale (JPEG decodes at 1/2..1/8 directly) instead
+    // of decoding the full scan and scaling afterwards
+    QSize size = reader.size();
+    if (size.isValid()) {
+        reader.setScaledSize(size.scaled(100, 100, Qt::KeepAspectRatio));
+    }
+
+    QImage thumbnail = reader.read();
+    if (thumbnail.isNull()) {
+        qDebug() << "[Client] Thumbnail read failed for" << filePath << ":" << reader.errorString();
+    }
+    return thumbnail;
+}
+
 void MainWindow::updateThumbnailStatus(int index, const QString& status)
 {
     if (index >= 0 && index < fileListWidget->count()) {
@@ -239,8 +744,16 @@ void MainWindow::updateThumbnailStatus(int index, const QString& status)
             QMutexLocker locker(&batchMutex_);
             if (index < currentBatch_.size()) {
                 QString fileName = QFileInfo(currentBatch_[index].filePath).fileName();
+                // Only the text changes; rebuilding the widget would redo
+                // the pixmap and the layout for every update
+                QWidget* existing = fileListWidget->itemWidget(item);
+                QLabel* label = existing ? existing->findChild<QLabel*>("thumbnailStatus") : nullptr;
+                if (label) {
+                    label->setText(QString("%1\n%2").arg(fileName).arg(status));
+                    return;
+                }
                 QWidget* widget = createThumbnailWidget(
-                    currentBatch_[index].image,
+                    currentBatch_[index].thumbnail,
                     fileName,
                     status
                 );
@@ -257,7 +770,7 @@ void MainWindow::onUploadClicked()
         this,
         "Select Images",
         "",
-        "Image Files (*.png *.jpg *.jpeg *.bmp)"
+        "Image Files (*.png *.jpg *.jpeg *.bmp *.tif *.tiff *.gif *.webp)"
     );
 
     qDebug() << "[Client] Selected" << files.size() << "files";
@@ -269,14 +782,18 @@ void MainWindow::onUploadClicked()
         }
 
         // Add files to current batch
+        QList<OCRJob> jobs;
         for (const QString& filePath : files) {
-            QImage image(filePath);
-            if (!image.isNull()) {
+            // Only the thumbnail is decoded here, at thumbnail size; the
+            // worker sends the file's own bytes
+            QImage thumbnail = loadThumbnail(filePath);
+            if (!thumbnail.isNull()) {
                 ImageTask task;
                 task.requestId = nextRequestId_;
                 task.filePath = filePath;
-                task.image = image;
+                task.thumbnail = thumbnail;
                 task.completed = false;
+                task.progress = 0;
                 task.result = "Processing...";
 
                 qDebug() << "[Client] Creating task for file:" << filePath
@@ -293,16 +810,20 @@ void MainWindow::onUploadClicked()
 
                 // Create and set thumbnail widget
                 QString fileName = QFileInfo(filePath).fileName();
-                QWidget* widget = createThumbnailWidget(image, fileName, "Processing...");
+                QWidget* widget = createThumbnailWidget(thumbnail, fileName, "Processing...");
                 fileListWidget->setItemWidget(item, widget);
 
-                // Start processing this image
-                qDebug() << "[Client] Invoking worker for request ID:" << task.requestId;
-                QMetaObject::invokeMethod(worker_, "processImage",
-                    Qt::QueuedConnection,
-                    Q_ARG(int, task.requestId),
-                    Q_ARG(QImage, image),
-                    Q_ARG(QString, filePath));
+                if (deadlineEnabled_) {
+                    // Deadlines are per image, so each one gets its own RPC
+                    qDebug() << "[Client] Invoking worker for request ID:" << task.requestId;
+                    QMetaObject::invokeMethod(worker_, "processImage",
+                        Qt::QueuedConnection,
+                        Q_ARG(int, task.requestId),
+                        Q_ARG(QString, filePath));
+                }
+                else {
+                    jobs.append(OCRJob{ task.requestId, filePath });
+                }
 
                 nextRequestId_++;
             }
@@ -311,6 +832,14 @@ void MainWindow::onUploadClicked()
             }
         }
 
+        // Without deadlines the whole upload goes out over one stream
+        if (!jobs.isEmpty()) {
+            qDebug() << "[Client] Invoking worker for batch of" << jobs.size() << "images";
+            OCRClientWorker* worker = worker_;
+            QMetaObject::invokeMethod(worker_, [worker, jobs]() { worker->processBatch(jobs); },
+                Qt::QueuedConnection);
+        }
+
         QString deadlineStatus = deadlineEnabled_ ? " (Deadline mode ON)" : "";
         statusLabel->setText(QString("Processing %1 images in current batch%2").arg(totalInCurrentBatch_).arg(deadlineStatus));
         progressBar->setValue(0);
@@ -398,10 +927,68 @@ void MainWindow::onOCRResultReady(int requestId, const QString& text, bool succe
     onProgressUpdated();
 }
 
+void MainWindow::onOCRProgress(int requestId, int percent)
+{
+    int taskIndex = -1;
+    {
+        QMutexLocker locker(&batchMutex_);
+        for (int i = 0; i < currentBatch_.size(); ++i) {
+            // A late progress update must not undo a result
+            if (currentBatch_[i].requestId == requestId && !currentBatch_[i].completed) {
+                if (percent > currentBatch_[i].progress) {
+                    currentBatch_[i].progress = percent;
+                    taskIndex = i;
+                }
+                break;
+            }
+        }
+    }
+
+    if (taskIndex != -1) {
+        progressPending_.insert(requestId);
+        if (!progressTimer_->isActive()) {
+            progressTimer_->start();
+        }
+    }
+}
+
+void MainWindow::flushProgress()
+{
+    QList<QPair<int, int>> updates;     // index, percent
+    {
+        QMutexLocker locker(&batchMutex_);
+        for (int i = 0; i < currentBatch_.size(); ++i) {
+            const ImageTask& task = currentBatch_[i];
+            // Finished since, or from a batch that was cleared: skip
+            if (progressPending_.contains(task.requestId) && !task.completed) {
+                updates.append(qMakePair(i, task.progress));
+            }
+        }
+        progressPending_.clear();
+    }
+
+    for (const auto& update : updates) {
+        updateThumbnailStatus(update.first, QString("⏳ %1%").arg(update.second));
+    }
+    if (!updates.isEmpty()) {
+        onProgressUpdated();
+    }
+}
+
 void MainWindow::onProgressUpdated()
 {
     if (totalInCurrentBatch_ > 0) {
-        int progress = (completedCount_ * 100) / totalInCurrentBatch_;
+        // Images still being recognized count for their share done
+        int partial = 0;
+        {
+            QMutexLocker locker(&batchMutex_);
+            for (const ImageTask& task : currentBatch_) {
+                if (!task.completed) {
+                    partial += task.progress;
+                }
+            }
+        }
+        int progress = (completedCount_ * 100 + partial) / totalInCurrentBatch_;
         progressBar->setValue(progress);
 
         QString deadlineStatus = deadlineEnabled_ ? " (Deadline mode ON)" : "";
@@ -11,41 +11,61 @@
 #include <QThread>
 #include <QMutex>
 #include <QWaitCondition>
+#include <QQueue>
+#include <QSet>
+#include <QSpinBox>
+#include <QTimer>
 #include <atomic>
+#include <condition_variable>
 #include <memory>
+#include <mutex>
 
+#include "backend_pool.h"
 #include "ocr_service.grpc.pb.h"
 #include <grpcpp/grpcpp.h>
 
 class OCRClientWorker;
 
+// One image of an upload batch, as handed to the worker thread.
+struct OCRJob {
+    int requestId;
+    QString filePath;
+};
+
 class MainWindow : public QMainWindow
 {
     Q_OBJECT
 
 public:
-    MainWindow(QWidget* parent = nullptr);
+    // Images are spread over the servers in pool.
+    MainWindow(std::shared_ptr<BackendPool> pool, QWidget* parent = nullptr);
     ~MainWindow();
 
 private slots:
     void onUploadClicked();
     void onClearClicked();
     void onDeadlineToggled();
+    void onRawPixelsToggled();
+    void onMaxInFlightChanged(int maxInFlight);
     void onOCRResultReady(int requestId, const QString& text, bool success, const QString& error);
+    void onOCRProgress(int requestId, int percent);
+    void flushProgress();
     void onProgressUpdated();
 
 private:
     void setupUI();
     void processNextImage();
     void startNewBatch();
+    QImage loadThumbnail(const QString& filePath);
     QWidget* createThumbnailWidget(const QImage& image, const QString& fileName, const QString& status);
     void updateThumbnailStatus(int index, const QString& status);
 
     struct ImageTask {
         int requestId;
         QString filePath;
-        QImage image;
+        QImage thumbnail;
         bool completed;
+        int progress;   // percent recognized so far, while not completed
         QString result;
     };
 
@@ -54,15 +74,19 @@ private:
     QPushButton* uploadButton;
     QPushButton* clearButton;
     QPushButton* deadlineButton;
+    QPushButton* rawPixelsButton;
+    QSpinBox* inFlightSpinBox;
     QProgressBar* progressBar;
     QTextEdit* resultsDisplay;
     QLabel* statusLabel;
     QListWidget* fileListWidget;
 
-    std::unique_ptr<ocrservice::OCRService::Stub> stub_;
-    std::shared_ptr<grpc::Channel> channel_;
-
     QList<ImageTask> currentBatch_;
+    // Progress arrives per word block; it is shown at most every
+    // kProgressIntervalMs, for the requests that moved since
+    static constexpr int kProgressIntervalMs = 200;
+    QTimer* progressTimer_;
+    QSet<int> progressPending_;     // request IDs
     std::atomic<int> completedCount_;
     std::atomic<int> nextRequestId_;
     int totalInCurrentBatch_;
@@ -78,21 +102,67 @@ class OCRClientWorker : public QObject
     Q_OBJECT
 
 public:
-    OCRClientWorker(std::shared_ptr<grpc::Channel> channel);
+    OCRClientWorker(std::shared_ptr<BackendPool> pool);
     ~OCRClientWorker();
 
+    static constexpr int kDefaultMaxInFlight = 8;
+
     void setDeadlineEnabled(bool enabled) { deadlineEnabled_ = enabled; }
+    void setRawPixelsEnabled(bool enabled) { rawPixelsEnabled_ = enabled; }
 
 public slots:
-    void processImage(int requestId, const QImage& image, const QString& filePath);
+    // Upper bound on images sent but not yet answered, across all calls.
+    void setMaxInFlight(int maxInFlight);
+    // Queues one image for its own unary call (used when deadlines are on).
+    void processImage(int requestId, const QString& filePath);
+    // Queues a batch to go over ProcessImageStream calls, one per server
+    // used. Results are emitted in the order the servers finish them.
+    void processBatch(const QList<OCRJob>& jobs);
 
 signals:
     void resultReady(int requestId, const QString& text, bool success, const QString& error);
+    // Streamed images only: how far the server has got with one, 0-99.
+    void progressReady(int requestId, int percent);
 
 private:
-    std::unique_ptr<ocrservice::OCRService::Stub> stub_;
+    struct UnaryCall;
+    class BatchStream;
+
+    // Starts queued images until maxInFlight_ RPCs are outstanding.
+    void pump();
+    void startUnary(int requestId, ocrservice::OCRRequest request, std::shared_ptr<BackendPool::Backend> backend);
+    // An open stream to backend that can still be written to, or a new one.
+    BatchStream* streamFor(const std::shared_ptr<BackendPool::Backend>& backend);
+    void onUnaryDone(UnaryCall* call, const grpc::Status& status);
+    void onCallFinished(int count);
+    void onStreamDone(BatchStream* stream, int released);
+
+    // Sets either raw_pixels or image_data/format on the request.
+    bool fillImage(const QString& filePath, ocrservice::OCRRequest& request);
+    // Reads the file as-is when the server can decode its format, otherwise
+    // decodes it and re-encodes to PNG. `format` is set to what is sent.
+    bool loadImageBytes(const QString& filePath, QByteArray& imageBytes, QByteArray& format);
+
+    // Every call whose callbacks may still reference this worker, so the
+    // destructor can cancel them and wait.
+    void trackCall(grpc::ClientContext* context);
+    void untrackCall(grpc::ClientContext* context);
+
+    std::shared_ptr<BackendPool> pool_;
     std::atomic<bool> shutdown_;
     std::atomic<bool> deadlineEnabled_;
+    std::atomic<bool> rawPixelsEnabled_;
+
+    // Worker thread only
+    int maxInFlight_;
+    int inFlight_;
+    QQueue<OCRJob> unaryQueue_;
+    QQueue<OCRJob> streamQueue_;    // batch images not yet sent
+    QList<BatchStream*> streams_;
+
+    std::mutex callsMutex_;
+    std::condition_variable callsCv_;
+    QSet<grpc::ClientContext*> liveCalls_;
 };
 
 #endif // MAINWINDOW_H
\ No newline at end of file
@@ -0,0 +1,77 @@
+#include "admission.h"
+#include <algorithm>
+
+namespace {
+
+// Weight of the newest sample in the cost average: a few images are enough
+// to follow a change in the mix of requests.
+constexpr double kCostSmoothing = 0.2;
+
+// Never tell a client to come back sooner than this.
+constexpr int64_t kMinRetryAfterMs = 100;
+
+} // namespace
+
+AdmissionController::AdmissionController(const Options& options, int n_workers)
+    : options_(options), n_workers_(std::max(1, n_workers)), ns_per_pixel_(options.initial_ns_per_pixel) {
+}
+
+int64_t AdmissionController::costMs(uint64_t pixels) const {
+    return static_cast<int64_t>(static_cast<double>(pixels) * ns_per_pixel_ / 1e6);
+}
+
+AdmissionController::Decision AdmissionController::admit(uint64_t pixels, TaskClock::time_point deadline) {
+    Decision decision;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        decision.wait_ms = costMs(queued_pixels_) / n_workers_;
+        const int64_t finish_ms = decision.wait_ms + costMs(pixels);
+
+        // How far over budget the request is; the queue has to shrink by
+        // about that much before it would fit
+        int64_t over_ms = 0;
+        if (options_.max_wait_ms > 0 && decision.wait_ms > options_.max_wait_ms) {
+            over_ms = decision.wait_ms - options_.max_wait_ms;
+        }
+        if (deadline != TaskClock::time_point::max()) {
+            const int64_t remaining_ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+                deadline - TaskClock::now()).count();
+            over_ms = std::max(over_ms, finish_ms - remaining_ms);
+        }
+
+        if (over_ms > 0) {
+            decision.accepted = false;
+            decision.retry_after_ms = std::max(over_ms, kMinRetryAfterMs);
+        }
+        else {
+            queued_pixels_ += pixels;
+        }
+    }
+
+    (decision.accepted ? accepted_ : shed_).fetch_add(1, std::memory_order_relaxed);
+    return decision;
+}
+
+void AdmissionController::release(uint64_t pixels) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    queued_pixels_ -= std::min(pixels, queued_pixels_);
+}
+
+void AdmissionController::recordCost(uint64_t pixels, std::chrono::nanoseconds elapsed) {
+    if (pixels == 0) {
+        return;
+    }
+    const double sample = static_cast<double>(elapsed.count()) / static_cast<double>(pixels);
+    std::lock_guard<std::mutex> lock(mutex_);
+    ns_per_pixel_ += kCostSmoothing * (sample - ns_per_pixel_);
+}
+
+AdmissionController::Stats AdmissionController::stats() const {
+    Stats s;
+    s.accepted = accepted_.load(std::memory_order_relaxed);
+    s.shed = shed_.load(std::memory_order_relaxed);
+    std::lock_guard<std::mutex> lock(mutex_);
+    s.queued_pixels = queued_pixels_;
+    s.ns_per_pixel = ns_per_pixel_;
+    return s;
+}
\ No newline at end of file
@@ -0,0 +1,62 @@
+#pragma once
+
+#include "ocr_task.h"
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+
+// Decides at the door whether a request can still be answered in time.
+//
+// The wait in front of a new request is estimated from the pixels already
+// admitted and not yet finished, times the recent recognition cost per
+// pixel, spread over the tier's workers. A request is shed when that wait
+// plus its own cost would overrun its deadline, or when the wait alone is
+// over the configured bound; the queue then stays short enough to drain
+// instead of growing until everything in it times out.
+class AdmissionController {
+public:
+    struct Options {
+        int64_t max_wait_ms = 30000;    // 0: only deadlines are enforced
+        // Cost assumed until the first image has been recognized.
+        double initial_ns_per_pixel = 200.0;
+    };
+
+    struct Stats {
+        uint64_t accepted = 0;
+        uint64_t shed = 0;
+        uint64_t queued_pixels = 0;     // admitted, not yet finished
+        double ns_per_pixel = 0.0;      // current cost estimate
+    };
+
+    struct Decision {
+        bool accepted = true;
+        int64_t wait_ms = 0;            // estimated queue wait
+        int64_t retry_after_ms = 0;     // when shed: roughly when to try again
+    };
+
+    AdmissionController(const Options& options, int n_workers);
+
+    // On acceptance the pixels count as queued until release(). pixels may
+    // be 0 for images whose size could not be read from their header.
+    Decision admit(uint64_t pixels, TaskClock::time_point deadline);
+    void release(uint64_t pixels);
+
+    // Feeds the cost estimate with one finished recognition.
+    void recordCost(uint64_t pixels, std::chrono::nanoseconds elapsed);
+
+    Stats stats() const;
+
+private:
+    int64_t costMs(uint64_t pixels) const;
+
+    Options options_;
+    int n_workers_;
+
+    mutable std::mutex mutex_;
+    double ns_per_pixel_;
+    uint64_t queued_pixels_ = 0;
+
+    std::atomic<uint64_t> accepted_{ 0 };
+    std::atomic<uint64_t> shed_{ 0 };
+};
\ No newline at end of file
@@ -0,0 +1,193 @@
+#include "engine_pool.h"
+#include "logger.h"
+#include <chrono>
+#include <thread>
+
+EnginePool::Lease::Lease(EnginePool* pool, Slot* slot, std::unique_ptr<OCRProcessor> engine)
+    : pool_(pool), slot_(slot), engine_(std::move(engine)) {
+}
+
+EnginePool::Lease::Lease(Lease&& other) noexcept
+    : pool_(other.pool_), slot_(other.slot_), engine_(std::move(other.engine_)) {
+    other.pool_ = nullptr;
+    other.slot_ = nullptr;
+}
+
+EnginePool::Lease& EnginePool::Lease::operator=(Lease&& other) noexcept {
+    if (this != &other) {
+        release();
+        pool_ = other.pool_;
+        slot_ = other.slot_;
+        engine_ = std::move(other.engine_);
+        other.pool_ = nullptr;
+        other.slot_ = nullptr;
+    }
+    return *this;
+}
+
+EnginePool::Lease::~Lease() {
+    release();
+}
+
+void EnginePool::Lease::release() {
+    if (engine_) {
+        pool_->release(slot_, std::move(engine_));
+    }
+    pool_ = nullptr;
+    slot_ = nullptr;
+}
+
+void EnginePool::Lease::discard() {
+    if (engine_) {
+        pool_->discard(std::move(engine_));
+    }
+    pool_ = nullptr;
+    slot_ = nullptr;
+}
+
+EnginePool::EnginePool(const Options& options)
+    : options_(options) {
+    if (options_.warm_languages.empty()) {
+        options_.warm_languages.push_back("eng");
+    }
+
+    // Init mostly reads and unpacks traineddata, so engines load about as
+    // fast in parallel as one does alone.
+    auto start_time = std::chrono::steady_clock::now();
+    std::vector<std::unique_ptr<OCRProcessor>> engines(options_.warm_languages.size() * options_.engines_per_language);
+    std::vector<std::thread> loaders;
+    for (size_t i = 0; i < engines.size(); ++i) {
+        const std::string& language = options_.warm_languages[i / options_.engines_per_language];
+        loaders.emplace_back([this, &engines, &language, i] {
+            engines[i] = std::make_unique<OCRProcessor>(language, options_.engine);
+        });
+    }
+    for (auto& loader : loaders) {
+        loader.join();
+    }
+
+    for (auto& engine : engines) {
+        Slot& slot = slots_[Key(engine->language(), options_.engine.oem)];
+        slot.idle_limit = options_.engines_per_language;
+        if (engine->ready()) {
+            slot.idle.push_back(std::move(engine));
+        }
+        else {
+            ++stats_.failed_loads;
+        }
+    }
+    for (auto& [key, slot] : slots_) {
+        slot.unavailable = slot.idle.empty();
+    }
+    stats_.warm_start_ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::steady_clock::now() - start_time).count();
+
+    std::string languages;
+    for (const auto& language : options_.warm_languages) {
+        languages += " " + language;
+    }
+    LOG_INFO << "[Server] Engine pool: " << engines.size() - stats_.failed_loads << " engines for"
+        << languages << " ready in " << stats_.warm_start_ms << "ms";
+}
+
+EnginePool::Lease EnginePool::acquire(const std::string& language, tesseract::OcrEngineMode oem) {
+    Slot* slot = nullptr;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto [it, inserted] = slots_.try_emplace(Key(language, oem));
+        slot = &it->second;
+        if (inserted) {
+            slot->idle_limit = options_.lazy_idle_limit;
+        }
+        if (slot->unavailable) {
+            return Lease();
+        }
+        ++stats_.leases;
+        if (!slot->idle.empty()) {
+            std::unique_ptr<OCRProcessor> engine = std::move(slot->idle.back());
+            slot->idle.pop_back();
+            ++stats_.leased_engines;
+            return Lease(this, slot, std::move(engine));
+        }
+        ++stats_.lazy_loads;
+    }
+
+    // Every engine of this kind is busy, or it was never loaded: make one
+    // without holding the lock so other languages are not held up.
+    LOG_INFO << "[Server] Loading engine for language " << language;
+    OCRProcessor::Config config = options_.engine;
+    config.oem = oem;
+    auto engine = std::make_unique<OCRProcessor>(language, config);
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!engine->ready()) {
+        slot->unavailable = true;
+        ++stats_.failed_loads;
+        return Lease();
+    }
+    ++stats_.leased_engines;
+    return Lease(this, slot, std::move(engine));
+}
+
+EnginePool::Lease EnginePool::tryAcquire(const std::string& language, tesseract::OcrEngineMode oem) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = slots_.find(Key(language, oem));
+    if (it == slots_.end() || it->second.idle.empty()) {
+        return Lease();
+    }
+    ++stats_.leases;
+    ++stats_.leased_engines;
+    std::unique_ptr<OCRProcessor> engine = std::move(it->second.idle.back());
+    it->second.idle.pop_back();
+    return Lease(this, &it->second, std::move(engine));
+}
+
+int EnginePool::idleEngines(const std::string& language, tesseract::OcrEngineMode oem) const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = slots_.find(Key(language, oem));
+    return it == slots_.end() ? 0 : static_cast<int>(it->second.idle.size());
+}
+
+void EnginePool::release(Slot* slot, std::unique_ptr<OCRProcessor> engine) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    --stats_.leased_engines;
+    if (slot->idle.size() < slot->idle_limit) {
+        slot->idle.push_back(std::move(engine));
+        return;
+    }
+    // Surplus engine from a burst; End() is slow, so not under the lock
+    lock.unlock();
+    engine.reset();
+}
+
+void EnginePool::discard(std::unique_ptr<OCRProcessor> engine) {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        ++stats_.discarded;
+        --stats_.leased_engines;
+    }
+    // The next acquire of this kind loads a fresh engine if none is idle
+    engine.reset();
+}
+
+bool EnginePool::isValidLanguage(const std::string& language) {
+    if (language.empty() || language.size() > 64) {
+        return false;
+    }
+    for (char c : language) {
+        const bool ok = (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9')
+            || c == '_' || c == '+';
+        if (!ok) {
+            return false;
+        }
+    }
+    return language.front() != '+' && language.back() != '+';
+}
+
+EnginePool::Stats EnginePool::stats() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    Stats stats = stats_;
+    for (const auto& [key, slot] : slots_) {
+        stats.idle_engines += slot.idle.size();
+    }
+    return stats;
+}
\ No newline at end of file
@@ -0,0 +1,101 @@
+#pragma once
+
+#include "ocr_processor.h"
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+// Initialized Tesseract engines, kept warm per (language, OEM) and leased to
+// workers one request at a time. Engines for the configured languages are
+// created in parallel at startup; any other language is loaded the first
+// time a request asks for it and a few idle copies are kept afterwards.
+class EnginePool {
+    struct Slot;
+
+public:
+    struct Options {
+        // The first entry is the default for requests that name none.
+        std::vector<std::string> warm_languages{ "eng" };
+        int engines_per_language = 4;
+        // Models, OEM and page segmentation shared by every engine here
+        OCRProcessor::Config engine;
+        // Idle engines kept for a lazily loaded language. Each one holds its
+        // traineddata in memory, so rare languages are not kept per worker.
+        int lazy_idle_limit = 1;
+    };
+
+    struct Stats {
+        uint64_t leases = 0;
+        uint64_t lazy_loads = 0;
+        uint64_t failed_loads = 0;
+        uint64_t discarded = 0;
+        uint64_t idle_engines = 0;
+        uint64_t leased_engines = 0;    // out on a lease right now
+        uint64_t warm_start_ms = 0;
+    };
+
+    // Exclusive use of one engine; returns it to the pool when destroyed.
+    class Lease {
+    public:
+        Lease() = default;
+        Lease(Lease&& other) noexcept;
+        Lease& operator=(Lease&& other) noexcept;
+        ~Lease();
+
+        explicit operator bool() const { return engine_ != nullptr; }
+        OCRProcessor* operator->() const { return engine_.get(); }
+        OCRProcessor& operator*() const { return *engine_; }
+
+        // Destroys the engine instead of returning it, for one that failed
+        // in a way that may have left it broken. Leaves the lease empty.
+        void discard();
+
+    private:
+        friend class EnginePool;
+        Lease(EnginePool* pool, Slot* slot, std::unique_ptr<OCRProcessor> engine);
+        void release();
+
+        EnginePool* pool_ = nullptr;
+        Slot* slot_ = nullptr;
+        std::unique_ptr<OCRProcessor> engine_;
+    };
+
+    explicit EnginePool(const Options& options);
+
+    const std::string& defaultLanguage() const { return options_.warm_languages.front(); }
+    tesseract::OcrEngineMode defaultOem() const { return options_.engine.oem; }
+
+    // Blocks only while a missing engine is being loaded. Returns an empty
+    // lease if the language's traineddata is not installed.
+    Lease acquire(const std::string& language, tesseract::OcrEngineMode oem);
+    // Only an already idle engine; never loads one.
+    Lease tryAcquire(const std::string& language, tesseract::OcrEngineMode oem);
+    int idleEngines(const std::string& language, tesseract::OcrEngineMode oem) const;
+
+    // Language codes are passed to Tesseract as part of a file path, so only
+    // "xxx" and "xxx+yyy" style names are accepted.
+    static bool isValidLanguage(const std::string& language);
+
+    Stats stats() const;
+
+private:
+    using Key = std::pair<std::string, int>;
+
+    struct Slot {
+        std::vector<std::unique_ptr<OCRProcessor>> idle;
+        size_t idle_limit = 0;
+        bool unavailable = false;   // Init failed; not retried on every request
+    };
+
+    void release(Slot* slot, std::unique_ptr<OCRProcessor> engine);
+    void discard(std::unique_ptr<OCRProcessor> engine);
+
+    Options options_;
+    mutable std::mutex mutex_;
+    std::map<Key, Slot> slots_;   // node-based: Slot pointers stay valid
+    Stats stats_;
+};
\ No newline at end of file
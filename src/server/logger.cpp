@@ -0,0 +1,264 @@
+#include "logger.h"
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace logging {
+
+namespace detail {
+std::atomic<int> min_level{ static_cast<int>(Level::Info) };
+}
+
+namespace {
+
+constexpr size_t kRingSize = 1024;  // lines per thread, a power of two
+constexpr auto kDrainInterval = std::chrono::milliseconds(20);
+
+struct Record {
+    int64_t time_us;    // system clock
+    uint8_t level;
+    uint8_t length;
+    char text[Line::kMaxLength];
+};
+
+// Single producer (the owning thread), single consumer (the drain thread).
+struct Ring {
+    std::array<Record, kRingSize> records;
+    alignas(64) std::atomic<uint64_t> head{ 0 };   // next to write
+    alignas(64) std::atomic<uint64_t> tail{ 0 };   // next to drain
+    std::atomic<uint64_t> dropped{ 0 };
+    std::atomic<bool> orphaned{ false };            // owner thread has exited
+};
+
+class Logger {
+public:
+    // Never destroyed, so threads still logging during static destruction
+    // find it intact.
+    static Logger& instance() {
+        static Logger* logger = new Logger();
+        return *logger;
+    }
+
+    void write(Level level, const char* text, size_t length) {
+        Record* record = nullptr;
+        Ring* ring = threadRing();
+        uint64_t head = 0;
+        if (ring) {
+            head = ring->head.load(std::memory_order_relaxed);
+            if (head - ring->tail.load(std::memory_order_acquire) < kRingSize) {
+                record = &ring->records[head % kRingSize];
+            }
+            else {
+                ring->dropped.fetch_add(1, std::memory_order_relaxed);
+                return;
+            }
+        }
+
+        Record local;
+        if (!record) {
+            record = &local;
+        }
+        record->time_us = std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::system_clock::now().time_since_epoch()).count();
+        record->level = static_cast<uint8_t>(level);
+        record->length = static_cast<uint8_t>(length);
+        std::memcpy(record->text, text, length);
+
+        if (!ring) {
+            // Stopped: no drain thread left to hand the line to
+            std::string out;
+            format(*record, out);
+            std::fwrite(out.data(), 1, out.size(), level >= Level::Warn ? stderr : stdout);
+            return;
+        }
+        ring->head.store(head + 1, std::memory_order_release);
+        if (head - ring->tail.load(std::memory_order_relaxed) == kRingSize / 2) {
+            // Filling up faster than the drain interval; do not wait for it
+            wake_.notify_one();
+        }
+    }
+
+    void stop() {
+        if (stopped_.exchange(true)) {
+            return;
+        }
+        {
+            // Not lost between the drain thread's check and its wait
+            std::lock_guard<std::mutex> lock(mutex_);
+        }
+        wake_.notify_one();
+        if (drainer_.joinable()) {
+            drainer_.join();
+        }
+        drain();
+    }
+
+    Stats stats() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        Stats s;
+        s.written = written_;
+        s.dropped = dropped_;
+        for (const auto& ring : rings_) {
+            s.dropped += ring->dropped.load(std::memory_order_relaxed);
+        }
+        return s;
+    }
+
+private:
+    struct Handle {
+        std::shared_ptr<Ring> ring;
+        ~Handle() {
+            if (ring) {
+                ring->orphaned.store(true, std::memory_order_release);
+            }
+        }
+    };
+
+    Logger() {
+        drainer_ = std::thread(&Logger::drainThread, this);
+        std::atexit([] { Logger::instance().stop(); });
+    }
+
+    // nullptr once stopped. Locks only on a thread's first line.
+    Ring* threadRing() {
+        if (stopped_.load(std::memory_order_acquire)) {
+            return nullptr;
+        }
+        thread_local Handle handle;
+        if (!handle.ring) {
+            handle.ring = std::make_shared<Ring>();
+            std::lock_guard<std::mutex> lock(mutex_);
+            rings_.push_back(handle.ring);
+        }
+        return handle.ring.get();
+    }
+
+    void drainThread() {
+        std::unique_lock<std::mutex> lock(mutex_);
+        while (!stopped_.load()) {
+            wake_.wait_for(lock, kDrainInterval);
+            lock.unlock();
+            drain();
+            lock.lock();
+        }
+    }
+
+    // Drain thread, or the thread that stopped it.
+    void drain() {
+        std::vector<std::shared_ptr<Ring>> rings;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            rings = rings_;
+        }
+
+        struct Pending {
+            const Record* record;
+            Ring* ring;
+        };
+        std::vector<Pending> pending;
+        std::vector<std::pair<Ring*, uint64_t>> drained;
+        uint64_t dropped = 0;
+        for (const auto& ring : rings) {
+            const uint64_t tail = ring->tail.load(std::memory_order_relaxed);
+            const uint64_t head = ring->head.load(std::memory_order_acquire);
+            for (uint64_t i = tail; i < head; ++i) {
+                pending.push_back({ &ring->records[i % kRingSize], ring.get() });
+            }
+            drained.emplace_back(ring.get(), head);
+            dropped += ring->dropped.exchange(0, std::memory_order_relaxed);
+        }
+
+        // Each ring is in order already; merge them into one timeline
+        std::stable_sort(pending.begin(), pending.end(), [](const Pending& a, const Pending& b) {
+            return a.record->time_us < b.record->time_us;
+        });
+        std::string out;
+        std::string err;
+        for (const Pending& line : pending) {
+            format(*line.record, line.record->level >= static_cast<uint8_t>(Level::Warn) ? err : out);
+        }
+        if (dropped > 0) {
+            err += "[Log] " + std::to_string(dropped) + " lines dropped (ring full)\n";
+        }
+        for (auto& [ring, head] : drained) {
+            ring->tail.store(head, std::memory_order_release);
+        }
+
+        if (!out.empty()) {
+            std::fwrite(out.data(), 1, out.size(), stdout);
+            std::fflush(stdout);
+        }
+        if (!err.empty()) {
+            std::fwrite(err.data(), 1, err.size(), stderr);
+            std::fflush(stderr);
+        }
+
+        std::lock_guard<std::mutex> lock(mutex_);
+        written_ += pending.size();
+        dropped_ += dropped;
+        // Rings of exited threads go once they are empty
+        rings_.erase(std::remove_if(rings_.begin(), rings_.end(), [](const std::shared_ptr<Ring>& ring) {
+            return ring->orphaned.load(std::memory_order_acquire)
+                && ring->tail.load(std::memory_order_relaxed) == ring->head.load(std::memory_order_acquire);
+        }), rings_.end());
+    }
+
+    // "HH:MM:SS.mmm L text\n", time of day in UTC
+    static void format(const Record& record, std::string& out) {
+        static constexpr char kLetters[] = "TDIWE";
+        const int64_t ms = record.time_us / 1000 % (24 * 3600 * 1000);
+        char stamp[32];
+        const int n = std::snprintf(stamp, sizeof(stamp), "%02d:%02d:%02d.%03d %c ",
+            static_cast<int>(ms / 3600000), static_cast<int>(ms / 60000 % 60),
+            static_cast<int>(ms / 1000 % 60), static_cast<int>(ms % 1000), kLetters[record.level]);
+        out.append(stamp, n);
+        out.append(record.text, record.length);
+        out += '\n';
+    }
+
+    std::mutex mutex_;
+    std::condition_variable wake_;
+    std::vector<std::shared_ptr<Ring>> rings_;
+    std::atomic<bool> stopped_{ false };
+    uint64_t written_ = 0;
+    uint64_t dropped_ = 0;
+    std::thread drainer_;
+};
+
+} // namespace
+
+Line::~Line() {
+    Logger::instance().write(level_, text_, length_);
+}
+
+void setLevel(Level level) {
+    detail::min_level.store(static_cast<int>(level), std::memory_order_relaxed);
+}
+
+bool parseLevel(const std::string& name, Level& level) {
+    static const char* const kNames[] = { "trace", "debug", "info", "warn", "error" };
+    for (int i = 0; i < 5; ++i) {
+        if (name == kNames[i]) {
+            level = static_cast<Level>(i);
+            return true;
+        }
+    }
+    return false;
+}
+
+void shutdown() {
+    Logger::instance().stop();
+}
+
+Stats stats() {
+    return Logger::instance().stats();
+}
+
+} // namespace logging
\ No newline at end of file
@@ -0,0 +1,103 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <charconv>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <string_view>
+#include <type_traits>
+
+// Levels below this are compiled out entirely (0 = trace ... 4 = error).
+#ifndef PS4_LOG_MIN_LEVEL
+#define PS4_LOG_MIN_LEVEL 0
+#endif
+
+// Leveled logging that stays off the hot path.
+//
+// A line is formatted on the caller's stack and copied into a ring buffer
+// owned by the calling thread; nothing is locked, allocated or flushed. A
+// background thread drains every ring, merges the lines by timestamp and
+// writes them out in batches (warnings and errors to stderr, the rest to
+// stdout). A thread whose ring is full drops the line and counts it rather
+// than wait. Lines longer than Line::kMaxLength are cut.
+//
+//     LOG_DEBUG << "[Server] Thread " << thread_id << " received task " << id;
+//
+// Arguments are not evaluated when the level is disabled.
+namespace logging {
+
+enum class Level { Trace, Debug, Info, Warn, Error };
+
+struct Stats {
+    uint64_t written = 0;
+    uint64_t dropped = 0;   // ring was full
+};
+
+namespace detail {
+extern std::atomic<int> min_level;
+}
+
+constexpr bool compiledIn(Level level) { return static_cast<int>(level) >= PS4_LOG_MIN_LEVEL; }
+inline bool enabled(Level level) {
+    return static_cast<int>(level) >= detail::min_level.load(std::memory_order_relaxed);
+}
+
+// Run-time threshold; Info by default.
+void setLevel(Level level);
+bool parseLevel(const std::string& name, Level& level);
+
+// Writes out everything logged so far and stops the drain thread; later
+// lines are written synchronously. Also runs at exit.
+void shutdown();
+
+Stats stats();
+
+class Line {
+public:
+    static constexpr size_t kMaxLength = 232;
+
+    explicit Line(Level level) : level_(level) {}
+    ~Line();
+
+    Line(const Line&) = delete;
+    Line& operator=(const Line&) = delete;
+
+    Line& operator<<(std::string_view text) {
+        const size_t n = std::min(text.size(), kMaxLength - length_);
+        std::memcpy(text_ + length_, text.data(), n);
+        length_ += n;
+        return *this;
+    }
+    Line& operator<<(const char* text) { return *this << std::string_view(text); }
+    Line& operator<<(const std::string& text) { return *this << std::string_view(text); }
+    Line& operator<<(char c) { return *this << std::string_view(&c, 1); }
+    Line& operator<<(bool value) { return *this << (value ? "true" : "false"); }
+
+    template <typename T, typename = std::enable_if_t<std::is_arithmetic_v<T>>>
+    Line& operator<<(T value) {
+        auto [end, ec] = std::to_chars(text_ + length_, text_ + kMaxLength, value);
+        if (ec == std::errc()) {
+            length_ = static_cast<size_t>(end - text_);
+        }
+        return *this;
+    }
+
+private:
+    Level level_;
+    size_t length_ = 0;
+    char text_[kMaxLength];
+};
+
+} // namespace logging
+
+#define PS4_LOG(level) \
+    if (!::logging::compiledIn(level) || !::logging::enabled(level)) {} \
+    else ::logging::Line(level)
+
+#define LOG_TRACE PS4_LOG(::logging::Level::Trace)
+#define LOG_DEBUG PS4_LOG(::logging::Level::Debug)
+#define LOG_INFO PS4_LOG(::logging::Level::Info)
+#define LOG_WARN PS4_LOG(::logging::Level::Warn)
+#define LOG_ERROR PS4_LOG(::logging::Level::Error)
\ No newline at end of file
@@ -1,32 +1,184 @@
 #include "ocr_service.h"
+#include "logger.h"
+#include "trace.h"
 #include <grpcpp/grpcpp.h>
+#include <algorithm>
+#include <atomic>
+#include <charconv>
+#include <chrono>
+#include <climits>
 #include <iostream>
 #include <csignal>
+#include <limits>
+#include <sstream>
+#include <thread>
 
-std::unique_ptr<grpc::Server> server;
+// Only a lock-free flag is safe to touch in a signal handler; the main
+// thread notices it and shuts the server down
+std::atomic<bool> stop_requested{ false };
 
 void signalHandler(int signum) {
-    std::cout << "\nShutting down server..." << std::endl;
-    if (server) {
-        server->Shutdown();
+    stop_requested.store(true);
+}
+
+// The whole argument has to be a number; std::stoi would throw out of main
+// on "abc" and quietly accept "64abc"
+template <typename T>
+bool parseNumber(const std::string& flag, const std::string& text, T& value) {
+    const char* end = text.data() + text.size();
+    auto [parsed, error] = std::from_chars(text.data(), end, value);
+    if (error != std::errc() || parsed != end) {
+        std::cerr << "Invalid value '" << text << "' for " << flag << std::endl;
+        return false;
     }
+    return true;
 }
 
 int main(int argc, char* argv[]) {
     std::signal(SIGINT, signalHandler);
     std::signal(SIGTERM, signalHandler);
 
-    std::string server_address("10.98.53.240:50051");
-    OCRService service(4); // 4 worker threads
+    std::string server_address("0.0.0.0:50051");
+    // gRPC's 4 MB default is less than one page of raw pixels; gRPC takes
+    // the limit in bytes as an int
+    constexpr int kMaxMessageMb = INT_MAX / (1024 * 1024);
+    int max_message_mb = 64;
+    ServiceOptions options;
+    std::string trace_file;
+
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg == "--listen" && i + 1 < argc) {
+            server_address = argv[++i];
+        }
+        else if (arg == "--max-message-mb" && i + 1 < argc) {
+            if (!parseNumber(arg, argv[++i], max_message_mb)) return 1;
+            max_message_mb = std::clamp(max_message_mb, 1, kMaxMessageMb);
+        }
+        else if (arg == "--scheduler" && i + 1 < argc) {
+            if (!TaskScheduler::parseKind(argv[++i], options.scheduler_kind)) {
+                std::cerr << "Unknown scheduler '" << argv[i] << "' (expected shared or stealing)" << std::endl;
+                return 1;
+            }
+        }
+        else if (arg == "--log-level" && i + 1 < argc) {
+            logging::Level level;
+            if (!logging::parseLevel(argv[++i], level)) {
+                std::cerr << "Unknown log level '" << argv[i] << "' (expected trace, debug, info, warn or error)" << std::endl;
+                return 1;
+            }
+            logging::setLevel(level);
+        }
+        else if (arg == "--cache-mb" && i + 1 < argc) {
+            size_t cache_mb = 0;
+            if (!parseNumber(arg, argv[++i], cache_mb)) return 1;
+            options.cache.memory_budget_bytes = std::min(cache_mb, std::numeric_limits<size_t>::max() / (1024 * 1024)) * 1024 * 1024;
+        }
+        else if (arg == "--cache-file" && i + 1 < argc) {
+            options.cache.disk_path = argv[++i];
+        }
+        else if (arg == "--trace-sample" && i + 1 < argc) {
+            // Fraction of requests traced, 0 to 1; see DumpTrace
+            double rate = 0.0;
+            if (!parseNumber(arg, argv[++i], rate)) return 1;
+            tracing::setSampleRate(rate);
+        }
+        else if (arg == "--trace-file" && i + 1 < argc) {
+            // Whatever is still buffered is written here on shutdown
+            trace_file = argv[++i];
+        }
+        else if (arg == "--stats-file" && i + 1 < argc) {
+            // Prometheus text format, e.g. for node_exporter's textfile collector
+            options.stats_file = argv[++i];
+        }
+        else if (arg == "--stats-interval-ms" && i + 1 < argc) {
+            if (!parseNumber(arg, argv[++i], options.stats_interval_ms)) return 1;
+        }
+        else if (arg == "--threads" && i + 1 < argc) {
+            if (!parseNumber(arg, argv[++i], options.accurate.n_threads)) return 1;
+            options.accurate.n_threads = std::max(1, options.accurate.n_threads);
+        }
+        else if (arg == "--fast-threads" && i + 1 < argc) {
+            if (!parseNumber(arg, argv[++i], options.fast.n_threads)) return 1;
+            options.fast.n_threads = std::max(1, options.fast.n_threads);
+        }
+        else if (arg == "--max-wait-ms" && i + 1 < argc) {
+            // Longest estimated queue wait a request is accepted into; 0
+            // leaves only the callers' own deadlines
+            if (!parseNumber(arg, argv[++i], options.accurate.admission.max_wait_ms)) return 1;
+        }
+        else if (arg == "--fast-max-wait-ms" && i + 1 < argc) {
+            if (!parseNumber(arg, argv[++i], options.fast.admission.max_wait_ms)) return 1;
+        }
+        else if (arg == "--tessdata-best" && i + 1 < argc) {
+            options.accurate.engines.engine.datapath = argv[++i];
+        }
+        else if (arg == "--tessdata-fast" && i + 1 < argc) {
+            options.fast.engines.engine.datapath = argv[++i];
+        }
+        else if (arg == "--languages" && i + 1 < argc) {
+            // Comma-separated languages to keep warm in both tiers; the first
+            // is the default
+            std::vector<std::string> languages;
+            std::stringstream list(argv[++i]);
+            std::string language;
+            while (std::getline(list, language, ',')) {
+                if (!EnginePool::isValidLanguage(language)) {
+                    std::cerr << "Invalid language '" << language << "'" << std::endl;
+                    return 1;
+                }
+                languages.push_back(language);
+            }
+            options.accurate.engines.warm_languages = languages;
+            options.fast.engines.warm_languages = languages;
+        }
+        else if (arg == "--split-pixels" && i + 1 < argc) {
+            // 0 turns off splitting large pages across engines
+            if (!parseNumber(arg, argv[++i], options.split_min_pixels)) return 1;
+        }
+        else if (arg == "--oem" && i + 1 < argc) {
+            int oem = 0;
+            if (!parseNumber(arg, argv[++i], oem)) return 1;
+            if (oem < 0 || oem >= tesseract::OEM_COUNT) {
+                std::cerr << "Unknown OCR engine mode " << oem << std::endl;
+                return 1;
+            }
+            // Accurate tier only; the fast tier always runs LSTM
+            options.accurate.engines.engine.oem = static_cast<tesseract::OcrEngineMode>(oem);
+        }
+    }
 
-    grpc::ServerBuilder builder;
-    builder.AddListeningPort(server_address, grpc::InsecureServerCredentials());
-    builder.RegisterService(&service);
+    int status = 0;
+    {
+        // Destroyed before the logger stops, so the service's shutdown stats
+        // and its workers' last messages still go through it
+        OCRService service(options);
 
-    server = builder.BuildAndStart();
-    std::cout << "OCR Server listening on " << server_address << std::endl;
+        grpc::ServerBuilder builder;
+        builder.AddListeningPort(server_address, grpc::InsecureServerCredentials());
+        builder.SetMaxReceiveMessageSize(max_message_mb * 1024 * 1024);
+        builder.RegisterService(&service);
 
-    server->Wait();
+        std::unique_ptr<grpc::Server> server = builder.BuildAndStart();
+        if (server) {
+            LOG_INFO << "OCR Server listening on " << server_address;
+
+            while (!stop_requested.load()) {
+                std::this_thread::sleep_for(std::chrono::milliseconds(100));
+            }
+            LOG_INFO << "Shutting down server...";
+            server->Shutdown();
+            server->Wait();
+        }
+        else {
+            LOG_ERROR << "Could not listen on " << server_address;
+            status = 1;
+        }
+    }
+    if (!trace_file.empty() && !writeFileAtomically(trace_file, tracing::chromeTraceJson(false))) {
+        LOG_WARN << "Could not write trace to " << trace_file;
+    }
+    logging::shutdown();
 
-    return 0;
+    return status;
 }
\ No newline at end of file
@@ -0,0 +1,225 @@
+#include "metrics.h"
+#include "ocr_service.pb.h"
+#include <algorithm>
+#include <bit>
+#include <cstdio>
+#include <filesystem>
+#include <fstream>
+#include <iterator>
+
+namespace {
+
+// Prometheus bucket bounds, in microseconds: 0.5 ms to one minute
+constexpr int64_t kExportBoundsUs[] = {
+    500, 1'000, 2'500, 5'000, 10'000, 25'000, 50'000, 100'000, 250'000, 500'000,
+    1'000'000, 2'500'000, 5'000'000, 10'000'000, 30'000'000, 60'000'000,
+};
+
+const char* tierName(ocrservice::ServiceTier tier) {
+    return tier == ocrservice::TIER_FAST ? "fast" : "accurate";
+}
+
+void appendSeconds(std::string& out, int64_t us) {
+    char number[32];
+    const int n = std::snprintf(number, sizeof(number), "%.6f", static_cast<double>(us) / 1e6);
+    out.append(number, n);
+}
+
+// Bucket bounds as Prometheus writes them: "0.0005", "1", "2.5"
+std::string boundLabel(int64_t us) {
+    char number[32];
+    const int n = std::snprintf(number, sizeof(number), "%g", static_cast<double>(us) / 1e6);
+    return std::string(number, n);
+}
+
+} // namespace
+
+const char* stageName(Stage stage) {
+    switch (stage) {
+    case Stage::QueueWait: return "queue_wait";
+    case Stage::Decode: return "decode";
+    case Stage::Preprocess: return "preprocess";
+    case Stage::Recognize: return "recognize";
+    case Stage::GetText: return "get_text";
+    case Stage::Respond: return "respond";
+    case Stage::Total: return "total";
+    }
+    return "unknown";
+}
+
+int LatencyHistogram::bucketOf(uint64_t us) {
+    if (us < 2 * kSubBuckets) {
+        return static_cast<int>(us);
+    }
+    // The top kSubBits + 1 bits pick the bucket; the leading one is implied
+    const int shift = static_cast<int>(std::bit_width(us)) - 1 - kSubBits;
+    if (shift > kMaxShift) {
+        return kBuckets - 1;
+    }
+    return (shift + 1) * kSubBuckets + static_cast<int>((us >> shift) - kSubBuckets);
+}
+
+int64_t LatencyHistogram::lowerBound(int bucket) {
+    if (bucket < 2 * kSubBuckets) {
+        return bucket;
+    }
+    const int shift = bucket / kSubBuckets - 1;
+    return static_cast<int64_t>(bucket % kSubBuckets + kSubBuckets) << shift;
+}
+
+int64_t LatencyHistogram::upperBound(int bucket) {
+    if (bucket < 2 * kSubBuckets) {
+        return bucket;
+    }
+    const int shift = bucket / kSubBuckets - 1;
+    return (static_cast<int64_t>(bucket % kSubBuckets + kSubBuckets + 1) << shift) - 1;
+}
+
+void LatencyHistogram::recordMicros(int64_t us) {
+    us = std::max<int64_t>(us, 0);
+    counts_[bucketOf(static_cast<uint64_t>(us))].fetch_add(1, std::memory_order_relaxed);
+    sum_us_.fetch_add(us, std::memory_order_relaxed);
+    int64_t max = max_us_.load(std::memory_order_relaxed);
+    while (us > max && !max_us_.compare_exchange_weak(max, us, std::memory_order_relaxed)) {
+    }
+}
+
+LatencyHistogram::Snapshot LatencyHistogram::snapshot() const {
+    Snapshot snapshot;
+    for (int i = 0; i < kBuckets; ++i) {
+        const uint64_t n = counts_[i].load(std::memory_order_relaxed);
+        if (n > 0) {
+            snapshot.buckets.push_back(Bucket{ lowerBound(i), upperBound(i), n });
+            // From the buckets, so the percentiles always add up
+            snapshot.count += n;
+        }
+    }
+    snapshot.sum_us = sum_us_.load(std::memory_order_relaxed);
+    snapshot.max_us = max_us_.load(std::memory_order_relaxed);
+    return snapshot;
+}
+
+int64_t LatencyHistogram::Snapshot::percentile(double q) const {
+    if (count == 0) {
+        return 0;
+    }
+    const uint64_t rank = std::max<uint64_t>(1, static_cast<uint64_t>(std::clamp(q, 0.0, 1.0) * count + 0.5));
+    uint64_t seen = 0;
+    for (const Bucket& bucket : buckets) {
+        seen += bucket.count;
+        if (seen >= rank) {
+            return std::min(bucket.upper_us, max_us);
+        }
+    }
+    return max_us;
+}
+
+std::string prometheusText(const ocrservice::StatsResponse& stats) {
+    std::string out;
+    out.reserve(16 * 1024);
+
+    auto header = [&out](const char* name, const char* help, const char* type) {
+        out += "# HELP ";
+        out += name;
+        out += ' ';
+        out += help;
+        out += "\n# TYPE ";
+        out += name;
+        out += ' ';
+        out += type;
+        out += '\n';
+    };
+    auto sample = [&out](const char* name, const std::string& labels, const std::string& value) {
+        out += name;
+        out += '{';
+        out += labels;
+        out += "} ";
+        out += value;
+        out += '\n';
+    };
+
+    out += "# HELP ps4_uptime_seconds Time since the server started.\n"
+        "# TYPE ps4_uptime_seconds gauge\n"
+        "ps4_uptime_seconds ";
+    appendSeconds(out, stats.uptime_ms() * 1000);
+    out += '\n';
+
+    struct TierValue {
+        const char* name;
+        const char* help;
+        const char* type;
+        int64_t (*get)(const ocrservice::TierStats&);
+    };
+    static const TierValue kTierValues[] = {
+        { "ps4_workers", "Worker threads.", "gauge",
+            [](const ocrservice::TierStats& t) -> int64_t { return t.workers(); } },
+        { "ps4_busy_workers", "Workers on a task.", "gauge",
+            [](const ocrservice::TierStats& t) -> int64_t { return t.busy_workers(); } },
+        { "ps4_queue_depth", "Tasks waiting for a worker.", "gauge",
+            [](const ocrservice::TierStats& t) -> int64_t { return t.queue_depth(); } },
+        { "ps4_engines_leased", "Engines in use.", "gauge",
+            [](const ocrservice::TierStats& t) -> int64_t { return t.engines_leased(); } },
+        { "ps4_engines_idle", "Loaded engines not in use.", "gauge",
+            [](const ocrservice::TierStats& t) -> int64_t { return t.engines_idle(); } },
+        { "ps4_requests_accepted_total", "Requests admitted.", "counter",
+            [](const ocrservice::TierStats& t) -> int64_t { return static_cast<int64_t>(t.accepted()); } },
+        { "ps4_requests_shed_total", "Requests turned away as overloaded.", "counter",
+            [](const ocrservice::TierStats& t) -> int64_t { return static_cast<int64_t>(t.shed()); } },
+        { "ps4_tasks_expired_total", "Tasks dropped unstarted at their deadline.", "counter",
+            [](const ocrservice::TierStats& t) -> int64_t { return static_cast<int64_t>(t.expired()); } },
+        { "ps4_tasks_cancelled_total", "Tasks dropped unstarted after the caller left.", "counter",
+            [](const ocrservice::TierStats& t) -> int64_t { return static_cast<int64_t>(t.cancelled()); } },
+    };
+    for (const TierValue& value : kTierValues) {
+        header(value.name, value.help, value.type);
+        for (const auto& tier : stats.tiers()) {
+            sample(value.name, std::string("tier=\"") + tierName(tier.tier()) + "\"", std::to_string(value.get(tier)));
+        }
+    }
+
+    header("ps4_worker_busy_seconds_total", "Worker time spent on tasks.", "counter");
+    for (const auto& tier : stats.tiers()) {
+        std::string value;
+        appendSeconds(value, tier.busy_ms() * 1000);
+        sample("ps4_worker_busy_seconds_total", std::string("tier=\"") + tierName(tier.tier()) + "\"", value);
+    }
+
+    header("ps4_stage_latency_seconds", "Time spent per processing stage.", "histogram");
+    for (const auto& tier : stats.tiers()) {
+        for (const auto& stage : tier.stages()) {
+            const std::string labels = std::string("tier=\"") + tierName(tier.tier()) + "\",stage=\"" + stage.stage() + "\"";
+            uint64_t counts[std::size(kExportBoundsUs)] = {};
+            for (const auto& bucket : stage.buckets()) {
+                const int64_t* bound = std::lower_bound(std::begin(kExportBoundsUs), std::end(kExportBoundsUs), bucket.upper_us());
+                if (bound != std::end(kExportBoundsUs)) {
+                    counts[bound - std::begin(kExportBoundsUs)] += bucket.count();
+                }
+            }
+            uint64_t cumulative = 0;
+            for (size_t i = 0; i < std::size(kExportBoundsUs); ++i) {
+                cumulative += counts[i];
+                sample("ps4_stage_latency_seconds_bucket", labels + ",le=\"" + boundLabel(kExportBoundsUs[i]) + "\"",
+                    std::to_string(cumulative));
+            }
+            sample("ps4_stage_latency_seconds_bucket", labels + ",le=\"+Inf\"", std::to_string(stage.count()));
+            std::string sum;
+            appendSeconds(sum, stage.sum_us());
+            sample("ps4_stage_latency_seconds_sum", labels, sum);
+            sample("ps4_stage_latency_seconds_count", labels, std::to_string(stage.count()));
+        }
+    }
+    return out;
+}
+
+bool writeFileAtomically(const std::string& path, const std::string& text) {
+    const std::string temp = path + ".tmp";
+    {
+        std::ofstream file(temp, std::ios::binary | std::ios::trunc);
+        if (!file.write(text.data(), static_cast<std::streamsize>(text.size())) || !file.flush()) {
+            return false;
+        }
+    }
+    std::error_code error;
+    std::filesystem::rename(temp, path, error);
+    return !error;
+}
\ No newline at end of file
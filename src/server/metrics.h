@@ -0,0 +1,88 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace ocrservice {
+class StatsResponse;
+}
+
+// Where a task's time goes, in the order it passes through the server.
+enum class Stage {
+    QueueWait,      // pushed to the scheduler until a worker took it
+    Decode,         // file bytes (or raw pixels) into an image
+    Preprocess,     // grayscale conversion and morphology
+    Recognize,      // layout analysis and recognition
+    GetText,        // collecting the recognized text
+    Respond,        // filling in the response and handing it to gRPC
+    Total,          // submitted until answered, cache hits included
+};
+constexpr int kStageCount = 7;
+
+const char* stageName(Stage stage);
+
+// HDR-style latency histogram: exact below 64 us, above that 32 buckets per
+// power of two, so any recorded value is off by at most ~3%. Recording is a
+// few relaxed atomic adds and never locks; any number of threads may record
+// while another takes a snapshot.
+class LatencyHistogram {
+public:
+    struct Bucket {
+        int64_t lower_us;   // inclusive
+        int64_t upper_us;   // inclusive
+        uint64_t count;
+    };
+
+    // Consistent enough for monitoring: values recorded while it is taken
+    // may show in some fields and not yet in others.
+    struct Snapshot {
+        uint64_t count = 0;
+        int64_t sum_us = 0;
+        int64_t max_us = 0;
+        std::vector<Bucket> buckets;    // non-empty ones, ascending
+
+        // Upper bound of the bucket holding quantile q (0-1); 0 if empty.
+        int64_t percentile(double q) const;
+    };
+
+    LatencyHistogram() = default;
+    LatencyHistogram(const LatencyHistogram&) = delete;
+    LatencyHistogram& operator=(const LatencyHistogram&) = delete;
+
+    void record(std::chrono::nanoseconds elapsed) {
+        recordMicros(std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count());
+    }
+    void recordMicros(int64_t us);
+
+    Snapshot snapshot() const;
+
+private:
+    static constexpr int kSubBits = 5;
+    static constexpr int kSubBuckets = 1 << kSubBits;
+    // Values are clamped to 2^36 us, about 19 hours
+    static constexpr int kMaxShift = 36 - kSubBits;
+    static constexpr int kBuckets = (kMaxShift + 2) * kSubBuckets;
+
+    static int bucketOf(uint64_t us);
+    static int64_t lowerBound(int bucket);
+    static int64_t upperBound(int bucket);
+
+    std::array<std::atomic<uint64_t>, kBuckets> counts_{};
+    std::atomic<int64_t> sum_us_{ 0 };
+    std::atomic<int64_t> max_us_{ 0 };
+};
+
+// Prometheus text exposition format of a GetStats response, for the node
+// exporter's textfile collector or any scraper that reads files. Latencies
+// are exported as histograms on a fixed set of bucket bounds, so servers
+// can be aggregated; a value is counted in the first bound at or above its
+// HDR bucket, which can put it one bound too high.
+std::string prometheusText(const ocrservice::StatsResponse& stats);
+
+// Writes text to path through a temporary file and a rename, so a reader
+// never sees a half-written file. Returns false on any I/O error.
+bool writeFileAtomically(const std::string& path, const std::string& text);
\ No newline at end of file
@@ -1,12 +1,36 @@
 #include "ocr_processor.h"
+#include "logger.h"
+#include "trace.h"
 #include <leptonica/allheaders.h>
-#include <iostream>
+#include <tesseract/ocrclass.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <vector>
 
-OCRProcessor::OCRProcessor() {
+namespace {
+
+// Ends a step begun at start: adds its time to one stage of
+// Result::Timings and records it as a span of the current trace. Returns
+// the end, which the next step can start from.
+tracing::Clock::time_point endStep(int64_t& stage_us, const char* span, tracing::Clock::time_point start) {
+	const auto end = tracing::Clock::now();
+	stage_us = std::max<int64_t>(stage_us, 0)
+		+ std::chrono::duration_cast<std::chrono::microseconds>(end - start).count();
+	tracing::record(tracing::current(), span, start, end);
+	return end;
+}
+
+} // namespace
+
+OCRProcessor::OCRProcessor(const std::string& language, const Config& config)
+	: lang(language), config(config) {
 	tess_api = std::make_unique<tesseract::TessBaseAPI>();
-	// Initialize Tesseract with English language
-	if (!initializeTesseract("eng")) {
-		std::cerr << "Failed to initialize Tesseract!" << std::endl;
+	initialized = initializeTesseract();
+	if (!initialized) {
+		LOG_ERROR << "Failed to initialize Tesseract!";
 	}
 }
 
@@ -16,61 +40,401 @@ OCRProcessor::~OCRProcessor() {
 	}
 }
 
-bool OCRProcessor::initializeTesseract(const std::string& lang) {
-	if (tess_api->Init(nullptr, lang.c_str())) {
-		std::cerr << "Could not initialize tesseract with language: " << lang << std::endl;
+bool OCRProcessor::initializeTesseract() {
+	const char* datapath = config.datapath.empty() ? nullptr : config.datapath.c_str();
+	if (tess_api->Init(datapath, lang.c_str(), config.oem)) {
+		LOG_ERROR << "Could not initialize tesseract with language: " << lang;
 		return false;
 	}
-	std::cout << "[OCRProcessor] Tesseract initialized successfully with language: " << lang << std::endl;
+	tess_api->SetPageSegMode(config.psm);
+	LOG_INFO << "[OCRProcessor] Tesseract initialized successfully with language: " << lang;
 	return true;
 }
 
-OCRProcessor::Result OCRProcessor::processImage(const std::vector<unsigned char>& image_data) {
+void OCRProcessor::setRegionHelper(RegionHelper* helper, uint64_t min_pixels) {
+	const std::lock_guard<std::mutex> lock(mutex);
+	region_helper = min_pixels > 0 ? helper : nullptr;
+	region_min_pixels = min_pixels;
+}
+
+void OCRProcessor::setMonitor(Monitor* new_monitor) {
+	const std::lock_guard<std::mutex> lock(mutex);
+	monitor = new_monitor;
+}
+
+OCRProcessor::Result OCRProcessor::processImage(const unsigned char* image_data, size_t image_size,
+	const std::string& format_hint, const Roi& roi) {
 	const std::lock_guard<std::mutex> lock(mutex);
 
 	Result result;
 	result.success = false;
 
-	std::cout << "[OCRProcessor] Starting image processing. Data size: " << image_data.size() << " bytes" << std::endl;
+	LOG_DEBUG << "[OCRProcessor] Starting image processing. Data size: " << image_size << " bytes"
+		<< (format_hint.empty() ? "" : ", format: " + format_hint);
+
+	l_int32 format = IFF_UNKNOWN;
+	if (image_size >= 12) {
+		findFileFormatBuffer(image_data, &format);
+	}
+	if (format == IFF_UNKNOWN) {
+		result.error_msg = "Unsupported image format" + (format_hint.empty() ? std::string(".") : ": " + format_hint + ".");
+		LOG_WARN << "[OCRProcessor] ERROR: " << result.error_msg;
+		return result;
+	}
 
-	Pix* image = pixReadMem(image_data.data(), static_cast<size_t>(image_data.size()));
+	const auto decode_start = tracing::Clock::now();
+	Pix* image = pixReadMem(image_data, image_size);
+	endStep(result.timings.decode_us, "pixReadMem", decode_start);
 	if (!image) {
 		result.error_msg = "Failed to read image from memory.";
-		std::cerr << "[OCRProcessor] ERROR: " << result.error_msg << std::endl;
+		LOG_WARN << "[OCRProcessor] ERROR: " << result.error_msg;
+		return result;
+	}
+
+	return recognizePix(image, result, roi);
+}
+
+int OCRProcessor::countPages(const unsigned char* image_data, size_t image_size) {
+	l_int32 format = IFF_UNKNOWN;
+	if (image_size < 12 || findFileFormatBuffer(image_data, &format) || !isTiff(format)) {
+		return 1;
+	}
+	// Walks the directory chain only; no page is decoded. Leptonica counts
+	// pages from a stream, which it opens over the buffer with fmemopen
+	// where there is one (a temporary file elsewhere).
+	FILE* stream = fopenReadFromMemory(image_data, image_size);
+	if (!stream) {
+		return 1;
+	}
+	l_int32 pages = 0;
+	const bool failed = tiffGetCount(stream, &pages) != 0;
+	fclose(stream);
+	if (failed || pages < 1) {
+		return 1;
+	}
+	return pages;
+}
+
+bool OCRProcessor::readSize(const unsigned char* image_data, size_t image_size, int& width, int& height) {
+	l_int32 format = IFF_UNKNOWN, w = 0, h = 0, bps = 0, spp = 0, iscmap = 0;
+	if (image_size < 12 || pixReadHeaderMem(image_data, image_size, &format, &w, &h, &bps, &spp, &iscmap)) {
+		return false;
+	}
+	width = w;
+	height = h;
+	return true;
+}
+
+OCRProcessor::Result OCRProcessor::processTiffPage(const unsigned char* image_data, size_t image_size, int page,
+	const Roi& roi) {
+	const std::lock_guard<std::mutex> lock(mutex);
+
+	Result result;
+	result.success = false;
+
+	LOG_DEBUG << "[OCRProcessor] Starting TIFF page " << page << ". Data size: " << image_size << " bytes";
+
+	// Decodes just this page, so a long document is never held in memory
+	// all at once
+	const auto decode_start = tracing::Clock::now();
+	Pix* image = pixReadMemTiff(image_data, image_size, page);
+	endStep(result.timings.decode_us, "pixReadMemTiff", decode_start);
+	if (!image) {
+		result.error_msg = "Failed to read TIFF page " + std::to_string(page) + " from memory.";
+		LOG_WARN << "[OCRProcessor] ERROR: " << result.error_msg;
 		return result;
 	}
 
-	std::cout << "[OCRProcessor] Image loaded successfully. Width: " << pixGetWidth(image)
+	return recognizePix(image, result, roi);
+}
+
+bool OCRProcessor::isTiff(int format) {
+	switch (format) {
+	case IFF_TIFF:
+	case IFF_TIFF_PACKBITS:
+	case IFF_TIFF_RLE:
+	case IFF_TIFF_G3:
+	case IFF_TIFF_G4:
+	case IFF_TIFF_LZW:
+	case IFF_TIFF_ZIP:
+	case IFF_TIFF_JPEG:
+		return true;
+	default:
+		return false;
+	}
+}
+
+OCRProcessor::Result OCRProcessor::recognizePix(Pix* image, Result result, const Roi& roi) {
+	LOG_DEBUG << "[OCRProcessor] Image loaded successfully. Width: " << pixGetWidth(image)
 		<< ", Height: " << pixGetHeight(image)
-		<< ", Depth: " << pixGetDepth(image) << std::endl;
+		<< ", Depth: " << pixGetDepth(image);
+
+	const auto convert_start = tracing::Clock::now();
+	preprocess::GrayImage gray;
+	const bool converted = preprocess::loadGray(image, workspace, gray);
+	pixDestroy(&image);
+	endStep(result.timings.preprocess_us, "loadGray", convert_start);
+	if (!converted) {
+		// Only allocation can fail here
+		result.error_msg = "Failed to convert image to grayscale.";
+		result.transient = true;
+		LOG_WARN << "[OCRProcessor] ERROR: " << result.error_msg;
+		return result;
+	}
+	LOG_DEBUG << "[OCRProcessor] Converted to 8-bit grayscale (" << preprocess::isaName(preprocess::activeIsa()) << ")";
+
+	return recognize(gray, result, roi);
+}
+
+OCRProcessor::Result OCRProcessor::processRawImage(const unsigned char* pixels, size_t size,
+	int width, int height, int stride, const Roi& roi) {
+	const std::lock_guard<std::mutex> lock(mutex);
+
+	Result result;
+	result.success = false;
+
+	LOG_DEBUG << "[OCRProcessor] Starting raw image processing. Width: " << width
+		<< ", Height: " << height << ", Stride: " << stride;
+
+	if (width <= 0 || height <= 0 || stride < width ||
+		size < static_cast<size_t>(height - 1) * stride + width) {
+		result.error_msg = "Invalid raw pixel buffer.";
+		LOG_WARN << "[OCRProcessor] ERROR: " << result.error_msg;
+		return result;
+	}
+
+	// The request buffer is read-only and the morphology runs in place, so
+	// the pixels are copied once into the workspace.
+	const auto copy_start = tracing::Clock::now();
+	preprocess::GrayImage gray = workspace.gray(width, height);
+	preprocess::copyGray(pixels, stride, width, height, gray);
+	endStep(result.timings.decode_us, "copyGray", copy_start);
+
+	return recognize(gray, result, roi);
+}
+
+OCRProcessor::Result OCRProcessor::recognize(preprocess::GrayImage& page, Result result, const Roi& roi) {
+	// Cropping is a view into the same buffer, so the rest of the page is
+	// never filtered or copied into Tesseract
+	preprocess::GrayImage image = page;
+	if (!roi.empty()) {
+		// The roi comes from the client: x + width may not fit in an int
+		const int left = std::clamp(roi.x, 0, page.width);
+		const int top = std::clamp(roi.y, 0, page.height);
+		const int64_t right = std::min<int64_t>(int64_t{ roi.x } + roi.width, page.width);
+		const int64_t bottom = std::min<int64_t>(int64_t{ roi.y } + roi.height, page.height);
+		image.width = static_cast<int>(std::max<int64_t>(right - left, 0));
+		image.height = static_cast<int>(std::max<int64_t>(bottom - top, 0));
+		if (image.width <= 0 || image.height <= 0) {
+			result.error_msg = "Region of interest is outside the image.";
+			LOG_WARN << "[OCRProcessor] ERROR: " << result.error_msg;
+			return result;
+		}
+		image.data = page.data + static_cast<size_t>(top) * page.stride + left;
+		LOG_DEBUG << "[OCRProcessor] Cropped to " << image.width << "x" << image.height
+			<< " at (" << left << ", " << top << ")";
+	}
 
 	// Preprocess and inference
-	image = pixConvertTo8(image, false);
-	std::cout << "[OCRProcessor] Converted to 8-bit grayscale" << std::endl;
+	const auto open_start = tracing::Clock::now();
+	preprocess::open3x3(image, workspace);
+	const auto close_start = endStep(result.timings.preprocess_us, "open3x3", open_start);
+	LOG_DEBUG << "[OCRProcessor] Applied morphological opening";
+
+	preprocess::close3x3(image, workspace);
+	endStep(result.timings.preprocess_us, "close3x3", close_start);
+	LOG_DEBUG << "[OCRProcessor] Applied morphological closing";
 
-	image = pixOpenGray(image, 3, 3);
-	std::cout << "[OCRProcessor] Applied morphological opening" << std::endl;
+	const auto set_start = tracing::Clock::now();
+	tess_api->SetImage(image.data, image.width, image.height, 1, image.stride);
+	const auto recognize_start = endStep(result.timings.recognize_us, "SetImage", set_start);
+	LOG_DEBUG << "[OCRProcessor] Image set in Tesseract, starting OCR...";
 
-	image = pixCloseGray(image, 3, 3);
-	std::cout << "[OCRProcessor] Applied morphological closing" << std::endl;
+	const uint64_t pixels = static_cast<uint64_t>(image.width) * image.height;
+	if (region_helper && pixels >= region_min_pixels && recognizeRegions(image, result)) {
+		endStep(result.timings.recognize_us, "recognizeRegions", recognize_start);
+		LOG_DEBUG << "[OCRProcessor] Processing complete. Success: " << (result.success ? "YES" : "NO");
+		return result;
+	}
 
-	tess_api->SetImage(image);
-	std::cout << "[OCRProcessor] Image set in Tesseract, starting OCR..." << std::endl;
+	const bool recognized = runRecognition(monitor, true);
+	endStep(result.timings.recognize_us, "Recognize", recognize_start);
+	if (!recognized) {
+		const bool cancelled = monitor && monitor->cancelled();
+		result.error_msg = cancelled ? "Recognition cancelled." : "Tesseract failed to recognize the image.";
+		result.transient = !cancelled;
+		LOG_WARN << "[OCRProcessor] ERROR: " << result.error_msg;
+		return result;
+	}
 
+	// Recognition is done, so this only collects the text
+	const auto text_start = tracing::Clock::now();
 	char* text = tess_api->GetUTF8Text();
+	endStep(result.timings.text_us, "GetUTF8Text", text_start);
 	if (text) {
 		result.text = std::string(text);
 		result.success = true;
-		std::cout << "[OCRProcessor] OCR SUCCESS! Extracted " << result.text.length() << " characters" << std::endl;
-		std::cout << "[OCRProcessor] Text preview: \"" << result.text.substr(0, std::min<size_t>(100, result.text.length())) << "\"" << std::endl;
-		//delete[] text;
+		LOG_DEBUG << "[OCRProcessor] OCR SUCCESS! Extracted " << result.text.length() << " characters";
+		LOG_TRACE << "[OCRProcessor] Text preview: \"" << result.text.substr(0, std::min<size_t>(100, result.text.length())) << "\"";
+		delete[] text;
 	}
 	else {
 		result.error_msg = "Tesseract failed to extract text.";
-		std::cerr << "[OCRProcessor] ERROR: " << result.error_msg << std::endl;
+		result.transient = true;
+		LOG_WARN << "[OCRProcessor] ERROR: " << result.error_msg;
 	}
 
-	pixDestroy(&image); // cleanup
-	std::cout << "[OCRProcessor] Processing complete. Success: " << (result.success ? "YES" : "NO") << std::endl;
+	LOG_DEBUG << "[OCRProcessor] Processing complete. Success: " << (result.success ? "YES" : "NO");
 	return result;
+}
+
+namespace {
+
+bool cancelRecognition(void* monitor, int /*words*/) {
+	return static_cast<OCRProcessor::Monitor*>(monitor)->cancelled();
+}
+
+bool reportProgress(tesseract::ETEXT_DESC* desc, int /*left*/, int /*right*/, int /*top*/, int /*bottom*/) {
+	static_cast<OCRProcessor::Monitor*>(desc->cancel_this)->progress(desc->progress);
+	return true;
+}
+
+// Blocks of one page, claimed one at a time by whichever engine is free;
+// the page's own engine takes part too, so nothing waits on a helper that
+// never started. Shared with the helper jobs, which may outlive the call.
+struct RegionBatch {
+	std::vector<std::string> texts;
+	std::atomic<size_t> next{ 0 };
+	std::mutex mutex;
+	std::condition_variable done_cv;
+	size_t done = 0;
+	// Once set, the remaining blocks are skipped
+	std::atomic<bool> failed{ false };
+};
+
+// Margin added around each block so glyphs on its edge are not clipped
+constexpr int kRegionMargin = 4;
+
+} // namespace
+
+bool OCRProcessor::recognizeRegions(const preprocess::GrayImage& image, Result& result) {
+	// Layout analysis only; when the page is not split, GetUTF8Text reuses it
+	Boxa* blocks = tess_api->GetComponentImages(tesseract::RIL_BLOCK, true, nullptr, nullptr);
+	if (!blocks) {
+		return false;
+	}
+	const int count = boxaGetCount(blocks);
+	const int helpers = count < 2 ? 0 : std::min(count - 1, region_helper->spareEngines(lang, config.oem));
+	if (helpers <= 0) {
+		boxaDestroy(&blocks);
+		return false;
+	}
+
+	// Blocks come back in Tesseract's reading order
+	std::vector<Region> regions(count);
+	for (int i = 0; i < count; ++i) {
+		l_int32 x = 0, y = 0, w = 0, h = 0;
+		boxaGetBoxGeometry(blocks, i, &x, &y, &w, &h);
+		const int left = std::max(0, x - kRegionMargin);
+		const int top = std::max(0, y - kRegionMargin);
+		regions[i] = { left, top,
+			std::min(image.width, x + w + kRegionMargin) - left,
+			std::min(image.height, y + h + kRegionMargin) - top };
+	}
+	boxaDestroy(&blocks);
+	LOG_DEBUG << "[OCRProcessor] Splitting page into " << count << " blocks across "
+		<< (helpers + 1) << " engines";
+
+	auto batch = std::make_shared<RegionBatch>();
+	batch->texts.resize(count);
+	// image and regions belong to this call. A job only touches them after
+	// claiming an index below count, and this call cannot return until every
+	// claimed index is done, so late jobs find nothing left and exit.
+	// The same holds for monitor, which the caller keeps until we return.
+	auto drain = [batch, image, regions = std::move(regions), monitor = monitor,
+		trace = tracing::current()](OCRProcessor& engine) {
+		for (;;) {
+			const size_t i = batch->next.fetch_add(1);
+			if (i >= regions.size()) {
+				return;
+			}
+			tracing::Span span(trace, "recognizeRegion", "block", static_cast<int64_t>(i));
+			if (batch->failed || !engine.recognizeRegion(image, regions[i], monitor, batch->texts[i])) {
+				batch->failed = true;
+			}
+			std::lock_guard<std::mutex> lock(batch->mutex);
+			++batch->done;
+			if (monitor) {
+				monitor->progress(static_cast<int>(batch->done * 100 / regions.size()));
+			}
+			if (batch->done == regions.size()) {
+				batch->done_cv.notify_all();
+			}
+		}
+	};
+
+	for (int i = 0; i < helpers; ++i) {
+		region_helper->run(lang, config.oem, [drain](OCRProcessor& engine) {
+			const std::lock_guard<std::mutex> lock(engine.mutex);
+			drain(engine);
+		});
+	}
+	drain(*this);
+
+	{
+		std::unique_lock<std::mutex> lock(batch->mutex);
+		batch->done_cv.wait(lock, [&] { return batch->done == static_cast<size_t>(count); });
+	}
+
+	if (batch->failed) {
+		const bool cancelled = monitor && monitor->cancelled();
+		result.error_msg = cancelled ? "Recognition cancelled." : "Tesseract failed to extract text.";
+		result.transient = !cancelled;
+		LOG_WARN << "[OCRProcessor] ERROR: " << result.error_msg;
+		return true;
+	}
+	for (const std::string& text : batch->texts) {
+		if (!result.text.empty() && !text.empty()) {
+			result.text += "\n";
+		}
+		result.text += text;
+	}
+	result.success = true;
+	LOG_DEBUG << "[OCRProcessor] OCR SUCCESS! Extracted " << result.text.length() << " characters from "
+		<< count << " blocks";
+	return true;
+}
+
+bool OCRProcessor::recognizeRegion(const preprocess::GrayImage& image, const Region& region, Monitor* monitor,
+	std::string& text) {
+	// Only the block's pixels are handed over, so Tesseract copies and
+	// thresholds just that part of the page
+	const unsigned char* origin = image.data + static_cast<size_t>(region.y) * image.stride + region.x;
+	tess_api->SetImage(origin, region.width, region.height, 1, image.stride);
+	// Progress is reported per block by the caller
+	if (!runRecognition(monitor, false)) {
+		return false;
+	}
+	char* utf8 = tess_api->GetUTF8Text();
+	if (!utf8) {
+		return false;
+	}
+	text = utf8;
+	delete[] utf8;
+	return true;
+}
+
+bool OCRProcessor::runRecognition(Monitor* monitor, bool report_progress) {
+	if (!monitor) {
+		return tess_api->Recognize(nullptr) == 0;
+	}
+	tesseract::ETEXT_DESC desc;
+	desc.cancel = &cancelRecognition;
+	desc.cancel_this = monitor;
+	if (report_progress) {
+		desc.progress_callback2 = &reportProgress;
+	}
+	// A cancel part way through can still end in a "successful" Recognize
+	// with only some of the words done
+	return tess_api->Recognize(&desc) == 0 && !monitor->cancelled();
 }
\ No newline at end of file
@@ -1,27 +1,153 @@
 #pragma once
 
 #include <string>
-#include <vector>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
 #include <memory>
 #include <mutex>
 #include <tesseract/baseapi.h>
+#include "preprocess.h"
 
 class OCRProcessor {
 public:
-	OCRProcessor();
+	// How an engine is set up; fixed for its lifetime.
+	struct Config {
+		// Directory with the traineddata (tessdata_best, tessdata_fast, ...).
+		// Empty means TESSDATA_PREFIX.
+		std::string datapath;
+		tesseract::OcrEngineMode oem;
+		// TessBaseAPI's own default: the image is one block of text.
+		tesseract::PageSegMode psm;
+
+		Config() : oem(tesseract::OEM_DEFAULT), psm(tesseract::PSM_SINGLE_BLOCK) {}
+	};
+
+	// Loads the traineddata for language ("eng", "deu", "eng+fra", ...).
+	// Check ready() before use: Init fails if it is missing.
+	explicit OCRProcessor(const std::string& language = "eng", const Config& config = Config());
 	~OCRProcessor();
 
+	bool ready() const { return initialized; }
+	const std::string& language() const { return lang; }
+	tesseract::OcrEngineMode engineMode() const { return config.oem; }
+
 	struct Result {
 		std::string text;
 		bool success;
 		std::string error_msg;
+		// The engine failed rather than the input: another attempt, best on
+		// another engine, may succeed. Bad input and cancellation never are.
+		bool transient = false;
+
+		// Microseconds spent in each stage of this call; -1 where a stage
+		// did not run. On a page split across engines, collecting the text
+		// is part of recognize_us.
+		struct Timings {
+			int64_t decode_us = -1;
+			int64_t preprocess_us = -1;
+			int64_t recognize_us = -1;
+			int64_t text_us = -1;
+		};
+		Timings timings;
+	};
+
+	// Part of the image to recognize, in pixels of the decoded image. Empty
+	// means all of it. Only this part is preprocessed and handed to Tesseract.
+	struct Roi {
+		int x;
+		int y;
+		int width;
+		int height;
+
+		Roi() : x(0), y(0), width(0), height(0) {}
+		bool empty() const { return width <= 0 || height <= 0; }
+	};
+
+	// image_data is only read, never retained past the call. format_hint is
+	// what the client claims the bytes are; Leptonica sniffs the real format.
+	Result processImage(const unsigned char* image_data, size_t image_size,
+		const std::string& format_hint = std::string(), const Roi& roi = Roi());
+
+	// Pages in a multi-page TIFF, or 1 for anything else. Reads only the
+	// TIFF directory chain, so it is cheap enough for the RPC thread.
+	static int countPages(const unsigned char* image_data, size_t image_size);
+	// Size of the (first) page from the header alone; false if unreadable.
+	static bool readSize(const unsigned char* image_data, size_t image_size, int& width, int& height);
+	// One page (0-based) of a TIFF; only that page is decoded.
+	Result processTiffPage(const unsigned char* image_data, size_t image_size, int page, const Roi& roi = Roi());
+
+	// Raw 8-bit grayscale pixels; no decode or depth conversion is needed.
+	Result processRawImage(const unsigned char* pixels, size_t size, int width, int height, int stride,
+		const Roi& roi = Roi());
+
+	// Lends other engines to a large page. Implemented by the service on top
+	// of its engine pool.
+	class RegionHelper {
+	public:
+		virtual ~RegionHelper() = default;
+		// How many more engines of this kind could start on a region now.
+		virtual int spareEngines(const std::string& language, tesseract::OcrEngineMode oem) = 0;
+		// Runs job on another thread with an engine of this kind, or drops
+		// it if none is free by the time it gets there.
+		virtual void run(const std::string& language, tesseract::OcrEngineMode oem,
+			std::function<void(OCRProcessor&)> job) = 0;
 	};
 
-	Result processImage(const std::vector<unsigned char>& image_data);
+	// Pages of at least min_pixels get layout analysis here, after which
+	// their text blocks are recognized in parallel on spare engines and
+	// joined in reading order. nullptr or 0 turns this off.
+	void setRegionHelper(RegionHelper* helper, uint64_t min_pixels);
+
+	// Follows one recognition from inside Tesseract. On a split page every
+	// engine working on it polls cancelled() concurrently; progress() calls
+	// never overlap.
+	class Monitor {
+	public:
+		virtual ~Monitor() = default;
+		// Polled between words; returning true abandons the image at once.
+		virtual bool cancelled() = 0;
+		// How far recognition of the current image is, 0-100.
+		virtual void progress(int percent) = 0;
+	};
+
+	// Used by every recognition until reset with nullptr. The monitor must
+	// outlive those calls.
+	void setMonitor(Monitor* monitor);
 
 private:
+	struct Region {
+		int x, y, width, height;
+	};
+
 	std::unique_ptr<tesseract::TessBaseAPI> tess_api;
+	std::string lang;
+	Config config;
+	bool initialized = false;
+	RegionHelper* region_helper = nullptr;
+	uint64_t region_min_pixels = 0;
+	Monitor* monitor = nullptr;
 	std::mutex mutex;
+	// Preprocessing buffers, reused across images. Guarded by mutex.
+	preprocess::Workspace workspace;
 
-	bool initializeTesseract(const std::string& lang = "eng");
+	bool initializeTesseract();
+	static bool isTiff(int format);
+	// Decoded image -> grayscale in workspace -> recognize. Takes ownership
+	// of image. Caller holds mutex.
+	Result recognizePix(Pix* image, Result result, const Roi& roi);
+	// Shared tail of all entry points: crop to roi, preprocess in place and
+	// recognize. image lives in workspace. Caller holds mutex.
+	Result recognize(preprocess::GrayImage& image, Result result, const Roi& roi);
+	// Splits the page set in tess_api into text blocks and recognizes them
+	// across engines. Returns false, leaving result alone, if the page is
+	// not worth splitting or no engine is spare. Caller holds mutex.
+	bool recognizeRegions(const preprocess::GrayImage& image, Result& result);
+	// One block on this engine, cancelled through monitor. Caller holds this
+	// engine's mutex.
+	bool recognizeRegion(const preprocess::GrayImage& image, const Region& region, Monitor* monitor,
+		std::string& text);
+	// Recognize() on the image set in tess_api, reporting to monitor if
+	// given. Returns false if it failed or was cancelled.
+	bool runRecognition(Monitor* monitor, bool report_progress);
 };
\ No newline at end of file
@@ -1,174 +1,940 @@
 #include "ocr_service.h"
-#include <iostream>
+#include "logger.h"
+#include "trace.h"
+#include <algorithm>
 #include <chrono>
 #include <thread>
+#include <deque>
+#include <mutex>
 
-OCRService::OCRService(int n_threads) : shutdown_(false) {
-    // Create one processor per thread
-    for (int i = 0; i < n_threads; ++i) {
-        processors_.emplace_back(std::make_unique<OCRProcessor>());
+namespace {
+
+// gRPC reports deadlines on the system clock; tasks are timed on the steady
+// one so a wall-clock step cannot expire (or revive) queued work.
+TaskClock::time_point taskDeadline(const grpc::CallbackServerContext* context) {
+    const std::chrono::system_clock::time_point deadline = context->deadline();
+    if (deadline == std::chrono::system_clock::time_point::max()) {
+        return TaskClock::time_point::max();
     }
+    const auto remaining = deadline - std::chrono::system_clock::now();
+    return TaskClock::now() + std::chrono::duration_cast<TaskClock::duration>(remaining);
+}
+
+// Adapts a task's callbacks to the engine: also stops recognition once the
+// task's deadline passes, and only passes progress on in kProgressStep steps.
+class TaskMonitor final : public OCRProcessor::Monitor {
+public:
+    explicit TaskMonitor(const ImageTask& task) : task_(task) {}
 
-    // Start worker threads
-    for (int i = 0; i < n_threads; ++i) {
-        workers_.emplace_back(&OCRService::workerThread, this, i);
+    bool cancelled() override {
+        return task_.expired(TaskClock::now()) || (task_.cancelled && task_.cancelled());
     }
 
-    std::cout << "OCRService started with " << n_threads << " threads." << std::endl;
-}
+    void progress(int percent) override {
+        // 100 is left to the result itself
+        if (!task_.on_progress || percent < reported_ + kProgressStep || percent >= 100) {
+            return;
+        }
+        reported_ = percent;
+        task_.on_progress(std::max(task_.page, 0), percent);
+    }
 
-OCRService::~OCRService() {
-    {
-        std::unique_lock<std::mutex> lock(queue_mutex_);
-        shutdown_ = true;
+private:
+    static constexpr int kProgressStep = 5;
+
+    const ImageTask& task_;
+    int reported_ = 0;
+};
+
+// Counts a worker as busy, and its time as busy time, while in scope.
+class BusyScope {
+public:
+    BusyScope(std::atomic<int>& busy_workers, std::atomic<int64_t>& busy_us)
+        : busy_workers_(busy_workers), busy_us_(busy_us), start_(TaskClock::now()) {
+        busy_workers_.fetch_add(1, std::memory_order_relaxed);
+    }
+    ~BusyScope() {
+        const auto elapsed = std::chrono::duration_cast<std::chrono::microseconds>(TaskClock::now() - start_);
+        busy_us_.fetch_add(elapsed.count(), std::memory_order_relaxed);
+        busy_workers_.fetch_sub(1, std::memory_order_relaxed);
+    }
+
+    BusyScope(const BusyScope&) = delete;
+    BusyScope& operator=(const BusyScope&) = delete;
+
+private:
+    std::atomic<int>& busy_workers_;
+    std::atomic<int64_t>& busy_us_;
+    const TaskClock::time_point start_;
+};
+
+// A unary call answers once, so the pages of a multi-page TIFF are
+// collected here and joined in page order when the last one is done.
+class PageMerge {
+public:
+    explicit PageMerge(int page_count) : results_(page_count), remaining_(page_count) {}
+
+    // Returns true for the page that completes the document.
+    bool add(int page, const TaskResult& result) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        results_[page] = result;
+        return --remaining_ == 0;
     }
-    queue_cv_.notify_all();
 
-    for (auto& worker : workers_) {
-        if (worker.joinable()) {
-            worker.join();
+    // Only after add() has returned true.
+    TaskResult merged() const {
+        TaskResult merged;
+        merged.success = true;
+        for (size_t page = 0; page < results_.size(); ++page) {
+            const TaskResult& result = results_[page];
+            if (page > 0) {
+                merged.text += '\f';  // Tesseract's own page separator
+            }
+            merged.text += result.text;
+            if (!result.success) {
+                merged.success = false;
+                if (merged.abandoned == TaskResult::Abandoned::No) {
+                    // The document is only as done as its least done page
+                    merged.abandoned = result.abandoned;
+                }
+                if (!merged.error_message.empty()) {
+                    merged.error_message += " ";
+                }
+                merged.error_message += "Page " + std::to_string(page + 1) + ": " + result.error_message;
+            }
         }
+        return merged;
     }
-    std::cout << "OCRService shut down." << std::endl;
+
+private:
+    std::mutex mutex_;
+    std::vector<TaskResult> results_;
+    int remaining_;
+};
+
+// Status for a unary call: an abandoned task is not an answer about the
+// image, and must not look like one to clients that record OK failures as
+// final.
+grpc::Status callStatus(const TaskResult& result) {
+    switch (result.abandoned) {
+    case TaskResult::Abandoned::Deadline:
+        return grpc::Status(grpc::StatusCode::DEADLINE_EXCEEDED, result.error_message);
+    case TaskResult::Abandoned::Cancelled:
+        return grpc::Status(grpc::StatusCode::CANCELLED, result.error_message);
+    case TaskResult::Abandoned::Shutdown:
+        return grpc::Status(grpc::StatusCode::UNAVAILABLE, result.error_message);
+    case TaskResult::Abandoned::No:
+        break;
+    }
+    return grpc::Status::OK;
 }
 
-void OCRService::workerThread(int thread_id) {
-    constexpr int kMaxRetries = 3;
-    constexpr int kRetryDelayMs = 200;
+} // namespace
+
+OCRService::OCRService(const ServiceOptions& options)
+    : cache_(options.cache),
+      next_task_id_(1),
+      split_min_pixels_(options.split_min_pixels),
+      // Straight back to the tier's queue: the task already went through
+      // admission and the cache, and its callbacks still point at both
+      retries_([this](ImageTask task) {
+          const auto now = TaskClock::now();
+          tracing::recordAsync(task.trace_id, task.task_id, "retry_wait", task.queued, now);
+          task.queued = now;
+          tierOf(task).scheduler->push(std::move(task));
+      }),
+      started_(TaskClock::now()),
+      stats_file_(options.stats_file),
+      stats_interval_(std::max<int64_t>(options.stats_interval_ms, 100)) {
+    // Requests live on per-call arenas so workers can read them in place
+    SetMessageAllocatorFor_ProcessImage(&request_allocator_);
+
+    const TierOptions* tier_options[kServiceTierCount] = { &options.accurate, &options.fast };
+    const char* tier_names[kServiceTierCount] = { "accurate", "fast" };
+    for (int t = 0; t < kServiceTierCount; ++t) {
+        Tier& tier = tiers_[t];
+        const int n_threads = tier_options[t]->n_threads;
+        tier.name = tier_names[t];
+        tier.scheduler = TaskScheduler::create(options.scheduler_kind, n_threads);
+
+        // A worker holds at most one engine at a time, so one per worker and
+        // language is all that can ever be busy at once
+        EnginePool::Options engines = tier_options[t]->engines;
+        engines.engines_per_language = n_threads;
+        tier.engines = std::make_unique<EnginePool>(engines);
+        tier.admission = std::make_unique<AdmissionController>(tier_options[t]->admission, n_threads);
+
+        if (static_cast<ServiceTier>(t) == ServiceTier::Accurate && split_min_pixels_ > 0) {
+            // Splitting only borrows engines while no task is waiting for one
+            TaskScheduler* scheduler = tier.scheduler.get();
+            tier.regions = std::make_unique<RegionPool>(*tier.engines, n_threads - 1,
+                [scheduler] { return scheduler->stats().depth <= 0; });
+        }
+
+        for (int i = 0; i < n_threads; ++i) {
+            tier.workers.emplace_back(&OCRService::workerThread, this, &tier, i);
+        }
+    }
+
+    LOG_INFO << "OCRService started with " << options.accurate.n_threads << " accurate and "
+        << options.fast.n_threads << " fast threads ("
+        << TaskScheduler::kindName(options.scheduler_kind) << " scheduler, "
+        << (cache_.enabled() ? "result cache on" : "result cache off") << ").";
 
-    std::cout << "[Server] Worker thread " << thread_id << " started." << std::endl;
+    if (!stats_file_.empty()) {
+        stats_writer_ = std::thread(&OCRService::statsWriterThread, this);
+    }
+}
 
-    while (true) {
-        ImageTask task;
+OCRService::~OCRService() {
+    if (stats_writer_.joinable()) {
         {
-            std::unique_lock<std::mutex> lock(queue_mutex_);
-            queue_cv_.wait(lock, [this]() { return !task_queue_.empty() || shutdown_; });
-
-            if (shutdown_ && task_queue_.empty()) {
-                break;
+            std::lock_guard<std::mutex> lock(stats_mutex_);
+            stopping_ = true;
+        }
+        stats_cv_.notify_one();
+        stats_writer_.join();
+    }
+    // First, so no retry is pushed to a scheduler whose workers are gone
+    retries_.stop();
+    for (Tier& tier : tiers_) {
+        tier.scheduler->shutdown();
+    }
+    for (Tier& tier : tiers_) {
+        for (auto& worker : tier.workers) {
+            if (worker.joinable()) {
+                worker.join();
             }
+        }
+    }
 
-            if (!task_queue_.empty()) {
-                task = std::move(task_queue_.front());
-                task_queue_.pop();
+    for (const Tier& tier : tiers_) {
+        TaskScheduler::Stats stats = tier.scheduler->stats();
+        LOG_INFO << "[Server] Scheduler stats (" << tier.name << "): pushed=" << stats.pushed
+            << " popped=" << stats.popped
+            << " steals=" << stats.steals
+            << " failed_steals=" << stats.failed_steals
+            << " lock_contention=" << stats.lock_contention
+            << " sleeps=" << stats.sleeps
+            << " expired=" << stats.expired
+            << " cancelled=" << stats.cancelled;
+        EnginePool::Stats engines = tier.engines->stats();
+        LOG_INFO << "[Server] Engine stats (" << tier.name << "): leases=" << engines.leases
+            << " lazy_loads=" << engines.lazy_loads
+            << " failed_loads=" << engines.failed_loads
+            << " discarded=" << engines.discarded
+            << " idle=" << engines.idle_engines
+            << " warm_start_ms=" << engines.warm_start_ms;
+        AdmissionController::Stats admission = tier.admission->stats();
+        LOG_INFO << "[Server] Admission stats (" << tier.name << "): accepted=" << admission.accepted
+            << " shed=" << admission.shed
+            << " ns_per_pixel=" << admission.ns_per_pixel;
+    }
+    LOG_INFO << "[Server] Retries scheduled: " << retries_.scheduled();
+    ArenaRequestAllocator::Stats ingest = ArenaRequestAllocator::stats();
+    LOG_INFO << "[Server] Ingest stats: calls=" << ingest.calls
+        << " image_bytes=" << ingest.image_bytes
+        << " peak_inflight_image_bytes=" << ingest.peak_inflight_image_bytes
+        << " arena_blocks=" << ingest.arena_blocks
+        << " arena_block_bytes=" << ingest.arena_block_bytes;
+    ResultCache::Stats cache = cache_.stats();
+    LOG_INFO << "[Server] Cache stats: hits=" << cache.hits
+        << " disk_hits=" << cache.disk_hits
+        << " misses=" << cache.misses
+        << " coalesced=" << cache.coalesced
+        << " evictions=" << cache.evictions
+        << " entries=" << cache.entries;
+    if (!stats_file_.empty()) {
+        // Final numbers, with every task accounted for
+        writeStatsFile();
+    }
+    LOG_INFO << "OCRService shut down.";
+}
 
-                std::cout << "[Server] Thread " << thread_id
-                    << " received task. Request ID: " << task.request_id
-                    << ", Image size: " << task.image_data.size() << " bytes" << std::endl;
-            }
-            else {
-                continue;
-            }
+void OCRService::workerThread(Tier* tier, int thread_id) {
+    constexpr int kMaxAttempts = 3;
+    constexpr int kRetryDelayMs = 200;  // doubled for every further attempt
+
+    LOG_DEBUG << "[Server] Worker thread " << thread_id << " (" << tier->name << ") started.";
+    tracing::setThreadName(std::string(tier->name) + " worker " + std::to_string(thread_id));
+
+    while (true) {
+        ImageTask task;
+        if (!tier->scheduler->pop(thread_id, task)) {
+            break;
         }
+        const auto dequeued = TaskClock::now();
+        tier->stage(Stage::QueueWait).record(dequeued - task.queued);
+        // Waiting is not work on this thread: shown on the task's track
+        tracing::recordAsync(task.trace_id, task.task_id, "queue_wait", task.queued, dequeued);
+        // Spans further down, in the engine too, belong to this task
+        tracing::Scope trace(task.trace_id);
+        BusyScope busy(tier->busy_workers, tier->busy_us);
+
+        LOG_DEBUG << "[Server] Thread " << thread_id
+            << " received task " << task.task_id << ". Request ID: " << task.request_id
+            << ", Image size: " << task.image_size << " bytes";
 
         TaskResult task_result;
         bool success = false;
+        bool retry = false;
+        TaskResult::Abandoned abandoned = TaskResult::Abandoned::No;
         std::string error_message;
         std::string text;
-        int attempt = 0;
         auto start_time = std::chrono::high_resolution_clock::now();
 
-        while (attempt < kMaxRetries) {
-            std::cout << "[Server] Thread " << thread_id << " processing image (attempt " << (attempt + 1) << ")..." << std::endl;
-            auto result = processors_[thread_id]->processImage(task.image_data);
+        // Leased per task: any worker can serve any language
+        EnginePool::Lease engine;
+        {
+            tracing::Span span("acquire_engine");
+            engine = tier->engines->acquire(task.language, tier->engines->defaultOem());
+        }
+        TaskMonitor monitor(task);
+        if (!engine) {
+            error_message = "Language '" + task.language + "' is not available on this server.";
+            LOG_DEBUG << "[Server] Thread " << thread_id << " " << error_message;
+        }
+        else {
+            engine->setRegionHelper(tier->regions.get(), split_min_pixels_);
+            engine->setMonitor(&monitor);
+
+            OCRProcessor::Roi roi;
+            roi.x = task.roi_x;
+            roi.y = task.roi_y;
+            roi.width = task.roi_width;
+            roi.height = task.roi_height;
+
+            LOG_DEBUG << "[Server] Thread " << thread_id << " processing image (attempt " << (task.attempt + 1) << ")...";
+            tracing::Span span("attempt", "attempt", task.attempt + 1);
+            const auto attempt_start = std::chrono::steady_clock::now();
+            auto result = task.isRaw()
+                ? engine->processRawImage(task.image_data, task.image_size,
+                    task.raw_width, task.raw_height, task.raw_stride, roi)
+                : task.page >= 0
+                ? engine->processTiffPage(task.image_data, task.image_size, task.page, roi)
+                : engine->processImage(task.image_data, task.image_size, task.format, roi);
+            engine->setMonitor(nullptr);
+
+            const OCRProcessor::Result::Timings& timings = result.timings;
+            const std::pair<Stage, int64_t> stages[] = {
+                { Stage::Decode, timings.decode_us },
+                { Stage::Preprocess, timings.preprocess_us },
+                { Stage::Recognize, timings.recognize_us },
+                { Stage::GetText, timings.text_us },
+            };
+            for (const auto& [stage, us] : stages) {
+                if (us >= 0) {
+                    tier->stage(stage).recordMicros(us);
+                }
+            }
 
-            if (result.success) {
-                success = true;
-                text = result.text;
-                error_message = result.error_msg;
-                break;
+            success = result.success;
+            text = std::move(result.text);
+            error_message = result.error_msg;
+            if (success) {
+                tier->admission->recordCost(task.pixels, std::chrono::steady_clock::now() - attempt_start);
             }
             else {
-                error_message = result.error_msg;
-                std::cout << "[Server] Thread " << thread_id << " processing failed: " << error_message << std::endl;
-                if (attempt < kMaxRetries - 1) {
-                    std::this_thread::sleep_for(std::chrono::milliseconds(kRetryDelayMs));
+                LOG_DEBUG << "[Server] Thread " << thread_id << " processing failed: " << error_message
+                    << (result.transient ? " (transient)" : "");
+                if (result.transient) {
+                    // The engine may be what is broken; the retry gets another
+                    engine.discard();
+                    retry = task.attempt + 1 < kMaxAttempts && !monitor.cancelled();
                 }
+                if (monitor.cancelled()) {
+                    // Stopped for this caller's sake; says nothing about the image
+                    abandoned = task.expired(TaskClock::now())
+                        ? TaskResult::Abandoned::Deadline : TaskResult::Abandoned::Cancelled;
+                }
+            }
+        }
+        engine = EnginePool::Lease();
+
+        if (retry) {
+            const auto due = TaskClock::now() + std::chrono::milliseconds(kRetryDelayMs << task.attempt);
+            // A retry that could only finish after the deadline is not worth
+            // queueing
+            if (due < task.deadline) {
+                ++task.attempt;
+                task.queued = TaskClock::now();
+                const uint64_t task_id = task.task_id;
+                if (retries_.schedule(std::move(task), due)) {
+                    LOG_DEBUG << "[Server] Thread " << thread_id << " scheduled task " << task_id
+                        << " for another attempt";
+                    continue;
+                }
+                --task.attempt;
+            }
+            else {
+                abandoned = TaskResult::Abandoned::Deadline;
             }
-            ++attempt;
         }
 
         auto end_time = std::chrono::high_resolution_clock::now();
         auto duration = std::chrono::duration_cast<std::chrono::milliseconds>(end_time - start_time);
 
-        std::cout << "[Server] Thread " << thread_id
+        LOG_DEBUG << "[Server] Thread " << thread_id
             << " completed in " << duration.count() << "ms. "
             << "Success: " << (success ? "Yes" : "No")
-            << ", Text length: " << text.length() << std::endl;
+            << ", Text length: " << text.length();
+
+        task_result.text = std::move(text);
+        task_result.success = success;
+        task_result.error_message = error_message;
+        task_result.abandoned = abandoned;
+
+        LOG_DEBUG << "[Server] Thread " << thread_id
+            << " completing task " << task.task_id << " (request ID: " << task.request_id << ")";
+
+        // Hand the result to this task's own completion slot
+        const auto respond_start = TaskClock::now();
+        task.on_complete(task_result);
+        const auto responded = TaskClock::now();
+        tier->stage(Stage::Respond).record(responded - respond_start);
+        tracing::record(task.trace_id, "respond", respond_start, responded);
+    }
 
-        // Store the result
-        {
-            std::lock_guard<std::mutex> lock(results_mutex_);
-            task_result.request_id = task.request_id;
-            task_result.text = text;
-            task_result.success = success;
-            task_result.error_message = error_message;
-            task_result.completed = true;
+    LOG_DEBUG << "[Server] Worker thread " << thread_id << " exited.";
+}
+
+grpc::ServerUnaryReactor* OCRService::ProcessImage(
+    grpc::CallbackServerContext* context,
+    const ocrservice::OCRRequest* request,
+    ocrservice::OCRResponse* response) {
+
+    int request_id = request->request_id();
+    grpc::ServerUnaryReactor* reactor = context->DefaultReactor();
+    const uint64_t trace_id = tracing::sample();
+    tracing::Span span(trace_id, "ProcessImage", "request_id", request_id);
+
+    LOG_DEBUG << "[Server] ProcessImage called. Request ID: " << request_id
+        << ", Client: " << context->peer()
+        << ", Image size: " << request->image_data().size() << " bytes";
+
+    ImageTask task;
+    task.request_id = request_id;
+    task.trace_id = trace_id;
+    task.deadline = taskDeadline(context);
+    // The context lives until Finish, which only runs once every task of
+    // the call has completed
+    task.cancelled = [context] { return context->IsCancelled(); };
+    // Zero-copy: the task reads the bytes where protobuf parsed them
+    std::string error;
+    const bool valid = setTaskImage(task, *request, &error);
+    const int pages = valid ? pageCount(task, &error) : 1;
+    ArenaRequestAllocator::trackImage(context, task.image_size);
+    task.on_complete = [reactor, response, request_id, pages](const TaskResult& result) {
+        response->set_request_id(request_id);
+        response->set_text(result.text);
+        response->set_success(result.success);
+        response->set_error_message(result.error_message);
+        response->set_page_count(std::max(pages, 1));
+        reactor->Finish(callStatus(result));
+    };
+
+    if (!valid || pages < 0) {
+        TaskResult result;
+        result.error_message = error;
+        task.on_complete(result);
+        return reactor;
+    }
+
+    const AdmissionController::Decision admission = admit(task, pages);
+    if (!admission.accepted) {
+        LOG_DEBUG << "[Server] Shedding request " << request_id << ": estimated wait "
+            << admission.wait_ms << " ms";
+        // Understood by gRPC's own retry policy, if the client has one
+        context->AddTrailingMetadata("grpc-retry-pushback-ms", std::to_string(admission.retry_after_ms));
+        reactor->Finish(grpc::Status(grpc::StatusCode::RESOURCE_EXHAUSTED,
+            "Server is overloaded (estimated wait " + std::to_string(admission.wait_ms)
+            + " ms); retry in " + std::to_string(admission.retry_after_ms) + " ms."));
+        return reactor;
+    }
+
+    if (pages > 1) {
+        LOG_DEBUG << "[Server] Request " << request_id << " is a " << pages << "-page TIFF";
+        auto merge = std::make_shared<PageMerge>(pages);
+        submitPages(task, pages, [merge, done = task.on_complete](int page, const TaskResult& result) {
+            if (merge->add(page, result)) {
+                done(merge->merged());
+            }
+        });
+        return reactor;
+    }
+
+    // Queue the task; the worker that picks it up finishes the reactor
+    submit(std::move(task));
+    return reactor;
+}
 
-            results_[task.request_id] = task_result;
+grpc::ServerUnaryReactor* OCRService::GetStats(
+    grpc::CallbackServerContext* context,
+    const ocrservice::StatsRequest* request,
+    ocrservice::StatsResponse* response) {
 
-            std::cout << "[Server] Thread " << thread_id
-                << " stored result for request ID: " << task.request_id << std::endl;
+    collectStats(request->include_buckets(), response);
+    grpc::ServerUnaryReactor* reactor = context->DefaultReactor();
+    reactor->Finish(grpc::Status::OK);
+    return reactor;
+}
+
+void OCRService::collectStats(bool include_buckets, ocrservice::StatsResponse* stats) const {
+    stats->set_uptime_ms(std::chrono::duration_cast<std::chrono::milliseconds>(TaskClock::now() - started_).count());
+    for (int t = 0; t < kServiceTierCount; ++t) {
+        const Tier& tier = tiers_[t];
+        ocrservice::TierStats* out = stats->add_tiers();
+        out->set_tier(static_cast<ServiceTier>(t) == ServiceTier::Fast ? ocrservice::TIER_FAST : ocrservice::TIER_ACCURATE);
+        out->set_workers(static_cast<int32_t>(tier.workers.size()));
+        out->set_busy_workers(tier.busy_workers.load(std::memory_order_relaxed));
+        out->set_busy_ms(tier.busy_us.load(std::memory_order_relaxed) / 1000);
+
+        const TaskScheduler::Stats scheduler = tier.scheduler->stats();
+        out->set_queue_depth(scheduler.depth);
+        out->set_expired(scheduler.expired);
+        out->set_cancelled(scheduler.cancelled);
+        const EnginePool::Stats engines = tier.engines->stats();
+        out->set_engines_leased(static_cast<int32_t>(engines.leased_engines));
+        out->set_engines_idle(static_cast<int32_t>(engines.idle_engines));
+        const AdmissionController::Stats admission = tier.admission->stats();
+        out->set_accepted(admission.accepted);
+        out->set_shed(admission.shed);
+
+        for (int s = 0; s < kStageCount; ++s) {
+            const LatencyHistogram::Snapshot latency = tier.latency[s].snapshot();
+            ocrservice::StageLatency* stage = out->add_stages();
+            stage->set_stage(stageName(static_cast<Stage>(s)));
+            stage->set_count(latency.count);
+            stage->set_sum_us(latency.sum_us);
+            stage->set_max_us(latency.max_us);
+            stage->set_p50_us(latency.percentile(0.5));
+            stage->set_p90_us(latency.percentile(0.9));
+            stage->set_p99_us(latency.percentile(0.99));
+            stage->set_p999_us(latency.percentile(0.999));
+            if (include_buckets) {
+                for (const LatencyHistogram::Bucket& bucket : latency.buckets) {
+                    ocrservice::LatencyBucket* b = stage->add_buckets();
+                    b->set_lower_us(bucket.lower_us);
+                    b->set_upper_us(bucket.upper_us);
+                    b->set_count(bucket.count);
+                }
+            }
         }
+    }
+}
 
-        // Notify that result is ready
-        results_cv_.notify_all();
+grpc::ServerUnaryReactor* OCRService::DumpTrace(
+    grpc::CallbackServerContext* context,
+    const ocrservice::TraceRequest* request,
+    ocrservice::TraceResponse* response) {
+
+    uint64_t spans = 0;
+    response->set_trace_json(tracing::chromeTraceJson(request->clear(), &spans));
+    response->set_spans(spans);
+    LOG_INFO << "[Server] Trace dump: " << spans << " spans, " << response->trace_json().size() << " bytes";
+    grpc::ServerUnaryReactor* reactor = context->DefaultReactor();
+    reactor->Finish(grpc::Status::OK);
+    return reactor;
+}
+
+void OCRService::statsWriterThread() {
+    std::unique_lock<std::mutex> lock(stats_mutex_);
+    while (!stats_cv_.wait_for(lock, stats_interval_, [this] { return stopping_; })) {
+        lock.unlock();
+        writeStatsFile();
+        lock.lock();
     }
+}
 
-    std::cout << "[Server] Worker thread " << thread_id << " exited." << std::endl;
+void OCRService::writeStatsFile() const {
+    ocrservice::StatsResponse stats;
+    collectStats(true, &stats);
+    if (!writeFileAtomically(stats_file_, prometheusText(stats))) {
+        LOG_WARN << "[Server] Could not write stats to " << stats_file_;
+    }
 }
 
-grpc::Status OCRService::ProcessImage(
-    grpc::ServerContext* context,
-    const ocrservice::OCRRequest* request,
-    ocrservice::OCRResponse* response) {
+bool OCRService::setTaskImage(ImageTask& task, const ocrservice::OCRRequest& request, std::string* error) const {
+    setTaskImageBytes(task, request);
 
-    int request_id = request->request_id();
+    task.tier = request.tier() == ocrservice::TIER_FAST ? ServiceTier::Fast : ServiceTier::Accurate;
+    if (request.has_roi()) {
+        task.roi_x = request.roi().x();
+        task.roi_y = request.roi().y();
+        task.roi_width = request.roi().width();
+        task.roi_height = request.roi().height();
+    }
 
-    std::cout << "[Server] ProcessImage called. Request ID: " << request_id
-        << ", Client: " << context->peer()
-        << ", Image size: " << request->image_data().size() << " bytes" << std::endl;
+    const EnginePool& engines = *tierOf(task).engines;
+    task.language = request.language().empty() ? engines.defaultLanguage() : request.language();
+    if (!EnginePool::isValidLanguage(task.language)) {
+        *error = "Invalid language '" + task.language + "'.";
+        return false;
+    }
+    return true;
+}
+
+std::string OCRService::cacheVariant(const ImageTask& task) const {
+    std::string variant = task.language + "|" + tierOf(task).name;
+    if (task.isRaw()) {
+        // The same bytes mean a different image under another geometry
+        variant += "|raw:" + std::to_string(task.raw_width) + "x" + std::to_string(task.raw_height)
+            + "/" + std::to_string(task.raw_stride);
+    }
+    if (task.page >= 0) {
+        variant += "|page:" + std::to_string(task.page);
+    }
+    if (task.roi_width > 0 && task.roi_height > 0) {
+        variant += "|roi:" + std::to_string(task.roi_x) + "," + std::to_string(task.roi_y)
+            + "+" + std::to_string(task.roi_width) + "x" + std::to_string(task.roi_height);
+    }
+    return variant;
+}
+
+AdmissionController::Decision OCRService::admit(ImageTask& task, int page_count) {
+    int width = 0;
+    int height = 0;
+    if (task.isRaw()) {
+        width = task.raw_width;
+        height = task.raw_height;
+    }
+    else if (!OCRProcessor::readSize(task.image_data, task.image_size, width, height)) {
+        width = height = 0;
+    }
+    if (task.roi_width > 0 && task.roi_height > 0) {
+        width = std::min(width, task.roi_width);
+        height = std::min(height, task.roi_height);
+    }
+    task.pixels = static_cast<uint64_t>(std::max(width, 0)) * static_cast<uint64_t>(std::max(height, 0));
+    return tierOf(task).admission->admit(task.pixels * std::max(page_count, 1), task.deadline);
+}
+
+void OCRService::submit(ImageTask task) {
+    const uint64_t image_hash = cache_.enabled() ? ResultCache::hashImage(task.image_data, task.image_size) : 0;
+    submit(std::move(task), image_hash);
+}
+
+void OCRService::submit(ImageTask task, uint64_t image_hash) {
+    task.task_id = next_task_id_.fetch_add(1, std::memory_order_relaxed);
+    tracing::Span span(task.trace_id, "enqueue", "task", static_cast<int64_t>(task.task_id));
+
+    // Every path below ends in on_complete exactly once
+    task.on_complete = [tier = &tierOf(task), pixels = task.pixels, submitted = TaskClock::now(),
+        trace_id = task.trace_id, task_id = task.task_id,
+        done = std::move(task.on_complete)](const TaskResult& result) {
+        if (pixels > 0) {
+            tier->admission->release(pixels);
+        }
+        done(result);
+        const auto now = TaskClock::now();
+        tier->stage(Stage::Total).record(now - submitted);
+        // The task's whole life, across threads, on a track of its own
+        tracing::recordAsync(trace_id, task_id, "task", submitted, now);
+    };
+
+    if (cache_.enabled()) {
+        ResultCache::Key key = ResultCache::makeKey(image_hash, task.image_size, cacheVariant(task));
+        TaskResult cached;
+        switch (cache_.acquire(key, task, cached)) {
+        case ResultCache::Lookup::Hit:
+            LOG_DEBUG << "[Server] Cache hit for task " << task.task_id;
+            task.on_complete(cached);
+            return;
+        case ResultCache::Lookup::Joined:
+            LOG_DEBUG << "[Server] Task " << task.task_id << " joined an identical in-flight image";
+            return;
+        case ResultCache::Lookup::Miss:
+            // The cache now holds our callback and fans the result out to
+            // everyone who joined in the meantime
+            task.on_complete = [this, key](const TaskResult& result) { completeCached(key, result); };
+            break;
+        }
+    }
+
+    enqueue(std::move(task));
+}
+
+void OCRService::enqueue(ImageTask task) {
+    Tier& tier = tierOf(task);
+    task.queued = TaskClock::now();
+    tier.scheduler->push(std::move(task));
+    LOG_DEBUG << "[Server] Task queued (" << tier.name << "). Queue size: " << tier.scheduler->stats().depth;
+}
+
+void OCRService::completeCached(const ResultCache::Key& key, const TaskResult& result) {
+    ImageTask successor;
+    if (!cache_.complete(key, result, successor)) {
+        return;
+    }
+    LOG_DEBUG << "[Server] Task " << successor.task_id << " takes over an abandoned identical image";
+    successor.on_complete = [this, key](const TaskResult& next) { completeCached(key, next); };
+    enqueue(std::move(successor));
+}
+
+int OCRService::pageCount(const ImageTask& task, std::string* error) {
+    if (task.isRaw()) {
+        return 1;
+    }
+    const int pages = OCRProcessor::countPages(task.image_data, task.image_size);
+    if (pages > kMaxPages) {
+        *error = "TIFF has " + std::to_string(pages) + " pages; at most "
+            + std::to_string(kMaxPages) + " are accepted per request.";
+        return -1;
+    }
+    return pages;
+}
+
+void OCRService::submitPages(const ImageTask& task, int page_count, PageCallback on_page) {
+    auto shared_on_page = std::make_shared<PageCallback>(std::move(on_page));
+    // Once for the whole document; the page number is in each key's variant
+    const uint64_t image_hash = cache_.enabled() ? ResultCache::hashImage(task.image_data, task.image_size) : 0;
+    for (int page = 0; page < page_count; ++page) {
+        // Copies the pointers and the owner reference, never the bytes
+        ImageTask page_task = task;
+        page_task.page = page;
+        page_task.on_complete = [shared_on_page, page](const TaskResult& result) {
+            (*shared_on_page)(page, result);
+        };
+        submit(std::move(page_task), image_hash);
+    }
+}
+
+// One reactor per ProcessImageStream call. Every request read becomes its own
+// task; results are written back in the order the workers finish them. The
+// call is finished once the client has half-closed and every task has been
+// answered, so tasks can never outlive the reactor.
+class OCRService::StreamReactor final
+    : public grpc::ServerBidiReactor<ocrservice::OCRRequest, ocrservice::OCRResponse> {
+public:
+    StreamReactor(OCRService* service, grpc::CallbackServerContext* context)
+        : service_(service), context_(context), peer_(context->peer()), deadline_(taskDeadline(context)) {
+        LOG_DEBUG << "[Server] ProcessImageStream opened. Client: " << peer_;
+        startNextRead();
+    }
+
+    void OnReadDone(bool ok) override {
+        if (!ok) {
+            // Client half-closed (or the call broke); no more requests
+            bool finish = false;
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                reads_done_ = true;
+                finish = shouldFinishLocked();
+            }
+            LOG_DEBUG << "[Server] Stream from " << peer_ << " done reading after "
+                << received_ << " images";
+            if (finish) {
+                Finish(grpc::Status::OK);
+            }
+            return;
+        }
+
+        // The task takes ownership of the message it reads its bytes from
+        std::shared_ptr<ocrservice::OCRRequest> request = std::move(next_request_);
+        int request_id = request->request_id();
+        ++received_;
 
-    // Queue the task
-    {
-        std::lock_guard<std::mutex> lock(queue_mutex_);
+        LOG_DEBUG << "[Server] Stream request received. Request ID: " << request_id
+            << ", Image size: " << request->image_data().size() << " bytes";
+
+        const uint64_t trace_id = tracing::sample();
+        tracing::Span span(trace_id, "ProcessImageStream.request", "request_id", request_id);
 
         ImageTask task;
         task.request_id = request_id;
-        task.image_data.assign(request->image_data().begin(), request->image_data().end());
+        task.trace_id = trace_id;
+        // Nobody is left to read a result once the call's deadline passes
+        // or it is cancelled
+        task.deadline = deadline_;
+        task.cancelled = [context = context_] { return context->IsCancelled(); };
+        std::string error;
+        const bool valid = service_->setTaskImage(task, *request, &error);
+        const int pages = valid ? pageCount(task, &error) : 1;
+        task.owner = request;
+        if (request->report_progress()) {
+            task.on_progress = [this, request_id, pages](int page, int percent) {
+                sendProgress(request_id, page, std::max(pages, 1), percent);
+            };
+        }
+
+        const AdmissionController::Decision admission = valid && pages >= 0
+            ? service_->admit(task, pages) : AdmissionController::Decision();
 
-        task_queue_.push(std::move(task));
+        if (!valid || pages < 0) {
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                ++pending_;
+            }
+            TaskResult result;
+            result.error_message = error;
+            sendResult(request_id, 0, 1, result);
+        }
+        else if (!admission.accepted) {
+            LOG_DEBUG << "[Server] Shedding stream request " << request_id << ": estimated wait "
+                << admission.wait_ms << " ms";
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                ++pending_;
+            }
+            // Answered as a whole, even if it is a multi-page TIFF
+            ocrservice::OCRResponse response;
+            response.set_request_id(request_id);
+            response.set_success(false);
+            response.set_error_message("Server is overloaded (estimated wait "
+                + std::to_string(admission.wait_ms) + " ms); retry in "
+                + std::to_string(admission.retry_after_ms) + " ms.");
+            response.set_page_count(1);
+            response.set_retry_after_ms(static_cast<int32_t>(admission.retry_after_ms));
+            onResult(std::move(response));
+        }
+        else if (pages > 1) {
+            // One response per page, written as each page finishes
+            LOG_DEBUG << "[Server] Stream request " << request_id << " is a " << pages << "-page TIFF";
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                pending_ += pages;
+            }
+            service_->submitPages(task, pages, [this, request_id, pages](int page, const TaskResult& result) {
+                sendResult(request_id, page, pages, result);
+            });
+        }
+        else {
+            task.on_complete = [this, request_id](const TaskResult& result) {
+                sendResult(request_id, 0, 1, result);
+            };
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                ++pending_;
+            }
+            service_->submit(std::move(task));
+        }
 
-        std::cout << "[Server] Task queued. Queue size: " << task_queue_.size() << std::endl;
+        startNextRead();
     }
-    queue_cv_.notify_one();
 
-    // Wait for the result
-    std::cout << "[Server] Waiting for result of request ID: " << request_id << std::endl;
+    void OnWriteDone(bool ok) override {
+        const ocrservice::OCRResponse* next = nullptr;
+        bool finish = false;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            write_queue_.pop_front();
+            --pending_;
+            if (!ok) {
+                // Client is gone: drop whatever else is queued
+                write_failed_ = true;
+                pending_ -= static_cast<int>(write_queue_.size());
+                write_queue_.clear();
+            }
+            if (!write_queue_.empty()) {
+                next = &write_queue_.front();
+            }
+            else {
+                writing_ = false;
+                finish = shouldFinishLocked();
+            }
+        }
+        if (next) {
+            StartWrite(next);
+        }
+        else if (finish) {
+            Finish(grpc::Status::OK);
+        }
+    }
 
-    {
-        std::unique_lock<std::mutex> lock(results_mutex_);
-        results_cv_.wait(lock, [this, request_id]() {
-            return results_.find(request_id) != results_.end() && results_[request_id].completed;
-            });
+    void OnDone() override {
+        LOG_DEBUG << "[Server] ProcessImageStream closed. Client: " << peer_;
+        delete this;
+    }
 
-        // Get the result
-        const TaskResult& result = results_[request_id];
+private:
+    void startNextRead() {
+        next_request_ = std::make_shared<ocrservice::OCRRequest>();
+        StartRead(next_request_.get());
+    }
 
-        response->set_request_id(result.request_id);
-        response->set_text(result.text);
-        response->set_success(result.success);
-        response->set_error_message(result.error_message);
+    void sendResult(int request_id, int page, int page_count, const TaskResult& result) {
+        ocrservice::OCRResponse response;
+        response.set_request_id(request_id);
+        response.set_text(result.text);
+        response.set_success(result.success);
+        response.set_error_message(result.error_message);
+        response.set_page(page);
+        response.set_page_count(page_count);
+        onResult(std::move(response));
+    }
 
-        std::cout << "[Server] Response prepared for Request ID: " << request_id
-            << ", Success: " << result.success
-            << ", Text length: " << result.text.length() << std::endl;
+    // Best effort: dropped while earlier responses are still waiting to be
+    // written, so a slow client never has progress pile up in front of
+    // results. Counted in pending_ like a result; the task it is for keeps
+    // the call open until after this is queued.
+    void sendProgress(int request_id, int page, int page_count, int percent) {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (write_failed_ || !write_queue_.empty()) {
+                return;
+            }
+            ++pending_;
+        }
+        ocrservice::OCRResponse response;
+        response.set_request_id(request_id);
+        response.set_page(page);
+        response.set_page_count(page_count);
+        response.mutable_progress()->set_percent(percent);
+        onResult(std::move(response));
+    }
 
-        // Clean up the result
-        results_.erase(request_id);
+    // Runs on the worker thread that finished the task.
+    void onResult(ocrservice::OCRResponse response) {
+        const ocrservice::OCRResponse* to_write = nullptr;
+        bool finish = false;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (write_failed_) {
+                --pending_;
+                finish = shouldFinishLocked();
+            }
+            else {
+                // Only one write may be outstanding; deque keeps addresses stable
+                write_queue_.push_back(std::move(response));
+                if (!writing_) {
+                    writing_ = true;
+                    to_write = &write_queue_.front();
+                }
+            }
+        }
+        if (to_write) {
+            StartWrite(to_write);
+        }
+        else if (finish) {
+            Finish(grpc::Status::OK);
+        }
     }
 
-    std::cout << "[Server] Response sent for Request ID: " << request_id << std::endl;
+    bool shouldFinishLocked() {
+        if (finished_ || !reads_done_ || pending_ > 0 || writing_) {
+            return false;
+        }
+        finished_ = true;
+        return true;
+    }
 
-    return grpc::Status::OK;
+    OCRService* service_;
+    grpc::CallbackServerContext* context_;
+    std::string peer_;
+    TaskClock::time_point deadline_;
+    std::shared_ptr<ocrservice::OCRRequest> next_request_;  // reader-side only
+    int received_ = 0;                                       // reader-side only
+
+    std::mutex mutex_;
+    std::deque<ocrservice::OCRResponse> write_queue_;
+    int pending_ = 0;   // tasks submitted but not yet written or dropped
+    bool reads_done_ = false;
+    bool writing_ = false;
+    bool write_failed_ = false;
+    bool finished_ = false;
+};
+
+grpc::ServerBidiReactor<ocrservice::OCRRequest, ocrservice::OCRResponse>* OCRService::ProcessImageStream(
+    grpc::CallbackServerContext* context) {
+    return new StreamReactor(this, context);
 }
\ No newline at end of file
@@ -1,51 +1,171 @@
 #pragma once
 
 #include "ocr_service.grpc.pb.h"
-#include "ocr_processor.h"
+#include "admission.h"
+#include "engine_pool.h"
+#include "metrics.h"
+#include "region_pool.h"
+#include "ocr_task.h"
+#include "request_allocator.h"
+#include "result_cache.h"
+#include "retry_queue.h"
+#include "task_scheduler.h"
 #include <grpcpp/grpcpp.h>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
 #include <memory>
+#include <mutex>
+#include <string>
 #include <vector>
 #include <thread>
-#include <queue>
-#include <map>
-#include <condition_variable>
-#include <mutex>
 
-class OCRService final : public ocrservice::OCRService::Service {
+// Workers and engines of one service tier.
+struct TierOptions {
+    int n_threads = 4;
+    EnginePool::Options engines;    // engines_per_language is set to n_threads
+    AdmissionController::Options admission;
+
+    // Point engines.engine.datapath at tessdata_best for this one...
+    static TierOptions accurate() {
+        TierOptions tier;
+        tier.engines.engine.psm = tesseract::PSM_AUTO;
+        return tier;
+    }
+    // ...and at tessdata_fast for this one.
+    static TierOptions fast() {
+        TierOptions tier;
+        tier.n_threads = 2;
+        tier.engines.engine.oem = tesseract::OEM_LSTM_ONLY;
+        tier.engines.engine.psm = tesseract::PSM_SINGLE_BLOCK;
+        // Interactive callers would rather be told to retry than wait
+        tier.admission.max_wait_ms = 1000;
+        return tier;
+    }
+};
+
+struct ServiceOptions {
+    TierOptions accurate = TierOptions::accurate();
+    TierOptions fast = TierOptions::fast();
+    TaskScheduler::Kind scheduler_kind = TaskScheduler::Kind::WorkStealing;
+    ResultCache::Options cache;
+    // Accurate-tier pages with at least this many pixels are split into text
+    // blocks that are OCR'd on otherwise idle engines. 0 disables splitting.
+    uint64_t split_min_pixels = 16'000'000;
+    // GetStats in Prometheus text format is written here every
+    // stats_interval_ms, and once more on shutdown. Empty: not written.
+    std::string stats_file;
+    int64_t stats_interval_ms = 15000;
+};
+
+// Callback-API service: the handlers only queue tasks and return a reactor,
+// and the worker that finishes a task completes (or writes to) the RPC
+// itself. No gRPC thread is held while a request waits for or runs OCR.
+class OCRService final : public ocrservice::OCRService::CallbackService {
 public:
-    OCRService(int n_threads = 4);
+    explicit OCRService(const ServiceOptions& options = ServiceOptions());
     ~OCRService();
 
-    grpc::Status ProcessImage(
-        grpc::ServerContext* context,
+    grpc::ServerUnaryReactor* ProcessImage(
+        grpc::CallbackServerContext* context,
         const ocrservice::OCRRequest* request,
         ocrservice::OCRResponse* response) override;
 
+    grpc::ServerBidiReactor<ocrservice::OCRRequest, ocrservice::OCRResponse>* ProcessImageStream(
+        grpc::CallbackServerContext* context) override;
+
+    grpc::ServerUnaryReactor* GetStats(
+        grpc::CallbackServerContext* context,
+        const ocrservice::StatsRequest* request,
+        ocrservice::StatsResponse* response) override;
+
+    grpc::ServerUnaryReactor* DumpTrace(
+        grpc::CallbackServerContext* context,
+        const ocrservice::TraceRequest* request,
+        ocrservice::TraceResponse* response) override;
+
+    // What GetStats answers.
+    void collectStats(bool include_buckets, ocrservice::StatsResponse* stats) const;
+
+    TaskScheduler::Stats schedulerStats(ServiceTier tier) const { return tiers_[static_cast<int>(tier)].scheduler->stats(); }
+    ResultCache::Stats cacheStats() const { return cache_.stats(); }
+    EnginePool::Stats engineStats(ServiceTier tier) const { return tiers_[static_cast<int>(tier)].engines->stats(); }
+    AdmissionController::Stats admissionStats(ServiceTier tier) const { return tiers_[static_cast<int>(tier)].admission->stats(); }
+
 private:
-    struct ImageTask {
-        int request_id;
-        std::vector<unsigned char> image_data;
-    };
+    class StreamReactor;
+
+    // Everything one tier owns. Tiers share only the result cache, so a
+    // backlog in one never delays the other.
+    struct Tier {
+        const char* name = "";
+        std::unique_ptr<TaskScheduler> scheduler;
+        std::unique_ptr<EnginePool> engines;
+        std::unique_ptr<RegionPool> regions;    // null: no page splitting
+        std::unique_ptr<AdmissionController> admission;
+        std::vector<std::thread> workers;
+
+        std::array<LatencyHistogram, kStageCount> latency;
+        std::atomic<int> busy_workers{ 0 };
+        std::atomic<int64_t> busy_us{ 0 };
 
-    struct TaskResult {
-        int request_id;
-        std::string text;
-        bool success;
-        std::string error_message;
-        bool completed = false;
+        LatencyHistogram& stage(Stage stage) { return latency[static_cast<int>(stage)]; }
     };
 
-    void workerThread(int thread_id);
+    Tier& tierOf(const ImageTask& task) { return tiers_[static_cast<int>(task.tier)]; }
+    const Tier& tierOf(const ImageTask& task) const { return tiers_[static_cast<int>(task.tier)]; }
+
+    // Points the task at the request's image (raw pixels if present,
+    // otherwise the encoded file bytes) and picks its tier, language and
+    // region of interest. Returns false, with an error in *error, if the
+    // language name is invalid.
+    bool setTaskImage(ImageTask& task, const ocrservice::OCRRequest& request, std::string* error) const;
+    // Everything besides the image bytes that changes the OCR output.
+    std::string cacheVariant(const ImageTask& task) const;
+
+    // Sets task.pixels and asks the task's tier whether all its pages can be
+    // taken on. Accepted pixels are released again as each page completes.
+    AdmissionController::Decision admit(ImageTask& task, int page_count);
+
+    // Assigns a task id and hands the task to the scheduler, unless the
+    // result cache can answer it or an identical image is already queued.
+    void submit(ImageTask task);
+    // image_hash: ResultCache::hashImage of the task's bytes, when the
+    // caller already has it; unused with the cache off.
+    void submit(ImageTask task, uint64_t image_hash);
+    void enqueue(ImageTask task);
+    // Completes a cache leader; runs a parked task in its place if the
+    // result was abandoned.
+    void completeCached(const ResultCache::Key& key, const TaskResult& result);
+
+    // Pages in the task's image (1 unless it is a multi-page TIFF), or -1
+    // with an error in *error if there are more than kMaxPages.
+    static int pageCount(const ImageTask& task, std::string* error);
+    // Submits one task per page of a multi-page TIFF, all reading the same
+    // bytes. on_page runs once per page, on the worker that finished it.
+    using PageCallback = std::function<void(int page, const TaskResult& result)>;
+    void submitPages(const ImageTask& task, int page_count, PageCallback on_page);
 
-    std::vector<std::thread> workers_;
-    std::queue<ImageTask> task_queue_;
-    std::mutex queue_mutex_;
-    std::condition_variable queue_cv_;
+    static constexpr int kMaxPages = 10000;
+    void workerThread(Tier* tier, int thread_id);
+    void statsWriterThread();
+    void writeStatsFile() const;
 
-    std::map<int, TaskResult> results_;
-    std::mutex results_mutex_;
-    std::condition_variable results_cv_;
+    ArenaRequestAllocator request_allocator_;
+    ResultCache cache_;
+    std::atomic<uint64_t> next_task_id_;
+    uint64_t split_min_pixels_;
+    std::array<Tier, kServiceTierCount> tiers_;
+    RetryQueue retries_;
+    const TaskClock::time_point started_;
 
-    bool shutdown_;
-    std::vector<std::unique_ptr<OCRProcessor>> processors_;
+    std::string stats_file_;
+    std::chrono::milliseconds stats_interval_;
+    std::mutex stats_mutex_;
+    std::condition_variable stats_cv_;
+    bool stopping_ = false;
+    std::thread stats_writer_;
 };
\ No newline at end of file
@@ -0,0 +1,100 @@
+#pragma once
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+
+// Which queue, workers and engine pool a task goes to.
+enum class ServiceTier {
+    Accurate,   // best models, full layout analysis; batch work
+    Fast,       // fast models, one text block; interactive requests
+};
+constexpr int kServiceTierCount = 2;
+
+struct TaskResult {
+    std::string text;
+    bool success = false;
+    std::string error_message;
+
+    // Set when the task was given up on for reasons other than the image.
+    // Answered with the matching gRPC status rather than as an OCR failure,
+    // so clients know to try again. After Deadline or Cancelled another
+    // caller of the same image may still get an answer.
+    enum class Abandoned {
+        No,
+        Deadline,   // the caller's deadline passed
+        Cancelled,  // the caller went away
+        Shutdown,   // the server stopped first
+    };
+    Abandoned abandoned = Abandoned::No;
+};
+
+using TaskClock = std::chrono::steady_clock;
+
+// Invoked exactly once, normally on the worker thread that ran the task.
+using CompletionCallback = std::function<void(const TaskResult&)>;
+// Invoked from inside recognition with its progress, 0-100. page is the
+// task's page, 0 unless it is part of a multi-page TIFF.
+using ProgressCallback = std::function<void(int page, int percent)>;
+
+struct ImageTask {
+    uint64_t task_id = 0;   // server-generated, unique per process
+    int request_id = 0;     // client-supplied, echoed back only
+
+    // Points into the parsed request message, which stays alive until
+    // on_complete has run: gRPC owns it for unary calls, `owner` does for
+    // streamed ones. Never copied.
+    const unsigned char* image_data = nullptr;
+    size_t image_size = 0;
+    std::shared_ptr<const void> owner;
+    std::string format;     // client's format hint, may be empty
+    std::string language;   // Tesseract language, already validated
+    ServiceTier tier = ServiceTier::Accurate;
+
+    // Set when image_data holds raw 8-bit gray pixels instead of a file.
+    int raw_width = 0;
+    int raw_height = 0;
+    int raw_stride = 0;
+
+    bool isRaw() const { return raw_width > 0; }
+
+    // Region of interest; zero width or height means the whole image.
+    int roi_x = 0;
+    int roi_y = 0;
+    int roi_width = 0;
+    int roi_height = 0;
+
+    // Set when image_data is a multi-page TIFF and this task is one of its
+    // pages (0-based); each page is a task of its own.
+    int page = -1;
+
+    // Pixels to recognize (one page, clipped to the roi), as read from the
+    // image header at admission. 0 if the header could not be read.
+    uint64_t pixels = 0;
+
+    // Earlier attempts that failed transiently.
+    int attempt = 0;
+
+    // When the task was last pushed to a scheduler (or parked for a retry),
+    // for queue wait stats.
+    TaskClock::time_point queued;
+
+    // From tracing::sample() when the request arrived; 0 if not traced.
+    uint64_t trace_id = 0;
+
+    // The caller's gRPC deadline. Tasks are scheduled earliest deadline
+    // first, and one that is still queued when it passes is never started.
+    TaskClock::time_point deadline = TaskClock::time_point::max();
+
+    bool expired(TaskClock::time_point now) const { return now >= deadline; }
+
+    // Tells whether the caller has gone away; polled while the task waits
+    // and while it is being recognized. Optional.
+    std::function<bool()> cancelled;
+    ProgressCallback on_progress;   // optional
+
+    CompletionCallback on_complete;
+};
@@ -0,0 +1,385 @@
+#include "preprocess.h"
+#include <leptonica/allheaders.h>
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define PREPROCESS_X86 1
+#include <immintrin.h>
+#if defined(_MSC_VER) && !defined(__clang__)
+#include <intrin.h>
+// MSVC accepts any intrinsic in any function; the dispatcher is what keeps
+// AVX2 code off CPUs without it.
+#define PREPROCESS_TARGET(isa)
+#else
+#define PREPROCESS_TARGET(isa) __attribute__((target(isa)))
+#endif
+#endif
+
+namespace preprocess {
+
+namespace {
+
+// out[i] = op(a[i], b[i], c[i]). The only primitive the morphology needs:
+// the horizontal pass calls it on (row - 1, row, row + 1), the vertical pass
+// on three rows of the ring.
+using Row3Fn = void (*)(const unsigned char* a, const unsigned char* b, const unsigned char* c,
+    unsigned char* out, size_t n);
+using GrayFn = void (*)(const uint32_t* src, unsigned char* dst, size_t n);
+
+struct Kernels {
+    Row3Fn min3;
+    Row3Fn max3;
+    GrayFn rgbToGray;
+};
+
+inline unsigned char luminance(uint32_t word) {
+    const uint32_t r = word >> 24;
+    const uint32_t g = (word >> 16) & 0xff;
+    const uint32_t b = (word >> 8) & 0xff;
+    return static_cast<unsigned char>((77 * r + 128 * g + 51 * b + 128) >> 8);
+}
+
+void min3Scalar(const unsigned char* a, const unsigned char* b, const unsigned char* c,
+    unsigned char* out, size_t n) {
+    for (size_t i = 0; i < n; ++i) {
+        out[i] = std::min(std::min(a[i], b[i]), c[i]);
+    }
+}
+
+void max3Scalar(const unsigned char* a, const unsigned char* b, const unsigned char* c,
+    unsigned char* out, size_t n) {
+    for (size_t i = 0; i < n; ++i) {
+        out[i] = std::max(std::max(a[i], b[i]), c[i]);
+    }
+}
+
+void rgbToGrayScalar(const uint32_t* src, unsigned char* dst, size_t n) {
+    for (size_t i = 0; i < n; ++i) {
+        dst[i] = luminance(src[i]);
+    }
+}
+
+#ifdef PREPROCESS_X86
+
+PREPROCESS_TARGET("sse4.1")
+void min3Sse41(const unsigned char* a, const unsigned char* b, const unsigned char* c,
+    unsigned char* out, size_t n) {
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        const __m128i va = _mm_loadu_si128(reinterpret_cast<const __m128i*>(a + i));
+        const __m128i vb = _mm_loadu_si128(reinterpret_cast<const __m128i*>(b + i));
+        const __m128i vc = _mm_loadu_si128(reinterpret_cast<const __m128i*>(c + i));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(out + i), _mm_min_epu8(_mm_min_epu8(va, vb), vc));
+    }
+    min3Scalar(a + i, b + i, c + i, out + i, n - i);
+}
+
+PREPROCESS_TARGET("sse4.1")
+void max3Sse41(const unsigned char* a, const unsigned char* b, const unsigned char* c,
+    unsigned char* out, size_t n) {
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        const __m128i va = _mm_loadu_si128(reinterpret_cast<const __m128i*>(a + i));
+        const __m128i vb = _mm_loadu_si128(reinterpret_cast<const __m128i*>(b + i));
+        const __m128i vc = _mm_loadu_si128(reinterpret_cast<const __m128i*>(c + i));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(out + i), _mm_max_epu8(_mm_max_epu8(va, vb), vc));
+    }
+    max3Scalar(a + i, b + i, c + i, out + i, n - i);
+}
+
+// Four pixels per 32-bit lane. Every channel is < 256 and the weights sum to
+// 256, so the weighted sum fits the low 16 bits of each lane and 16-bit
+// multiplies are enough.
+PREPROCESS_TARGET("sse4.1")
+inline __m128i luminance4(__m128i words) {
+    const __m128i mask = _mm_set1_epi32(0xff);
+    const __m128i r = _mm_srli_epi32(words, 24);
+    const __m128i g = _mm_and_si128(_mm_srli_epi32(words, 16), mask);
+    const __m128i b = _mm_and_si128(_mm_srli_epi32(words, 8), mask);
+    __m128i sum = _mm_mullo_epi16(r, _mm_set1_epi32(77));
+    sum = _mm_add_epi16(sum, _mm_slli_epi32(g, 7));
+    sum = _mm_add_epi16(sum, _mm_mullo_epi16(b, _mm_set1_epi32(51)));
+    sum = _mm_add_epi16(sum, _mm_set1_epi32(128));
+    return _mm_srli_epi32(sum, 8);
+}
+
+PREPROCESS_TARGET("sse4.1")
+void rgbToGraySse41(const uint32_t* src, unsigned char* dst, size_t n) {
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        const __m128i* p = reinterpret_cast<const __m128i*>(src + i);
+        const __m128i l0 = luminance4(_mm_loadu_si128(p));
+        const __m128i l1 = luminance4(_mm_loadu_si128(p + 1));
+        const __m128i l2 = luminance4(_mm_loadu_si128(p + 2));
+        const __m128i l3 = luminance4(_mm_loadu_si128(p + 3));
+        const __m128i packed = _mm_packus_epi16(_mm_packus_epi32(l0, l1), _mm_packus_epi32(l2, l3));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i), packed);
+    }
+    rgbToGrayScalar(src + i, dst + i, n - i);
+}
+
+PREPROCESS_TARGET("avx2")
+void min3Avx2(const unsigned char* a, const unsigned char* b, const unsigned char* c,
+    unsigned char* out, size_t n) {
+    size_t i = 0;
+    for (; i + 32 <= n; i += 32) {
+        const __m256i va = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(a + i));
+        const __m256i vb = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(b + i));
+        const __m256i vc = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(c + i));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(out + i), _mm256_min_epu8(_mm256_min_epu8(va, vb), vc));
+    }
+    min3Sse41(a + i, b + i, c + i, out + i, n - i);
+}
+
+PREPROCESS_TARGET("avx2")
+void max3Avx2(const unsigned char* a, const unsigned char* b, const unsigned char* c,
+    unsigned char* out, size_t n) {
+    size_t i = 0;
+    for (; i + 32 <= n; i += 32) {
+        const __m256i va = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(a + i));
+        const __m256i vb = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(b + i));
+        const __m256i vc = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(c + i));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(out + i), _mm256_max_epu8(_mm256_max_epu8(va, vb), vc));
+    }
+    max3Sse41(a + i, b + i, c + i, out + i, n - i);
+}
+
+PREPROCESS_TARGET("avx2")
+inline __m256i luminance8(__m256i words) {
+    const __m256i mask = _mm256_set1_epi32(0xff);
+    const __m256i r = _mm256_srli_epi32(words, 24);
+    const __m256i g = _mm256_and_si256(_mm256_srli_epi32(words, 16), mask);
+    const __m256i b = _mm256_and_si256(_mm256_srli_epi32(words, 8), mask);
+    __m256i sum = _mm256_mullo_epi16(r, _mm256_set1_epi32(77));
+    sum = _mm256_add_epi16(sum, _mm256_slli_epi32(g, 7));
+    sum = _mm256_add_epi16(sum, _mm256_mullo_epi16(b, _mm256_set1_epi32(51)));
+    sum = _mm256_add_epi16(sum, _mm256_set1_epi32(128));
+    return _mm256_srli_epi32(sum, 8);
+}
+
+PREPROCESS_TARGET("avx2")
+void rgbToGrayAvx2(const uint32_t* src, unsigned char* dst, size_t n) {
+    // The packs work within 128-bit halves, leaving groups of four pixels in
+    // the order 0 2 4 6 1 3 5 7; one cross-lane permute restores it.
+    const __m256i order = _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7);
+    size_t i = 0;
+    for (; i + 32 <= n; i += 32) {
+        const __m256i* p = reinterpret_cast<const __m256i*>(src + i);
+        const __m256i l0 = luminance8(_mm256_loadu_si256(p));
+        const __m256i l1 = luminance8(_mm256_loadu_si256(p + 1));
+        const __m256i l2 = luminance8(_mm256_loadu_si256(p + 2));
+        const __m256i l3 = luminance8(_mm256_loadu_si256(p + 3));
+        const __m256i packed = _mm256_packus_epi16(_mm256_packus_epi32(l0, l1), _mm256_packus_epi32(l2, l3));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(dst + i), _mm256_permutevar8x32_epi32(packed, order));
+    }
+    rgbToGraySse41(src + i, dst + i, n - i);
+}
+
+#endif // PREPROCESS_X86
+
+const Kernels kKernels[] = {
+    { min3Scalar, max3Scalar, rgbToGrayScalar },
+#ifdef PREPROCESS_X86
+    { min3Sse41, max3Sse41, rgbToGraySse41 },
+    { min3Avx2, max3Avx2, rgbToGrayAvx2 },
+#endif
+};
+
+std::atomic<Isa>& isaSelection() {
+    static std::atomic<Isa> isa{ detectIsa() };
+    return isa;
+}
+
+const Kernels& kernels() {
+    return kKernels[static_cast<int>(isaSelection().load(std::memory_order_relaxed))];
+}
+
+// Horizontal 3-tap pass over one row; the edge pixels only have one
+// neighbour, which is what ignoring out-of-image pixels amounts to.
+void filterRow(Row3Fn op, const unsigned char* src, unsigned char* dst, int width) {
+    if (width == 1) {
+        dst[0] = src[0];
+        return;
+    }
+    op(src, src, src + 1, dst, 1);
+    if (width > 2) {
+        op(src, src + 1, src + 2, dst + 1, width - 2);
+    }
+    op(src + width - 2, src + width - 1, src + width - 1, dst + width - 1, 1);
+}
+
+// Separable 3x3 min or max, written back into image. Row y of the output
+// needs the horizontally filtered rows y-1..y+1; those are kept in a ring of
+// three, and row y+1 is filtered before row y is overwritten, so the source
+// is never read after it has been replaced.
+void filter3x3(Row3Fn op, GrayImage& image, Workspace& workspace) {
+    const int width = image.width;
+    const int height = image.height;
+    if (width <= 0 || height <= 0) {
+        return;
+    }
+    const size_t stride = static_cast<size_t>(image.stride);
+    unsigned char* ring = workspace.rows(stride * 3);
+    auto slot = [&](int y) { return ring + static_cast<size_t>(y % 3) * stride; };
+    auto row = [&](int y) { return image.data + static_cast<size_t>(y) * stride; };
+
+    filterRow(op, row(0), slot(0), width);
+    for (int y = 0; y < height; ++y) {
+        if (y + 1 < height) {
+            filterRow(op, row(y + 1), slot(y + 1), width);
+        }
+        const unsigned char* up = slot(std::max(y - 1, 0));
+        const unsigned char* down = slot(std::min(y + 1, height - 1));
+        op(up, slot(y), down, row(y), width);
+    }
+}
+
+} // namespace
+
+Isa detectIsa() {
+#ifdef PREPROCESS_X86
+#if defined(_MSC_VER) && !defined(__clang__)
+    int info[4];
+    __cpuid(info, 0);
+    const int max_leaf = info[0];
+    __cpuid(info, 1);
+    const bool sse41 = (info[2] & (1 << 19)) != 0;
+    // AVX state must also be enabled by the OS (OSXSAVE + XCR0 bits 1-2).
+    const bool os_avx = (info[2] & (1 << 27)) && (info[2] & (1 << 28)) && (_xgetbv(0) & 6) == 6;
+    bool avx2 = false;
+    if (os_avx && max_leaf >= 7) {
+        __cpuidex(info, 7, 0);
+        avx2 = (info[1] & (1 << 5)) != 0;
+    }
+#else
+    __builtin_cpu_init();
+    const bool sse41 = __builtin_cpu_supports("sse4.1");
+    const bool avx2 = __builtin_cpu_supports("avx2");
+#endif
+    if (avx2) {
+        return Isa::AVX2;
+    }
+    if (sse41) {
+        return Isa::SSE41;
+    }
+#endif
+    return Isa::Scalar;
+}
+
+Isa activeIsa() {
+    return isaSelection().load(std::memory_order_relaxed);
+}
+
+void setIsa(Isa isa) {
+    isaSelection().store(std::min(isa, detectIsa()), std::memory_order_relaxed);
+}
+
+const char* isaName(Isa isa) {
+    switch (isa) {
+    case Isa::AVX2:
+        return "avx2";
+    case Isa::SSE41:
+        return "sse4.1";
+    default:
+        return "scalar";
+    }
+}
+
+GrayImage Workspace::gray(int width, int height) {
+    GrayImage image;
+    image.width = width;
+    image.height = height;
+    // Rows padded to a multiple of the AVX2 vector width.
+    image.stride = (width + 31) & ~31;
+    const size_t bytes = static_cast<size_t>(image.stride) * height;
+    if (gray_.size() < bytes) {
+        gray_.resize(bytes);
+    }
+    image.data = gray_.data();
+    return image;
+}
+
+unsigned char* Workspace::rows(size_t bytes) {
+    if (rows_.size() < bytes) {
+        rows_.resize(bytes);
+    }
+    return rows_.data();
+}
+
+void rgbToGray(const uint32_t* src, int src_wpl, int width, int height, GrayImage& dst) {
+    const GrayFn convert = kernels().rgbToGray;
+    for (int y = 0; y < height; ++y) {
+        convert(src + static_cast<size_t>(y) * src_wpl, dst.data + static_cast<size_t>(y) * dst.stride, width);
+    }
+}
+
+void unpackGray(const uint32_t* src, int src_wpl, int width, int height, GrayImage& dst) {
+    // Leptonica keeps pixel 0 in the most significant byte of each word
+    // whatever the host byte order. Plain shifts compile to a byte swap (or
+    // a copy on big-endian) and vectorize without help.
+    const int words = width / 4;
+    for (int y = 0; y < height; ++y) {
+        const uint32_t* in = src + static_cast<size_t>(y) * src_wpl;
+        unsigned char* out = dst.data + static_cast<size_t>(y) * dst.stride;
+        for (int i = 0; i < words; ++i) {
+            const uint32_t w = in[i];
+            out[4 * i] = static_cast<unsigned char>(w >> 24);
+            out[4 * i + 1] = static_cast<unsigned char>(w >> 16);
+            out[4 * i + 2] = static_cast<unsigned char>(w >> 8);
+            out[4 * i + 3] = static_cast<unsigned char>(w);
+        }
+        for (int x = words * 4; x < width; ++x) {
+            out[x] = static_cast<unsigned char>(in[x / 4] >> (24 - 8 * (x % 4)));
+        }
+    }
+}
+
+void copyGray(const unsigned char* src, int src_stride, int width, int height, GrayImage& dst) {
+    for (int y = 0; y < height; ++y) {
+        std::memcpy(dst.data + static_cast<size_t>(y) * dst.stride, src + static_cast<size_t>(y) * src_stride, width);
+    }
+}
+
+void open3x3(GrayImage& image, Workspace& workspace) {
+    filter3x3(kernels().min3, image, workspace);
+    filter3x3(kernels().max3, image, workspace);
+}
+
+void close3x3(GrayImage& image, Workspace& workspace) {
+    filter3x3(kernels().max3, image, workspace);
+    filter3x3(kernels().min3, image, workspace);
+}
+
+bool loadGray(Pix* pix, Workspace& workspace, GrayImage& out) {
+    l_int32 width = 0, height = 0, depth = 0;
+    pixGetDimensions(pix, &width, &height, &depth);
+    if (width <= 0 || height <= 0) {
+        return false;
+    }
+
+    if (depth == 32) {
+        out = workspace.gray(width, height);
+        rgbToGray(pixGetData(pix), pixGetWpl(pix), width, height, out);
+        return true;
+    }
+    if (depth == 8 && !pixGetColormap(pix)) {
+        out = workspace.gray(width, height);
+        unpackGray(pixGetData(pix), pixGetWpl(pix), width, height, out);
+        return true;
+    }
+
+    // Binary, low-depth, 16bpp and colormapped images are rare enough in
+    // scans that Leptonica's conversion is fine for them.
+    Pix* converted = pixConvertTo8(pix, false);
+    if (!converted) {
+        return false;
+    }
+    out = workspace.gray(width, height);
+    unpackGray(pixGetData(converted), pixGetWpl(converted), width, height, out);
+    pixDestroy(&converted);
+    return true;
+}
+
+} // namespace preprocess
\ No newline at end of file
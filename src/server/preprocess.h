@@ -0,0 +1,74 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+struct Pix;
+
+// Preprocessing kernels for the OCR pipeline: RGB -> gray conversion and 3x3
+// gray-level morphology, with AVX2 and SSE4.1 implementations picked at
+// runtime and a portable scalar fallback.
+//
+// Images are plain row-major bytes (pixel x of row y at data[y*stride + x]),
+// not Leptonica's word-packed layout, so rows can be streamed through SIMD
+// registers directly. All buffers live in a Workspace that is reused across
+// calls, so the chain allocates nothing once it has seen its largest image.
+namespace preprocess {
+
+enum class Isa {
+    Scalar,
+    SSE41,
+    AVX2,
+};
+
+// Best ISA this CPU supports; what the kernels use unless overridden.
+Isa detectIsa();
+Isa activeIsa();
+// Forces a specific path (clamped to what the CPU supports). For benchmarks.
+void setIsa(Isa isa);
+const char* isaName(Isa isa);
+
+struct GrayImage {
+    unsigned char* data = nullptr;
+    int width = 0;
+    int height = 0;
+    int stride = 0;
+};
+
+// Grow-only scratch buffers owned by one OCRProcessor. Not thread-safe.
+class Workspace {
+public:
+    GrayImage gray(int width, int height);  // the image being processed
+    unsigned char* rows(size_t bytes);      // row ring for the morphology passes
+
+    size_t capacity() const { return gray_.capacity() + rows_.capacity(); }
+
+private:
+    std::vector<unsigned char> gray_;
+    std::vector<unsigned char> rows_;
+};
+
+// Leptonica 32bpp RGB(A) words -> 8-bit luminance with the 0.3/0.5/0.2
+// weights of pixConvertRGBToLuminance (in 8-bit fixed point, so results can
+// differ from Leptonica's by one gray level). src_wpl is in 32-bit words.
+void rgbToGray(const uint32_t* src, int src_wpl, int width, int height, GrayImage& dst);
+
+// 8bpp Leptonica words -> plain bytes (undoes the in-word byte order).
+void unpackGray(const uint32_t* src, int src_wpl, int width, int height, GrayImage& dst);
+
+// Copies rows of an external 8-bit buffer into dst.
+void copyGray(const unsigned char* src, int src_stride, int width, int height, GrayImage& dst);
+
+// 3x3 gray opening (min then max) and closing (max then min), in place: each
+// pass keeps only a three-row ring of horizontally filtered rows. Pixels
+// outside the image are ignored, matching pixOpenGray/pixCloseGray.
+void open3x3(GrayImage& image, Workspace& workspace);
+void close3x3(GrayImage& image, Workspace& workspace);
+
+// Converts any Leptonica image to an 8-bit GrayImage held by workspace.
+// 32bpp goes through rgbToGray; other depths through pixConvertTo8.
+// Returns false if the conversion failed. Does not take ownership of pix.
+bool loadGray(Pix* pix, Workspace& workspace, GrayImage& out);
+
+} // namespace preprocess
\ No newline at end of file
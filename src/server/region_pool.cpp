@@ -0,0 +1,66 @@
+#include "region_pool.h"
+#include <algorithm>
+
+RegionPool::RegionPool(EnginePool& engines, int n_threads, std::function<bool()> has_spare)
+    : engines_(engines), has_spare_(std::move(has_spare)) {
+    for (int i = 0; i < n_threads; ++i) {
+        threads_.emplace_back(&RegionPool::helperThread, this);
+    }
+}
+
+RegionPool::~RegionPool() {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stop_ = true;
+    }
+    cv_.notify_all();
+    for (auto& thread : threads_) {
+        thread.join();
+    }
+}
+
+int RegionPool::spareEngines(const std::string& language, tesseract::OcrEngineMode oem) {
+    if (!has_spare_()) {
+        return 0;
+    }
+    int idle_threads = 0;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        idle_threads = idle_threads_ - static_cast<int>(jobs_.size());
+    }
+    return std::max(0, std::min(idle_threads, engines_.idleEngines(language, oem)));
+}
+
+void RegionPool::run(const std::string& language, tesseract::OcrEngineMode oem,
+    std::function<void(OCRProcessor&)> job) {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        jobs_.push_back(Job{ language, oem, std::move(job) });
+    }
+    cv_.notify_one();
+}
+
+void RegionPool::helperThread() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (true) {
+        ++idle_threads_;
+        cv_.wait(lock, [this] { return stop_ || !jobs_.empty(); });
+        --idle_threads_;
+        if (stop_) {
+            return;
+        }
+        Job job = std::move(jobs_.front());
+        jobs_.pop_front();
+        lock.unlock();
+
+        // If the engines were taken in the meantime the job is dropped; the
+        // worker that queued it recognizes the remaining blocks itself.
+        EnginePool::Lease engine = engines_.tryAcquire(job.language, job.oem);
+        if (engine) {
+            job.fn(*engine);
+        }
+        engine = EnginePool::Lease();
+
+        lock.lock();
+    }
+}
\ No newline at end of file
@@ -0,0 +1,44 @@
+#pragma once
+
+#include "engine_pool.h"
+#include "ocr_processor.h"
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Helper threads that lend idle pooled engines to a worker splitting a large
+// page into blocks. Only engines nobody is using are borrowed, and only while
+// has_spare() says the task queue is empty, so splitting never delays other
+// requests or forces an extra engine to load.
+class RegionPool final : public OCRProcessor::RegionHelper {
+public:
+    RegionPool(EnginePool& engines, int n_threads, std::function<bool()> has_spare);
+    ~RegionPool();
+
+    int spareEngines(const std::string& language, tesseract::OcrEngineMode oem) override;
+    void run(const std::string& language, tesseract::OcrEngineMode oem,
+        std::function<void(OCRProcessor&)> job) override;
+
+private:
+    struct Job {
+        std::string language;
+        tesseract::OcrEngineMode oem;
+        std::function<void(OCRProcessor&)> fn;
+    };
+
+    void helperThread();
+
+    EnginePool& engines_;
+    std::function<bool()> has_spare_;
+    std::vector<std::thread> threads_;
+
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    std::deque<Job> jobs_;
+    int idle_threads_ = 0;
+    bool stop_ = false;
+};
\ No newline at end of file
@@ -0,0 +1,103 @@
+#include "request_allocator.h"
+#include <google/protobuf/arena.h>
+#include <grpcpp/server_context.h>
+#include <atomic>
+#include <cstdlib>
+
+namespace {
+
+std::atomic<uint64_t> g_calls{ 0 };
+std::atomic<uint64_t> g_blocks{ 0 };
+std::atomic<uint64_t> g_block_bytes{ 0 };
+std::atomic<uint64_t> g_image_bytes{ 0 };
+std::atomic<uint64_t> g_inflight_image_bytes{ 0 };
+std::atomic<uint64_t> g_peak_inflight_image_bytes{ 0 };
+
+void* countedBlockAlloc(size_t size) {
+    g_blocks.fetch_add(1, std::memory_order_relaxed);
+    g_block_bytes.fetch_add(size, std::memory_order_relaxed);
+    return std::malloc(size);
+}
+
+void countedBlockDealloc(void* block, size_t /*size*/) {
+    std::free(block);
+}
+
+google::protobuf::ArenaOptions arenaOptions() {
+    google::protobuf::ArenaOptions options;
+    options.block_alloc = &countedBlockAlloc;
+    options.block_dealloc = &countedBlockDealloc;
+    return options;
+}
+
+class ArenaMessageHolder final
+    : public grpc::MessageHolder<ocrservice::OCRRequest, ocrservice::OCRResponse> {
+public:
+    ArenaMessageHolder() : arena_(arenaOptions()) {
+        set_request(google::protobuf::Arena::CreateMessage<ocrservice::OCRRequest>(&arena_));
+        set_response(google::protobuf::Arena::CreateMessage<ocrservice::OCRResponse>(&arena_));
+    }
+
+    // Called by gRPC once the RPC is finished; frees the whole arena at once.
+    void Release() override {
+        if (tracked_bytes_ > 0) {
+            g_inflight_image_bytes.fetch_sub(tracked_bytes_, std::memory_order_relaxed);
+        }
+        delete this;
+    }
+
+    void track(size_t image_bytes) { tracked_bytes_ = image_bytes; }
+
+private:
+    google::protobuf::Arena arena_;
+    size_t tracked_bytes_ = 0;
+};
+
+} // namespace
+
+grpc::MessageHolder<ocrservice::OCRRequest, ocrservice::OCRResponse>* ArenaRequestAllocator::AllocateMessages() {
+    g_calls.fetch_add(1, std::memory_order_relaxed);
+    return new ArenaMessageHolder();
+}
+
+void ArenaRequestAllocator::trackImage(grpc::CallbackServerContext* context, size_t image_bytes) {
+    auto* holder = dynamic_cast<ArenaMessageHolder*>(context->GetRpcAllocatorState());
+    if (!holder) {
+        return;
+    }
+    holder->track(image_bytes);
+
+    g_image_bytes.fetch_add(image_bytes, std::memory_order_relaxed);
+    uint64_t inflight = g_inflight_image_bytes.fetch_add(image_bytes, std::memory_order_relaxed) + image_bytes;
+    uint64_t peak = g_peak_inflight_image_bytes.load(std::memory_order_relaxed);
+    while (inflight > peak &&
+        !g_peak_inflight_image_bytes.compare_exchange_weak(peak, inflight, std::memory_order_relaxed)) {
+    }
+}
+
+ArenaRequestAllocator::Stats ArenaRequestAllocator::stats() {
+    Stats s;
+    s.calls = g_calls.load(std::memory_order_relaxed);
+    s.arena_blocks = g_blocks.load(std::memory_order_relaxed);
+    s.arena_block_bytes = g_block_bytes.load(std::memory_order_relaxed);
+    s.image_bytes = g_image_bytes.load(std::memory_order_relaxed);
+    s.inflight_image_bytes = g_inflight_image_bytes.load(std::memory_order_relaxed);
+    s.peak_inflight_image_bytes = g_peak_inflight_image_bytes.load(std::memory_order_relaxed);
+    return s;
+}
+
+void setTaskImageBytes(ImageTask& task, const ocrservice::OCRRequest& request) {
+    if (request.has_raw_pixels()) {
+        const ocrservice::RawPixels& raw = request.raw_pixels();
+        task.image_data = reinterpret_cast<const unsigned char*>(raw.data().data());
+        task.image_size = raw.data().size();
+        task.raw_width = raw.width();
+        task.raw_height = raw.height();
+        task.raw_stride = raw.stride();
+    }
+    else {
+        task.image_data = reinterpret_cast<const unsigned char*>(request.image_data().data());
+        task.image_size = request.image_data().size();
+        task.format = request.format();
+    }
+}
@@ -0,0 +1,42 @@
+#pragma once
+
+#include "ocr_service.pb.h"
+#include "ocr_task.h"
+#include <grpcpp/support/message_allocator.h>
+#include <grpcpp/support/server_callback.h>
+#include <cstddef>
+#include <cstdint>
+
+// Allocates each ProcessImage request/response pair on its own protobuf
+// Arena that lives until gRPC releases the RPC. Workers read the image
+// bytes straight out of the parsed request, so a payload is held in memory
+// exactly once for the life of the call.
+//
+// The image counters below say how much payload is held, not whether it
+// was copied; ps4_processor_bench's BM_Ingest checks that it is not.
+class ArenaRequestAllocator final
+    : public grpc::MessageAllocator<ocrservice::OCRRequest, ocrservice::OCRResponse> {
+public:
+    struct Stats {
+        uint64_t calls = 0;                 // arenas handed to gRPC
+        uint64_t arena_blocks = 0;          // arena blocks allocated from the heap
+        uint64_t arena_block_bytes = 0;     // bytes in those blocks
+        uint64_t image_bytes = 0;           // image payload bytes received
+        uint64_t inflight_image_bytes = 0;  // payload bytes held by unfinished RPCs
+        uint64_t peak_inflight_image_bytes = 0;
+    };
+
+    grpc::MessageHolder<ocrservice::OCRRequest, ocrservice::OCRResponse>* AllocateMessages() override;
+
+    // Called by the handler once the request is parsed; the bytes count as
+    // in flight until gRPC releases the call's arena.
+    static void trackImage(grpc::CallbackServerContext* context, size_t image_bytes);
+
+    // Process-wide: arena block hooks are plain function pointers.
+    static Stats stats();
+};
+
+// Points the task at the request's image: the raw pixels and their geometry
+// if present, otherwise the encoded file bytes and format hint. Nothing is
+// copied, so the task must not outlive the request's arena.
+void setTaskImageBytes(ImageTask& task, const ocrservice::OCRRequest& request);
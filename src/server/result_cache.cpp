@@ -0,0 +1,431 @@
+#include "result_cache.h"
+#include "logger.h"
+#include <cstring>
+#include <filesystem>
+
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace {
+
+// xxHash64 (public-domain algorithm by Yann Collet); fast enough to hash a
+// multi-megabyte scan on the RPC thread without showing up in profiles.
+constexpr uint64_t kPrime1 = 11400714785074694791ULL;
+constexpr uint64_t kPrime2 = 14029467366897019727ULL;
+constexpr uint64_t kPrime3 = 1609587929392839161ULL;
+constexpr uint64_t kPrime4 = 9650029242287828579ULL;
+constexpr uint64_t kPrime5 = 2870177450012600261ULL;
+
+inline uint64_t rotl(uint64_t x, int r) {
+    return (x << r) | (x >> (64 - r));
+}
+
+inline uint64_t read64(const unsigned char* p) {
+    uint64_t v;
+    std::memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+inline uint32_t read32(const unsigned char* p) {
+    uint32_t v;
+    std::memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+inline uint64_t round64(uint64_t acc, uint64_t input) {
+    acc += input * kPrime2;
+    acc = rotl(acc, 31);
+    return acc * kPrime1;
+}
+
+inline uint64_t mergeRound(uint64_t acc, uint64_t val) {
+    acc ^= round64(0, val);
+    return acc * kPrime1 + kPrime4;
+}
+
+uint64_t xxhash64(const unsigned char* p, size_t len, uint64_t seed) {
+    const unsigned char* end = p + len;
+    uint64_t h;
+
+    if (len >= 32) {
+        const unsigned char* limit = end - 32;
+        uint64_t v1 = seed + kPrime1 + kPrime2;
+        uint64_t v2 = seed + kPrime2;
+        uint64_t v3 = seed;
+        uint64_t v4 = seed - kPrime1;
+        do {
+            v1 = round64(v1, read64(p));
+            v2 = round64(v2, read64(p + 8));
+            v3 = round64(v3, read64(p + 16));
+            v4 = round64(v4, read64(p + 24));
+            p += 32;
+        } while (p <= limit);
+
+        h = rotl(v1, 1) + rotl(v2, 7) + rotl(v3, 12) + rotl(v4, 18);
+        h = mergeRound(h, v1);
+        h = mergeRound(h, v2);
+        h = mergeRound(h, v3);
+        h = mergeRound(h, v4);
+    }
+    else {
+        h = seed + kPrime5;
+    }
+
+    h += static_cast<uint64_t>(len);
+
+    while (p + 8 <= end) {
+        h ^= round64(0, read64(p));
+        h = rotl(h, 27) * kPrime1 + kPrime4;
+        p += 8;
+    }
+    if (p + 4 <= end) {
+        h ^= static_cast<uint64_t>(read32(p)) * kPrime1;
+        h = rotl(h, 23) * kPrime2 + kPrime3;
+        p += 4;
+    }
+    while (p < end) {
+        h ^= (*p) * kPrime5;
+        h = rotl(h, 11) * kPrime1;
+        ++p;
+    }
+
+    h ^= h >> 33;
+    h *= kPrime2;
+    h ^= h >> 29;
+    h *= kPrime3;
+    h ^= h >> 32;
+    return h;
+}
+
+// On-disk layout: the magic, then back-to-back records of
+//   u64 hash | u64 size | u32 variant_len | u32 text_len | variant | text
+// in host byte order. Records are only ever appended.
+constexpr char kDiskMagic[8] = { 'P', 'S', '4', 'O', 'C', 'R', 'C', '1' };
+constexpr size_t kRecordHeaderSize = 8 + 8 + 4 + 4;
+
+// Rough per-entry bookkeeping cost (list node, hash node, strings).
+constexpr size_t kEntryOverhead = 128;
+
+} // namespace
+
+// Read-only view of the persistent tier.
+class ResultCache::MappedFile {
+public:
+    static std::unique_ptr<MappedFile> open(const std::string& path) {
+        std::unique_ptr<MappedFile> file(new MappedFile());
+#ifdef _WIN32
+        file->handle_ = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE,
+            nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+        if (file->handle_ == INVALID_HANDLE_VALUE) {
+            return nullptr;
+        }
+        LARGE_INTEGER size;
+        if (!GetFileSizeEx(file->handle_, &size)) {
+            return nullptr;
+        }
+        file->size_ = static_cast<size_t>(size.QuadPart);
+        if (file->size_ == 0) {
+            return file;
+        }
+        file->mapping_ = CreateFileMappingA(file->handle_, nullptr, PAGE_READONLY, 0, 0, nullptr);
+        if (!file->mapping_) {
+            return nullptr;
+        }
+        file->data_ = static_cast<const unsigned char*>(MapViewOfFile(file->mapping_, FILE_MAP_READ, 0, 0, 0));
+#else
+        file->fd_ = ::open(path.c_str(), O_RDONLY);
+        if (file->fd_ < 0) {
+            return nullptr;
+        }
+        struct stat st;
+        if (fstat(file->fd_, &st) != 0) {
+            return nullptr;
+        }
+        file->size_ = static_cast<size_t>(st.st_size);
+        if (file->size_ == 0) {
+            return file;
+        }
+        void* addr = mmap(nullptr, file->size_, PROT_READ, MAP_SHARED, file->fd_, 0);
+        file->data_ = addr == MAP_FAILED ? nullptr : static_cast<const unsigned char*>(addr);
+#endif
+        if (!file->data_) {
+            return nullptr;
+        }
+        return file;
+    }
+
+    ~MappedFile() {
+#ifdef _WIN32
+        if (data_) UnmapViewOfFile(data_);
+        if (mapping_) CloseHandle(mapping_);
+        if (handle_ != INVALID_HANDLE_VALUE) CloseHandle(handle_);
+#else
+        if (data_) munmap(const_cast<unsigned char*>(data_), size_);
+        if (fd_ >= 0) ::close(fd_);
+#endif
+    }
+
+    const unsigned char* data() const { return data_; }
+    size_t size() const { return size_; }
+
+private:
+    MappedFile() = default;
+
+    const unsigned char* data_ = nullptr;
+    size_t size_ = 0;
+#ifdef _WIN32
+    HANDLE handle_ = INVALID_HANDLE_VALUE;
+    HANDLE mapping_ = nullptr;
+#else
+    int fd_ = -1;
+#endif
+};
+
+size_t ResultCache::KeyHash::operator()(const Key& key) const {
+    // The content hash is already well mixed; fold in the rest cheaply
+    return static_cast<size_t>(key.hash ^ (key.size * kPrime2) ^ std::hash<std::string>()(key.variant));
+}
+
+ResultCache::ResultCache(const Options& options) : options_(options) {
+    if (enabled() && !options_.disk_path.empty()) {
+        openDiskTier();
+    }
+}
+
+ResultCache::~ResultCache() {
+    if (disk_append_) {
+        std::fclose(disk_append_);
+    }
+}
+
+uint64_t ResultCache::hashImage(const unsigned char* data, size_t size) {
+    return xxhash64(data, size, 0);
+}
+
+ResultCache::Key ResultCache::makeKey(uint64_t image_hash, size_t size, const std::string& variant) {
+    Key key;
+    key.hash = image_hash;
+    key.size = size;
+    key.variant = variant;
+    return key;
+}
+
+ResultCache::Lookup ResultCache::acquire(const Key& key, ImageTask& task, TaskResult& result) {
+    std::lock_guard<std::mutex> lock(mutex_);
+
+    auto it = index_.find(key);
+    if (it != index_.end()) {
+        lru_.splice(lru_.begin(), lru_, it->second);
+        result.text = it->second->text;
+        result.success = true;
+        result.error_message.clear();
+        hits_.fetch_add(1, std::memory_order_relaxed);
+        return Lookup::Hit;
+    }
+
+    if (lookupDiskLocked(key, result.text)) {
+        insertLocked(key, result.text);
+        result.success = true;
+        result.error_message.clear();
+        disk_hits_.fetch_add(1, std::memory_order_relaxed);
+        return Lookup::Hit;
+    }
+
+    auto flight = in_flight_.find(key);
+    if (flight != in_flight_.end()) {
+        flight->second.joiners.push_back(std::move(task));
+        coalesced_.fetch_add(1, std::memory_order_relaxed);
+        return Lookup::Joined;
+    }
+
+    in_flight_[key].leader = task.on_complete;
+    misses_.fetch_add(1, std::memory_order_relaxed);
+    return Lookup::Miss;
+}
+
+bool ResultCache::complete(const Key& key, const TaskResult& result, ImageTask& successor) {
+    CompletionCallback leader;
+    std::vector<ImageTask> joiners;
+    bool handed_over = false;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto flight = in_flight_.find(key);
+        if (flight != in_flight_.end()) {
+            leader = std::move(flight->second.leader);
+            const bool callers_own = result.abandoned == TaskResult::Abandoned::Deadline
+                || result.abandoned == TaskResult::Abandoned::Cancelled;
+            if (callers_own && !flight->second.joiners.empty()) {
+                // The others' callers may still be waiting with time to
+                // spare; the oldest takes over and the rest stay parked. One
+                // that has itself expired is dropped by the scheduler, which
+                // hands over again.
+                std::vector<ImageTask>& parked = flight->second.joiners;
+                successor = std::move(parked.front());
+                parked.erase(parked.begin());
+                flight->second.leader = successor.on_complete;
+                handed_over = true;
+            }
+            else {
+                joiners = std::move(flight->second.joiners);
+                in_flight_.erase(flight);
+            }
+        }
+        if (result.success) {
+            insertLocked(key, result.text);
+            appendDiskLocked(key, result.text);
+        }
+    }
+
+    if (leader) {
+        leader(result);
+    }
+    for (ImageTask& joiner : joiners) {
+        joiner.on_complete(result);
+    }
+    return handed_over;
+}
+
+ResultCache::Stats ResultCache::stats() const {
+    Stats s;
+    s.hits = hits_.load(std::memory_order_relaxed);
+    s.disk_hits = disk_hits_.load(std::memory_order_relaxed);
+    s.misses = misses_.load(std::memory_order_relaxed);
+    s.coalesced = coalesced_.load(std::memory_order_relaxed);
+    s.evictions = evictions_.load(std::memory_order_relaxed);
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    s.entries = index_.size();
+    s.bytes = bytes_;
+    s.disk_entries = disk_index_.size();
+    return s;
+}
+
+void ResultCache::insertLocked(const Key& key, const std::string& text) {
+    if (index_.count(key)) {
+        return;
+    }
+
+    size_t charge = text.size() + key.variant.size() + kEntryOverhead;
+    if (charge > options_.memory_budget_bytes) {
+        return;
+    }
+
+    lru_.push_front(Entry{ key, text, charge });
+    index_[key] = lru_.begin();
+    bytes_ += charge;
+
+    while (bytes_ > options_.memory_budget_bytes && !lru_.empty()) {
+        Entry& victim = lru_.back();
+        bytes_ -= victim.charge;
+        index_.erase(victim.key);
+        lru_.pop_back();
+        evictions_.fetch_add(1, std::memory_order_relaxed);
+    }
+}
+
+bool ResultCache::lookupDiskLocked(const Key& key, std::string& text) {
+    auto it = disk_index_.find(key);
+    if (it == disk_index_.end()) {
+        return false;
+    }
+
+    const DiskRecord& record = it->second;
+    if (!disk_map_ || record.offset + record.length > disk_map_->size()) {
+        // Appended since the file was last mapped
+        disk_map_ = MappedFile::open(options_.disk_path);
+        if (!disk_map_ || record.offset + record.length > disk_map_->size()) {
+            return false;
+        }
+    }
+
+    text.assign(reinterpret_cast<const char*>(disk_map_->data() + record.offset), record.length);
+    return true;
+}
+
+void ResultCache::openDiskTier() {
+    namespace fs = std::filesystem;
+    const std::string& path = options_.disk_path;
+
+    std::error_code ec;
+    if (!fs::exists(path, ec) || fs::file_size(path, ec) < sizeof(kDiskMagic)) {
+        std::FILE* f = std::fopen(path.c_str(), "wb");
+        if (!f) {
+            LOG_WARN << "[Cache] Cannot create cache file " << path << "; running memory-only";
+            return;
+        }
+        std::fwrite(kDiskMagic, 1, sizeof(kDiskMagic), f);
+        std::fclose(f);
+    }
+
+    disk_map_ = MappedFile::open(path);
+    if (!disk_map_ || disk_map_->size() < sizeof(kDiskMagic) ||
+        std::memcmp(disk_map_->data(), kDiskMagic, sizeof(kDiskMagic)) != 0) {
+        LOG_WARN << "[Cache] " << path << " is not a cache file; running memory-only";
+        disk_map_.reset();
+        return;
+    }
+
+    // Index every complete record; a torn tail from a crash is cut off
+    const unsigned char* base = disk_map_->data();
+    const size_t size = disk_map_->size();
+    size_t pos = sizeof(kDiskMagic);
+    while (pos + kRecordHeaderSize <= size) {
+        Key key;
+        key.hash = read64(base + pos);
+        key.size = read64(base + pos + 8);
+        uint32_t variant_len = read32(base + pos + 16);
+        uint32_t text_len = read32(base + pos + 20);
+        size_t record_end = pos + kRecordHeaderSize + variant_len + text_len;
+        if (record_end > size) {
+            break;
+        }
+        key.variant.assign(reinterpret_cast<const char*>(base + pos + kRecordHeaderSize), variant_len);
+        disk_index_[key] = DiskRecord{ pos + kRecordHeaderSize + variant_len, text_len };
+        pos = record_end;
+    }
+
+    if (pos < size) {
+        LOG_WARN << "[Cache] Dropping " << (size - pos) << " bytes of incomplete records from " << path;
+        disk_map_.reset();
+        fs::resize_file(path, pos, ec);
+        disk_map_ = MappedFile::open(path);
+    }
+    disk_size_ = pos;
+
+    disk_append_ = std::fopen(path.c_str(), "ab");
+    LOG_INFO << "[Cache] Loaded " << disk_index_.size() << " results from " << path;
+}
+
+void ResultCache::appendDiskLocked(const Key& key, const std::string& text) {
+    if (!disk_append_ || disk_index_.count(key)) {
+        return;
+    }
+
+    unsigned char header[kRecordHeaderSize];
+    uint32_t variant_len = static_cast<uint32_t>(key.variant.size());
+    uint32_t text_len = static_cast<uint32_t>(text.size());
+    std::memcpy(header, &key.hash, 8);
+    std::memcpy(header + 8, &key.size, 8);
+    std::memcpy(header + 16, &variant_len, 4);
+    std::memcpy(header + 20, &text_len, 4);
+
+    std::fwrite(header, 1, sizeof(header), disk_append_);
+    std::fwrite(key.variant.data(), 1, variant_len, disk_append_);
+    std::fwrite(text.data(), 1, text_len, disk_append_);
+    if (std::fflush(disk_append_) != 0) {
+        LOG_ERROR << "[Cache] Write to " << options_.disk_path << " failed; disabling persistence";
+        std::fclose(disk_append_);
+        disk_append_ = nullptr;
+        return;
+    }
+
+    disk_index_[key] = DiskRecord{ disk_size_ + kRecordHeaderSize + variant_len, text_len };
+    disk_size_ += kRecordHeaderSize + variant_len + text_len;
+}
@@ -0,0 +1,133 @@
+#pragma once
+
+#include "ocr_task.h"
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// Content-addressed cache of OCR results.
+//
+// Entries are keyed by a hash of the image bytes plus a "variant" string
+// describing everything else that affects the output (language, engine
+// config). Successful results are kept in an LRU bounded by a byte budget
+// and, optionally, appended to a memory-mapped file that is re-indexed on
+// startup. Requests for an image that is already being OCR'd are parked on
+// the in-flight entry instead of being queued again (single-flight). If the
+// leader is abandoned for its own caller's sake (deadline, cancellation), a
+// parked request takes over rather than sharing that failure.
+class ResultCache {
+public:
+    struct Options {
+        size_t memory_budget_bytes = 64 * 1024 * 1024;  // 0 disables the cache
+        std::string disk_path;                           // empty: memory only
+    };
+
+    struct Key {
+        uint64_t hash = 0;
+        uint64_t size = 0;
+        std::string variant;
+
+        bool operator==(const Key& other) const {
+            return hash == other.hash && size == other.size && variant == other.variant;
+        }
+    };
+
+    struct Stats {
+        uint64_t hits = 0;          // served from memory
+        uint64_t disk_hits = 0;     // served from the persistent tier
+        uint64_t misses = 0;        // had to be OCR'd
+        uint64_t coalesced = 0;     // joined an identical in-flight request
+        uint64_t evictions = 0;
+        uint64_t entries = 0;
+        uint64_t bytes = 0;
+        uint64_t disk_entries = 0;
+    };
+
+    enum class Lookup {
+        Hit,     // `result` holds the cached answer; call on_complete yourself
+        Joined,  // the task was parked and completes when the leader does
+        Miss,    // caller must OCR the image and then call complete(key, ...)
+    };
+
+    explicit ResultCache(const Options& options);
+    ~ResultCache();
+
+    bool enabled() const { return options_.memory_budget_bytes > 0; }
+
+    static uint64_t hashImage(const unsigned char* data, size_t size);
+    // image_hash is hashImage(data, size); hashed once, it keys every page
+    // of a multi-page image.
+    static Key makeKey(uint64_t image_hash, size_t size, const std::string& variant);
+
+    // On Miss the caller becomes the leader for `key`: task.on_complete is
+    // stored and will be invoked by complete() together with any joiners. On
+    // Joined the whole task is moved into the cache, so that it can be run
+    // in the leader's place.
+    Lookup acquire(const Key& key, ImageTask& task, TaskResult& result);
+
+    // Publishes the leader's result and runs every parked callback, outside
+    // the cache lock. Only successful results are stored.
+    //
+    // If the result was abandoned for the leader's caller (deadline or
+    // cancellation) and a request is parked, only the leader
+    // gets it: the oldest parked task becomes the new leader, is moved into
+    // successor with its callback stored as the leader's, and true is
+    // returned. The caller must run successor and complete `key` again.
+    bool complete(const Key& key, const TaskResult& result, ImageTask& successor);
+
+    Stats stats() const;
+
+private:
+    struct KeyHash {
+        size_t operator()(const Key& key) const;
+    };
+
+    struct Entry {
+        Key key;
+        std::string text;
+        size_t charge;
+    };
+
+    struct Flight {
+        CompletionCallback leader;
+        std::vector<ImageTask> joiners;     // oldest first
+    };
+
+    struct DiskRecord {
+        uint64_t offset;    // of the text, from the start of the file
+        uint32_t length;
+    };
+
+    class MappedFile;
+
+    void insertLocked(const Key& key, const std::string& text);
+    bool lookupDiskLocked(const Key& key, std::string& text);
+    void openDiskTier();
+    void appendDiskLocked(const Key& key, const std::string& text);
+
+    Options options_;
+
+    mutable std::mutex mutex_;
+    std::list<Entry> lru_;  // front = most recently used
+    std::unordered_map<Key, std::list<Entry>::iterator, KeyHash> index_;
+    std::unordered_map<Key, Flight, KeyHash> in_flight_;
+    size_t bytes_ = 0;
+
+    std::unique_ptr<MappedFile> disk_map_;
+    std::unordered_map<Key, DiskRecord, KeyHash> disk_index_;
+    std::FILE* disk_append_ = nullptr;
+    uint64_t disk_size_ = 0;
+
+    mutable std::atomic<uint64_t> hits_{ 0 };
+    mutable std::atomic<uint64_t> disk_hits_{ 0 };
+    mutable std::atomic<uint64_t> misses_{ 0 };
+    mutable std::atomic<uint64_t> coalesced_{ 0 };
+    mutable std::atomic<uint64_t> evictions_{ 0 };
+};
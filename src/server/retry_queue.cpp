@@ -0,0 +1,68 @@
+#include "retry_queue.h"
+#include <algorithm>
+
+RetryQueue::RetryQueue(Resubmit resubmit)
+    : resubmit_(std::move(resubmit)), thread_(&RetryQueue::timerThread, this) {
+}
+
+RetryQueue::~RetryQueue() {
+    stop();
+}
+
+bool RetryQueue::schedule(ImageTask&& task, TaskClock::time_point due) {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (stopped_) {
+            return false;
+        }
+        waiting_.push_back(Entry{ due, std::move(task) });
+        std::push_heap(waiting_.begin(), waiting_.end(), dueLater);
+    }
+    scheduled_.fetch_add(1, std::memory_order_relaxed);
+    cv_.notify_one();
+    return true;
+}
+
+void RetryQueue::stop() {
+    std::vector<Entry> abandoned;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (stopped_) {
+            return;
+        }
+        stopped_ = true;
+        abandoned.swap(waiting_);
+    }
+    cv_.notify_one();
+    thread_.join();
+
+    TaskResult result;
+    result.error_message = "Server shut down before the image could be retried.";
+    result.abandoned = TaskResult::Abandoned::Shutdown;
+    for (Entry& entry : abandoned) {
+        entry.task.on_complete(result);
+    }
+}
+
+void RetryQueue::timerThread() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (!stopped_) {
+        if (waiting_.empty()) {
+            cv_.wait(lock);
+            continue;
+        }
+        const TaskClock::time_point due = waiting_.front().due;
+        if (TaskClock::now() < due) {
+            // Woken early by an earlier entry or stop()
+            cv_.wait_until(lock, due);
+            continue;
+        }
+
+        std::pop_heap(waiting_.begin(), waiting_.end(), dueLater);
+        ImageTask task = std::move(waiting_.back().task);
+        waiting_.pop_back();
+        lock.unlock();
+        resubmit_(std::move(task));
+        lock.lock();
+    }
+}
\ No newline at end of file
@@ -0,0 +1,48 @@
+#pragma once
+
+#include "ocr_task.h"
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Parks tasks that failed transiently until their retry is due, then hands
+// them back through `resubmit`. One thread sleeps until the earliest due
+// time, so the worker that saw the failure moves straight on.
+class RetryQueue {
+public:
+    using Resubmit = std::function<void(ImageTask task)>;
+
+    explicit RetryQueue(Resubmit resubmit);
+    ~RetryQueue();
+
+    // Takes the task unless the queue is stopped; it is then left as it was
+    // and the caller has to complete it.
+    bool schedule(ImageTask&& task, TaskClock::time_point due);
+
+    // Ends the thread. Tasks still waiting fail with an error.
+    void stop();
+
+    uint64_t scheduled() const { return scheduled_.load(std::memory_order_relaxed); }
+
+private:
+    struct Entry {
+        TaskClock::time_point due;
+        ImageTask task;
+    };
+
+    static bool dueLater(const Entry& a, const Entry& b) { return a.due > b.due; }
+
+    void timerThread();
+
+    Resubmit resubmit_;
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    std::vector<Entry> waiting_;    // heap, earliest due on top
+    bool stopped_ = false;
+    std::atomic<uint64_t> scheduled_{ 0 };
+    std::thread thread_;
+};
\ No newline at end of file
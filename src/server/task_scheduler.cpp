@@ -0,0 +1,264 @@
+#include "task_scheduler.h"
+#include <algorithm>
+
+TaskScheduler::Stats TaskScheduler::stats() const {
+    Stats s;
+    s.pushed = counters_.pushed.load(std::memory_order_relaxed);
+    s.popped = counters_.popped.load(std::memory_order_relaxed);
+    s.steals = counters_.steals.load(std::memory_order_relaxed);
+    s.failed_steals = counters_.failed_steals.load(std::memory_order_relaxed);
+    s.lock_contention = counters_.lock_contention.load(std::memory_order_relaxed);
+    s.sleeps = counters_.sleeps.load(std::memory_order_relaxed);
+    s.expired = counters_.expired.load(std::memory_order_relaxed);
+    s.cancelled = counters_.cancelled.load(std::memory_order_relaxed);
+    s.depth = counters_.depth.load(std::memory_order_relaxed);
+    return s;
+}
+
+std::unique_ptr<TaskScheduler> TaskScheduler::create(Kind kind, int n_workers) {
+    switch (kind) {
+    case Kind::SharedQueue:
+        return std::make_unique<SharedQueueScheduler>();
+    case Kind::WorkStealing:
+    default:
+        return std::make_unique<WorkStealingScheduler>(n_workers);
+    }
+}
+
+bool TaskScheduler::parseKind(const std::string& name, Kind& kind) {
+    if (name == "shared") {
+        kind = Kind::SharedQueue;
+        return true;
+    }
+    if (name == "stealing") {
+        kind = Kind::WorkStealing;
+        return true;
+    }
+    return false;
+}
+
+const char* TaskScheduler::kindName(Kind kind) {
+    return kind == Kind::SharedQueue ? "shared" : "stealing";
+}
+
+std::unique_lock<std::mutex> TaskScheduler::lockCounted(std::mutex& mutex) {
+    std::unique_lock<std::mutex> lock(mutex, std::try_to_lock);
+    if (!lock.owns_lock()) {
+        counters_.lock_contention.fetch_add(1, std::memory_order_relaxed);
+        lock.lock();
+    }
+    return lock;
+}
+
+bool TaskScheduler::dropIfExpired(ImageTask& task) {
+    TaskResult result;
+    if (task.expired(TaskClock::now())) {
+        counters_.expired.fetch_add(1, std::memory_order_relaxed);
+        result.error_message = "Deadline exceeded before processing started.";
+        result.abandoned = TaskResult::Abandoned::Deadline;
+    }
+    else if (task.cancelled && task.cancelled()) {
+        counters_.cancelled.fetch_add(1, std::memory_order_relaxed);
+        result.error_message = "Cancelled before processing started.";
+        result.abandoned = TaskResult::Abandoned::Cancelled;
+    }
+    else {
+        return false;
+    }
+    task.on_complete(result);
+    return true;
+}
+
+// SharedQueueScheduler
+
+void SharedQueueScheduler::push(ImageTask task) {
+    {
+        auto lock = lockCounted(mutex_);
+        queue_.push_back(std::move(task));
+        std::push_heap(queue_.begin(), queue_.end(), runsLater);
+        counters_.depth.fetch_add(1, std::memory_order_relaxed);
+    }
+    counters_.pushed.fetch_add(1, std::memory_order_relaxed);
+    cv_.notify_one();
+}
+
+bool SharedQueueScheduler::pop(int /*worker_id*/, ImageTask& task) {
+    while (true) {
+        auto lock = lockCounted(mutex_);
+        if (queue_.empty() && !shutdown_) {
+            counters_.sleeps.fetch_add(1, std::memory_order_relaxed);
+            cv_.wait(lock, [this]() { return !queue_.empty() || shutdown_; });
+        }
+        if (queue_.empty()) {
+            return false;
+        }
+
+        std::pop_heap(queue_.begin(), queue_.end(), runsLater);
+        task = std::move(queue_.back());
+        queue_.pop_back();
+        counters_.depth.fetch_sub(1, std::memory_order_relaxed);
+        lock.unlock();
+
+        if (!dropIfExpired(task)) {
+            counters_.popped.fetch_add(1, std::memory_order_relaxed);
+            return true;
+        }
+    }
+}
+
+void SharedQueueScheduler::shutdown() {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        shutdown_ = true;
+    }
+    cv_.notify_all();
+}
+
+// WorkStealingScheduler
+
+WorkStealingScheduler::WorkStealingScheduler(int n_workers) {
+    if (n_workers < 1) {
+        n_workers = 1;
+    }
+    for (int i = 0; i < n_workers; ++i) {
+        queues_.emplace_back(std::make_unique<WorkerQueue>());
+    }
+}
+
+void WorkStealingScheduler::push(ImageTask task) {
+    // Producers are mostly gRPC threads, so spread tasks round-robin
+    size_t index = next_queue_.fetch_add(1, std::memory_order_relaxed) % queues_.size();
+    WorkerQueue& queue = *queues_[index];
+    {
+        auto lock = lockCounted(queue.mutex);
+        queue.tasks.push_back(std::move(task));
+        std::push_heap(queue.tasks.begin(), queue.tasks.end(), runsLater);
+        publishTopLocked(queue);
+    }
+    counters_.pushed.fetch_add(1, std::memory_order_relaxed);
+
+    // depth and sleepers_ are seq_cst so either a parking worker sees the
+    // new depth, or we see the sleeper and wake it.
+    counters_.depth.fetch_add(1);
+    if (sleepers_.load() > 0) {
+        std::lock_guard<std::mutex> lock(sleep_mutex_);
+        sleep_cv_.notify_one();
+    }
+}
+
+void WorkStealingScheduler::publishTopLocked(WorkerQueue& queue) {
+    const TaskClock::time_point top = queue.tasks.empty() ? TaskClock::time_point::max() : queue.tasks.front().deadline;
+    queue.top_deadline.store(top.time_since_epoch().count(), std::memory_order_relaxed);
+}
+
+bool WorkStealingScheduler::popEarliest(int worker_id, ImageTask& task) {
+    // Own deque first, so it wins ties
+    const size_t n = queues_.size();
+    const size_t self = worker_id % n;
+    size_t best = self;
+    TaskClock::rep best_deadline = queues_[self]->top_deadline.load(std::memory_order_relaxed);
+    for (size_t k = 1; k < n; ++k) {
+        const size_t index = (self + k) % n;
+        const TaskClock::rep deadline = queues_[index]->top_deadline.load(std::memory_order_relaxed);
+        if (deadline < best_deadline) {
+            best = index;
+            best_deadline = deadline;
+        }
+    }
+    if (best_deadline == TaskClock::time_point::max().time_since_epoch().count()) {
+        return false;
+    }
+    if (best == self) {
+        return popLocal(worker_id, task);
+    }
+
+    // Same as a steal, only aimed at the most urgent task
+    WorkerQueue& victim = *queues_[best];
+    std::unique_lock<std::mutex> lock(victim.mutex, std::try_to_lock);
+    if (!lock.owns_lock()) {
+        counters_.lock_contention.fetch_add(1, std::memory_order_relaxed);
+        return false;
+    }
+    if (victim.tasks.empty()) {
+        return false;
+    }
+    std::pop_heap(victim.tasks.begin(), victim.tasks.end(), runsLater);
+    task = std::move(victim.tasks.back());
+    victim.tasks.pop_back();
+    publishTopLocked(victim);
+    counters_.steals.fetch_add(1, std::memory_order_relaxed);
+    return true;
+}
+
+bool WorkStealingScheduler::popLocal(int worker_id, ImageTask& task) {
+    WorkerQueue& queue = *queues_[worker_id % queues_.size()];
+    auto lock = lockCounted(queue.mutex);
+    if (queue.tasks.empty()) {
+        return false;
+    }
+    std::pop_heap(queue.tasks.begin(), queue.tasks.end(), runsLater);
+    task = std::move(queue.tasks.back());
+    queue.tasks.pop_back();
+    publishTopLocked(queue);
+    return true;
+}
+
+bool WorkStealingScheduler::steal(int worker_id, ImageTask& task) {
+    const size_t n = queues_.size();
+    for (size_t k = 1; k < n; ++k) {
+        WorkerQueue& victim = *queues_[(worker_id + k) % n];
+
+        // Never wait on a victim's lock: if it is busy, try the next one
+        std::unique_lock<std::mutex> lock(victim.mutex, std::try_to_lock);
+        if (!lock.owns_lock()) {
+            counters_.lock_contention.fetch_add(1, std::memory_order_relaxed);
+            counters_.failed_steals.fetch_add(1, std::memory_order_relaxed);
+            continue;
+        }
+        if (victim.tasks.empty()) {
+            counters_.failed_steals.fetch_add(1, std::memory_order_relaxed);
+            continue;
+        }
+
+        // Thieves take the victim's most urgent task, like its owner would
+        std::pop_heap(victim.tasks.begin(), victim.tasks.end(), runsLater);
+        task = std::move(victim.tasks.back());
+        victim.tasks.pop_back();
+        publishTopLocked(victim);
+        counters_.steals.fetch_add(1, std::memory_order_relaxed);
+        return true;
+    }
+    return false;
+}
+
+bool WorkStealingScheduler::pop(int worker_id, ImageTask& task) {
+    while (true) {
+        if (popEarliest(worker_id, task) || popLocal(worker_id, task) || steal(worker_id, task)) {
+            counters_.depth.fetch_sub(1);
+            if (dropIfExpired(task)) {
+                continue;
+            }
+            counters_.popped.fetch_add(1, std::memory_order_relaxed);
+            return true;
+        }
+
+        std::unique_lock<std::mutex> lock(sleep_mutex_);
+        if (shutdown_ && counters_.depth.load() <= 0) {
+            return false;
+        }
+        sleepers_.fetch_add(1);
+        if (counters_.depth.load() <= 0 && !shutdown_) {
+            counters_.sleeps.fetch_add(1, std::memory_order_relaxed);
+            sleep_cv_.wait(lock, [this]() { return counters_.depth.load() > 0 || shutdown_; });
+        }
+        sleepers_.fetch_sub(1);
+    }
+}
+
+void WorkStealingScheduler::shutdown() {
+    {
+        std::lock_guard<std::mutex> lock(sleep_mutex_);
+        shutdown_ = true;
+    }
+    sleep_cv_.notify_all();
+}
@@ -0,0 +1,140 @@
+#pragma once
+
+#include "ocr_task.h"
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// Hands queued ImageTasks to worker threads, earliest deadline first (tasks
+// without one in arrival order, after all that have one). Tasks whose
+// deadline passed or whose caller cancelled while they were queued are
+// completed with an error inside pop() and never reach a worker.
+// Implementations differ only in how the pending tasks are stored and
+// shared between workers.
+class TaskScheduler {
+public:
+    enum class Kind {
+        SharedQueue,    // one queue behind one lock (the original design)
+        WorkStealing,   // per-worker deques, idle workers steal
+    };
+
+    struct Stats {
+        uint64_t pushed = 0;
+        uint64_t popped = 0;
+        uint64_t steals = 0;           // tasks taken from another worker's deque
+        uint64_t failed_steals = 0;    // victim deques found empty or busy
+        uint64_t lock_contention = 0;  // lock acquisitions that had to wait
+        uint64_t sleeps = 0;           // times a worker blocked for lack of work
+        uint64_t expired = 0;          // dropped unstarted, deadline passed
+        uint64_t cancelled = 0;        // dropped unstarted, caller cancelled
+        int64_t depth = 0;             // tasks currently queued
+    };
+
+    virtual ~TaskScheduler() = default;
+
+    // Queues a task. Safe to call from any thread, including workers.
+    virtual void push(ImageTask task) = 0;
+
+    // Blocks until a live task is available for worker_id. Returns false once
+    // the scheduler is shut down and every queued task has been handed out.
+    virtual bool pop(int worker_id, ImageTask& task) = 0;
+
+    virtual void shutdown() = 0;
+
+    Stats stats() const;
+
+    static std::unique_ptr<TaskScheduler> create(Kind kind, int n_workers);
+    static bool parseKind(const std::string& name, Kind& kind);
+    static const char* kindName(Kind kind);
+
+protected:
+    struct Counters {
+        std::atomic<uint64_t> pushed{ 0 };
+        std::atomic<uint64_t> popped{ 0 };
+        std::atomic<uint64_t> steals{ 0 };
+        std::atomic<uint64_t> failed_steals{ 0 };
+        std::atomic<uint64_t> lock_contention{ 0 };
+        std::atomic<uint64_t> sleeps{ 0 };
+        std::atomic<uint64_t> expired{ 0 };
+        std::atomic<uint64_t> cancelled{ 0 };
+        std::atomic<int64_t> depth{ 0 };
+    };
+
+    // Heap order for std::push_heap/pop_heap: the top is the task with the
+    // earliest deadline, ties broken by task_id.
+    static bool runsLater(const ImageTask& a, const ImageTask& b) {
+        if (a.deadline != b.deadline) {
+            return a.deadline > b.deadline;
+        }
+        return a.task_id > b.task_id;
+    }
+
+    // Takes the lock, counting the acquisition as contended if it had to wait.
+    std::unique_lock<std::mutex> lockCounted(std::mutex& mutex);
+
+    // Call without holding a lock: completes task with an error if its
+    // deadline has passed or it was cancelled. Returns true if it did.
+    bool dropIfExpired(ImageTask& task);
+
+    Counters counters_;
+};
+
+class SharedQueueScheduler final : public TaskScheduler {
+public:
+    void push(ImageTask task) override;
+    bool pop(int worker_id, ImageTask& task) override;
+    void shutdown() override;
+
+private:
+    std::vector<ImageTask> queue_;  // heap ordered by runsLater
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    bool shutdown_ = false;
+};
+
+// Tasks are pushed to the workers' deques round-robin. A popping worker
+// takes the earliest deadline across all deques, not just its own, going
+// by the deadline each deque publishes for its top task; it only falls back
+// to its own deque when that victim's lock is busy. Tasks without a
+// deadline run in arrival order per deque, and stolen ones in whatever
+// order the deques give them up.
+class WorkStealingScheduler final : public TaskScheduler {
+public:
+    explicit WorkStealingScheduler(int n_workers);
+
+    void push(ImageTask task) override;
+    bool pop(int worker_id, ImageTask& task) override;
+    void shutdown() override;
+
+private:
+    // Padded so neighbouring deques' locks do not share a cache line.
+    struct alignas(64) WorkerQueue {
+        std::mutex mutex;
+        std::vector<ImageTask> tasks;   // heap ordered by runsLater
+        // The top task's deadline, readable without the lock; max() when
+        // empty or when the top has no deadline
+        std::atomic<TaskClock::rep> top_deadline{ TaskClock::time_point::max().time_since_epoch().count() };
+    };
+
+    // Caller holds queue.mutex.
+    static void publishTopLocked(WorkerQueue& queue);
+    // Pops the task with the earliest deadline of any deque. False if no
+    // queued task has a deadline, or its deque's lock was busy.
+    bool popEarliest(int worker_id, ImageTask& task);
+    bool popLocal(int worker_id, ImageTask& task);
+    bool steal(int worker_id, ImageTask& task);
+
+    std::vector<std::unique_ptr<WorkerQueue>> queues_;
+    std::atomic<uint64_t> next_queue_{ 0 };
+
+    // Idle workers park here; pushers only take sleep_mutex_ when
+    // somebody is actually asleep.
+    std::atomic<int> sleepers_{ 0 };
+    std::mutex sleep_mutex_;
+    std::condition_variable sleep_cv_;
+    std::atomic<bool> shutdown_{ false };
+};
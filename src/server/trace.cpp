@@ -0,0 +1,278 @@
+#include "trace.h"
+#include <algorithm>
+#include <cstdio>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace tracing {
+
+namespace detail {
+thread_local uint64_t current_trace = 0;
+}
+
+namespace {
+
+constexpr size_t kRingSize = 4096;      // spans kept per thread
+// Rings of exited threads are kept for the next dump, up to this many
+constexpr size_t kMaxOrphanedRings = 32;
+
+struct Event {
+    uint64_t trace_id;
+    uint64_t async_id;      // 0: a span on the thread's own track
+    const char* name;
+    const char* arg_name;   // may be null
+    int64_t arg;
+    int64_t start_us;
+    int64_t duration_us;
+};
+
+struct Ring {
+    std::mutex mutex;       // only ever contended by a dump
+    std::vector<Event> events = std::vector<Event>(kRingSize);
+    uint64_t next = 0;      // total recorded; the oldest are overwritten
+    uint32_t tid = 0;
+    std::string name;
+    std::atomic<bool> orphaned{ false };
+};
+
+struct Handle {
+    std::shared_ptr<Ring> ring;
+    ~Handle() {
+        if (ring) {
+            ring->orphaned.store(true);
+        }
+    }
+};
+
+// This thread's ring, created on its first span
+thread_local Handle t_handle;
+// Kept apart so naming a thread does not allocate a ring it may never use
+thread_local std::string t_name;
+
+class Registry {
+public:
+    // Never destroyed, so threads still tracing during static destruction
+    // find it intact.
+    static Registry& instance() {
+        static Registry* registry = new Registry();
+        return *registry;
+    }
+
+    int64_t micros(Clock::time_point time) const {
+        return std::chrono::duration_cast<std::chrono::microseconds>(time - epoch_).count();
+    }
+
+    Ring* threadRing() {
+        if (!t_handle.ring) {
+            t_handle.ring = std::make_shared<Ring>();
+            t_handle.ring->name = t_name;
+            std::lock_guard<std::mutex> lock(mutex_);
+            t_handle.ring->tid = next_tid_++;
+            rings_.push_back(t_handle.ring);
+            dropOldOrphansLocked();
+        }
+        return t_handle.ring.get();
+    }
+
+    std::vector<std::shared_ptr<Ring>> rings() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return rings_;
+    }
+
+    void dropOrphans() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        rings_.erase(std::remove_if(rings_.begin(), rings_.end(), [](const std::shared_ptr<Ring>& ring) {
+            return ring->orphaned.load();
+        }), rings_.end());
+    }
+
+    std::atomic<uint64_t> sample_threshold{ 0 };    // out of 2^64
+    std::atomic<uint64_t> next_trace_id{ 1 };
+
+private:
+    Registry() : epoch_(Clock::now()) {}
+
+    void dropOldOrphansLocked() {
+        size_t orphans = std::count_if(rings_.begin(), rings_.end(), [](const std::shared_ptr<Ring>& ring) {
+            return ring->orphaned.load();
+        });
+        for (auto it = rings_.begin(); orphans > kMaxOrphanedRings && it != rings_.end();) {
+            if ((*it)->orphaned.load()) {
+                it = rings_.erase(it);
+                --orphans;
+            }
+            else {
+                ++it;
+            }
+        }
+    }
+
+    const Clock::time_point epoch_;
+    std::mutex mutex_;
+    std::vector<std::shared_ptr<Ring>> rings_;
+    uint32_t next_tid_ = 1;
+};
+
+void push(const Event& event) {
+    Ring* ring = Registry::instance().threadRing();
+    std::lock_guard<std::mutex> lock(ring->mutex);
+    ring->events[ring->next % kRingSize] = event;
+    ++ring->next;
+}
+
+// Thread names are ours, but quote them properly anyway
+void appendString(std::string& out, const std::string& text) {
+    out += '"';
+    for (char c : text) {
+        if (c == '"' || c == '\\') {
+            out += '\\';
+            out += c;
+        }
+        else if (static_cast<unsigned char>(c) >= 0x20) {
+            out += c;
+        }
+    }
+    out += '"';
+}
+
+} // namespace
+
+void setSampleRate(double rate) {
+    uint64_t threshold = 0;
+    if (rate >= 1.0) {
+        threshold = UINT64_MAX;
+    }
+    else if (rate > 0.0) {
+        threshold = static_cast<uint64_t>(rate * 18446744073709551616.0);
+    }
+    Registry::instance().sample_threshold.store(threshold, std::memory_order_relaxed);
+}
+
+uint64_t sample() {
+    Registry& registry = Registry::instance();
+    const uint64_t threshold = registry.sample_threshold.load(std::memory_order_relaxed);
+    if (threshold == 0) {
+        return 0;
+    }
+    // xorshift64*, seeded per thread; good enough to pick requests
+    thread_local uint64_t state = (std::hash<std::thread::id>()(std::this_thread::get_id())
+        ^ static_cast<uint64_t>(Clock::now().time_since_epoch().count())) | 1;
+    state ^= state >> 12;
+    state ^= state << 25;
+    state ^= state >> 27;
+    if (state * 0x2545F4914F6CDD1DULL > threshold) {
+        return 0;
+    }
+    return registry.next_trace_id.fetch_add(1, std::memory_order_relaxed);
+}
+
+void record(uint64_t trace_id, const char* name, Clock::time_point start, Clock::time_point end,
+    const char* arg_name, int64_t arg) {
+    if (!trace_id) {
+        return;
+    }
+    const Registry& registry = Registry::instance();
+    const int64_t start_us = registry.micros(start);
+    push(Event{ trace_id, 0, name, arg_name, arg, start_us, registry.micros(end) - start_us });
+}
+
+void recordAsync(uint64_t trace_id, uint64_t id, const char* name, Clock::time_point start,
+    Clock::time_point end) {
+    if (!trace_id) {
+        return;
+    }
+    const Registry& registry = Registry::instance();
+    const int64_t start_us = registry.micros(start);
+    push(Event{ trace_id, id, name, nullptr, 0, start_us, registry.micros(end) - start_us });
+}
+
+void setThreadName(const std::string& name) {
+    t_name = name;
+    if (Ring* ring = t_handle.ring.get()) {
+        std::lock_guard<std::mutex> lock(ring->mutex);
+        ring->name = name;
+    }
+}
+
+std::string chromeTraceJson(bool clear, uint64_t* spans) {
+    Registry& registry = Registry::instance();
+    std::string out = "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[";
+    bool first = true;
+    uint64_t count = 0;
+    char buffer[512];
+
+    std::vector<Event> events;
+    for (const std::shared_ptr<Ring>& ring : registry.rings()) {
+        std::string name;
+        events.clear();
+        {
+            // Copied out so the owner is held up for as little as possible
+            std::lock_guard<std::mutex> lock(ring->mutex);
+            const uint64_t kept = std::min<uint64_t>(ring->next, kRingSize);
+            for (uint64_t i = ring->next - kept; i < ring->next; ++i) {
+                events.push_back(ring->events[i % kRingSize]);
+            }
+            if (clear) {
+                ring->next = 0;
+            }
+            name = ring->name.empty() ? "thread " + std::to_string(ring->tid) : ring->name;
+        }
+
+        if (!first) {
+            out += ',';
+        }
+        first = false;
+        std::snprintf(buffer, sizeof(buffer),
+            "{\"ph\":\"M\",\"pid\":1,\"tid\":%u,\"name\":\"thread_name\",\"args\":{\"name\":", ring->tid);
+        out += buffer;
+        appendString(out, name);
+        out += "}}";
+
+        for (const Event& event : events) {
+            int n = 0;
+            if (event.async_id) {
+                // Begin and end on a track of its own, keyed by id
+                n = std::snprintf(buffer, sizeof(buffer),
+                    ",{\"ph\":\"b\",\"pid\":1,\"tid\":%u,\"cat\":\"task\",\"name\":\"%s\",\"id\":\"0x%llx\","
+                    "\"ts\":%lld,\"args\":{\"trace\":%llu}}"
+                    ",{\"ph\":\"e\",\"pid\":1,\"tid\":%u,\"cat\":\"task\",\"name\":\"%s\",\"id\":\"0x%llx\","
+                    "\"ts\":%lld}",
+                    ring->tid, event.name, static_cast<unsigned long long>(event.async_id),
+                    static_cast<long long>(event.start_us), static_cast<unsigned long long>(event.trace_id),
+                    ring->tid, event.name, static_cast<unsigned long long>(event.async_id),
+                    static_cast<long long>(event.start_us + event.duration_us));
+            }
+            else if (event.arg_name) {
+                n = std::snprintf(buffer, sizeof(buffer),
+                    ",{\"ph\":\"X\",\"pid\":1,\"tid\":%u,\"cat\":\"ocr\",\"name\":\"%s\",\"ts\":%lld,\"dur\":%lld,"
+                    "\"args\":{\"trace\":%llu,\"%s\":%lld}}",
+                    ring->tid, event.name, static_cast<long long>(event.start_us),
+                    static_cast<long long>(event.duration_us), static_cast<unsigned long long>(event.trace_id),
+                    event.arg_name, static_cast<long long>(event.arg));
+            }
+            else {
+                n = std::snprintf(buffer, sizeof(buffer),
+                    ",{\"ph\":\"X\",\"pid\":1,\"tid\":%u,\"cat\":\"ocr\",\"name\":\"%s\",\"ts\":%lld,\"dur\":%lld,"
+                    "\"args\":{\"trace\":%llu}}",
+                    ring->tid, event.name, static_cast<long long>(event.start_us),
+                    static_cast<long long>(event.duration_us), static_cast<unsigned long long>(event.trace_id));
+            }
+            out.append(buffer, std::min<size_t>(static_cast<size_t>(std::max(n, 0)), sizeof(buffer) - 1));
+            ++count;
+        }
+    }
+    out += "]}";
+
+    if (clear) {
+        registry.dropOrphans();
+    }
+    if (spans) {
+        *spans = count;
+    }
+    return out;
+}
+
+} // namespace tracing
\ No newline at end of file
@@ -0,0 +1,97 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <string>
+
+// Per-request tracing, cheap enough to leave on in production.
+//
+// A sampled request gets a trace id; every span recorded under it goes into
+// a fixed-size ring owned by the recording thread, overwriting the oldest
+// span once full, so the buffer always holds the most recent activity.
+// Nothing is written out until chromeTraceJson() is asked for it; the
+// result loads in chrome://tracing and ui.perfetto.dev.
+//
+// Spans on a worker pick up the trace of the task it is running:
+//
+//     tracing::Scope scope(task.trace_id);
+//     ...
+//     tracing::Span span("pixReadMem");    // anywhere below, same thread
+//
+// Untraced requests have trace id 0, and a span under it costs a
+// thread-local read and a branch.
+namespace tracing {
+
+using Clock = std::chrono::steady_clock;
+
+// Fraction of requests to trace, 0 (off, the default) to 1.
+void setSampleRate(double rate);
+// A new trace id for a request, or 0 if this one is not sampled.
+uint64_t sample();
+
+namespace detail {
+extern thread_local uint64_t current_trace;
+}
+
+inline uint64_t current() { return detail::current_trace; }
+
+// Makes trace_id the current trace on this thread while in scope.
+class Scope {
+public:
+    explicit Scope(uint64_t trace_id) : previous_(detail::current_trace) { detail::current_trace = trace_id; }
+    ~Scope() { detail::current_trace = previous_; }
+
+    Scope(const Scope&) = delete;
+    Scope& operator=(const Scope&) = delete;
+
+private:
+    uint64_t previous_;
+};
+
+// name and arg_name must outlive the buffer, i.e. be string literals.
+void record(uint64_t trace_id, const char* name, Clock::time_point start, Clock::time_point end,
+    const char* arg_name = nullptr, int64_t arg = 0);
+// A span on a track of its own rather than the thread's: the life of a
+// task as it moves between threads, or time it spends waiting. Spans with
+// the same id share a track and nest by time.
+void recordAsync(uint64_t trace_id, uint64_t id, const char* name, Clock::time_point start,
+    Clock::time_point end);
+
+// Times its own lifetime; recorded only under a sampled trace.
+class Span {
+public:
+    explicit Span(const char* name, const char* arg_name = nullptr, int64_t arg = 0)
+        : Span(current(), name, arg_name, arg) {}
+    Span(uint64_t trace_id, const char* name, const char* arg_name = nullptr, int64_t arg = 0)
+        : trace_id_(trace_id), name_(name), arg_name_(arg_name), arg_(arg) {
+        if (trace_id_) {
+            start_ = Clock::now();
+        }
+    }
+    ~Span() {
+        if (trace_id_) {
+            record(trace_id_, name_, start_, Clock::now(), arg_name_, arg_);
+        }
+    }
+
+    Span(const Span&) = delete;
+    Span& operator=(const Span&) = delete;
+
+private:
+    uint64_t trace_id_;
+    const char* name_;
+    const char* arg_name_;
+    int64_t arg_;
+    Clock::time_point start_;
+};
+
+// Shown as the thread's name in the trace viewer.
+void setThreadName(const std::string& name);
+
+// Everything in the buffers as Chrome trace-event JSON. clear empties them
+// afterwards, so the next dump only holds what came later. *spans, if
+// given, is set to the number of spans written.
+std::string chromeTraceJson(bool clear, uint64_t* spans = nullptr);
+
+} // namespace tracing
\ No newline at end of file